@@ -41,6 +41,10 @@
  * #SpiceCursorChannel::cursor-move signals.
  */
 
+/* cursors that don't fit are dropped from the cache, the default
+ * cursor is shown if the server asks for them again */
+#define CURSOR_CACHE_MAX_BYTES (8 * 1024 * 1024)
+
 #define SPICE_CURSOR_CHANNEL_GET_PRIVATE(obj)                                  \
     (G_TYPE_INSTANCE_GET_PRIVATE((obj), SPICE_TYPE_CURSOR_CHANNEL, SpiceCursorChannelPrivate))
 
@@ -83,7 +87,8 @@ static void spice_cursor_channel_init(SpiceCursorChannel *channel)
 
     c = channel->priv = SPICE_CURSOR_CHANNEL_GET_PRIVATE(channel);
 
-    c->cursors = cache_new((GDestroyNotify)display_cursor_unref);
+    c->cursors = cache_new("cursors", (GDestroyNotify)display_cursor_unref);
+    cache_set_max_bytes(c->cursors, CURSOR_CACHE_MAX_BYTES);
 }
 
 static void spice_cursor_channel_finalize(GObject *obj)
@@ -317,7 +322,15 @@ static display_cursor *set_cursor(SpiceChannel *channel, SpiceCursor *scursor)
 
     if (scursor->flags & SPICE_CURSOR_FLAGS_FROM_CACHE) {
         cursor = cache_find(c->cursors, hdr->unique);
-        g_return_val_if_fail(cursor != NULL, NULL);
+        if (cursor == NULL) {
+            CHANNEL_DEBUG(channel, "%s: %" PRIx64 " was evicted, using the default cursor",
+                          __FUNCTION__, hdr->unique);
+            cursor = g_new0(display_cursor, 1);
+            cursor->hdr = *hdr;
+            cursor->default_cursor = TRUE;
+            cursor->refcount = 1;
+            return cursor;
+        }
         return display_cursor_ref(cursor);
     }
 
@@ -391,7 +404,8 @@ static display_cursor *set_cursor(SpiceChannel *channel, SpiceCursor *scursor)
 
 cache_add:
     if (scursor->flags & SPICE_CURSOR_FLAGS_CACHE_ME) {
-        cache_add(c->cursors, hdr->unique, display_cursor_ref(cursor));
+        cache_add(c->cursors, hdr->unique, display_cursor_ref(cursor),
+                  sizeof(*cursor) + 4u * hdr->width * hdr->height);
     }
 
     return cursor;
@@ -512,6 +526,16 @@ static void cursor_handle_inval_all(SpiceChannel *channel, SpiceMsgIn *in)
     cache_clear(c->cursors);
 }
 
+/* main context */
+static void cursor_stats_to_json(SpiceChannel *channel, GString *json)
+{
+    SpiceCursorChannelPrivate *c = SPICE_CURSOR_CHANNEL(channel)->priv;
+
+    g_string_append(json, ",\"caches\":{");
+    cache_stats_to_json(c->cursors, json);
+    g_string_append_c(json, '}');
+}
+
 static void channel_set_handlers(SpiceChannelClass *klass)
 {
     static const spice_msg_handler handlers[] = {
@@ -526,4 +550,5 @@ static void channel_set_handlers(SpiceChannelClass *klass)
     };
 
     spice_channel_set_handlers(klass, handlers, G_N_ELEMENTS(handlers));
+    klass->priv->stats_to_json = cursor_stats_to_json;
 }
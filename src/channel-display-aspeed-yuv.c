@@ -0,0 +1,332 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2010 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include <string.h>
+
+#include "channel-display-aspeed-yuv.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    G_BYTE_ORDER == G_LITTLE_ENDIAN
+#define USE_ASPEED_YUV_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) && G_BYTE_ORDER == G_LITTLE_ENDIAN
+#define USE_ASPEED_YUV_NEON 1
+#include <arm_neon.h>
+#endif
+
+/* The coefficients and rounding match the tables the scalar decoder used
+ * to build, every term is rounded on its own before being summed, so all
+ * implementations are bit-exact */
+#define FIX_G(d) ((int)((double)(d) * 65536 + 0.5))
+
+#define COEF_Y      FIX_G(1.1639999999999999)
+#define COEF_CR_R   FIX_G(1.597656)
+#define COEF_CB_B   FIX_G(2.015625)
+#define COEF_CR_G   (-FIX_G(0.8125))
+#define COEF_CB_G   (-FIX_G(0.390625))
+
+static inline int yuv_scale(int coef, int v)
+{
+    return (coef * v + 0x8000) >> 16;
+}
+
+static inline guint8 yuv_clamp(int v)
+{
+    return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+static void yuv_row_c(const guint8 *y, const guint8 *cb,
+                      const guint8 *cr, guint32 *dest)
+{
+    for (int k = 0; k < 8; k++) {
+        int Y = yuv_scale(COEF_Y, y[k] - 16);
+        int Cb = cb[k] - 128;
+        int Cr = cr[k] - 128;
+        guint8 b = yuv_clamp(Y + yuv_scale(COEF_CB_B, Cb));
+        guint8 g = yuv_clamp(Y + (yuv_scale(COEF_CB_G, Cb) + yuv_scale(COEF_CR_G, Cr)));
+        guint8 r = yuv_clamp(Y + yuv_scale(COEF_CR_R, Cr));
+
+        dest[k] = b | g << 8 | r << 16;
+    }
+}
+
+#ifdef USE_ASPEED_YUV_X86
+/* SSE2 has no 32-bit multiply keeping the low halves, build it from two
+ * 32x32->64 multiplies on the even and odd lanes */
+__attribute__((target("sse2")))
+static inline __m128i mullo_epi32_sse2(__m128i a, __m128i b)
+{
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                              _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+__attribute__((target("sse2")))
+static inline __m128i scale_sse2(__m128i v, int coef)
+{
+    __m128i p = mullo_epi32_sse2(v, _mm_set1_epi32(coef));
+
+    return _mm_srai_epi32(_mm_add_epi32(p, _mm_set1_epi32(0x8000)), 16);
+}
+
+/* packs 8 b, g, r 32-bit values with unsigned saturation into BGRX */
+__attribute__((target("sse2")))
+static inline void store_bgrx_sse2(__m128i b0, __m128i b1, __m128i g0, __m128i g1,
+                                   __m128i r0, __m128i r1, guint32 *dest)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i b = _mm_packus_epi16(_mm_packs_epi32(b0, b1), zero);
+    __m128i g = _mm_packus_epi16(_mm_packs_epi32(g0, g1), zero);
+    __m128i r = _mm_packus_epi16(_mm_packs_epi32(r0, r1), zero);
+    __m128i bg = _mm_unpacklo_epi8(b, g);
+    __m128i rx = _mm_unpacklo_epi8(r, zero);
+
+    _mm_storeu_si128((__m128i *)dest, _mm_unpacklo_epi16(bg, rx));
+    _mm_storeu_si128((__m128i *)(dest + 4), _mm_unpackhi_epi16(bg, rx));
+}
+
+__attribute__((target("sse2")))
+static inline void yuv_half_sse2(__m128i y, __m128i cb, __m128i cr,
+                                 __m128i *b, __m128i *g, __m128i *r)
+{
+    __m128i Y = scale_sse2(_mm_sub_epi32(y, _mm_set1_epi32(16)), COEF_Y);
+    __m128i Cb = _mm_sub_epi32(cb, _mm_set1_epi32(128));
+    __m128i Cr = _mm_sub_epi32(cr, _mm_set1_epi32(128));
+
+    *b = _mm_add_epi32(Y, scale_sse2(Cb, COEF_CB_B));
+    *g = _mm_add_epi32(Y, _mm_add_epi32(scale_sse2(Cb, COEF_CB_G),
+                                        scale_sse2(Cr, COEF_CR_G)));
+    *r = _mm_add_epi32(Y, scale_sse2(Cr, COEF_CR_R));
+}
+
+__attribute__((target("sse2")))
+static void yuv_row_sse2(const guint8 *y, const guint8 *cb,
+                         const guint8 *cr, guint32 *dest)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i y16 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)y), zero);
+    __m128i cb16 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)cb), zero);
+    __m128i cr16 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)cr), zero);
+    __m128i b0, b1, g0, g1, r0, r1;
+
+    yuv_half_sse2(_mm_unpacklo_epi16(y16, zero), _mm_unpacklo_epi16(cb16, zero),
+                  _mm_unpacklo_epi16(cr16, zero), &b0, &g0, &r0);
+    yuv_half_sse2(_mm_unpackhi_epi16(y16, zero), _mm_unpackhi_epi16(cb16, zero),
+                  _mm_unpackhi_epi16(cr16, zero), &b1, &g1, &r1);
+    store_bgrx_sse2(b0, b1, g0, g1, r0, r1, dest);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i scale_avx2(__m256i v, int coef)
+{
+    __m256i p = _mm256_mullo_epi32(v, _mm256_set1_epi32(coef));
+
+    return _mm256_srai_epi32(_mm256_add_epi32(p, _mm256_set1_epi32(0x8000)), 16);
+}
+
+__attribute__((target("avx2")))
+static void yuv_row_avx2(const guint8 *y, const guint8 *cb,
+                         const guint8 *cr, guint32 *dest)
+{
+    __m256i Y = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)y));
+    __m256i Cb = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)cb));
+    __m256i Cr = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)cr));
+    __m256i b, g, r;
+    __m128i zero = _mm_setzero_si128();
+    __m128i b8, g8, r8, bg, rx;
+
+    Y = scale_avx2(_mm256_sub_epi32(Y, _mm256_set1_epi32(16)), COEF_Y);
+    Cb = _mm256_sub_epi32(Cb, _mm256_set1_epi32(128));
+    Cr = _mm256_sub_epi32(Cr, _mm256_set1_epi32(128));
+
+    b = _mm256_add_epi32(Y, scale_avx2(Cb, COEF_CB_B));
+    g = _mm256_add_epi32(Y, _mm256_add_epi32(scale_avx2(Cb, COEF_CB_G),
+                                             scale_avx2(Cr, COEF_CR_G)));
+    r = _mm256_add_epi32(Y, scale_avx2(Cr, COEF_CR_R));
+
+    b8 = _mm_packus_epi16(_mm_packs_epi32(_mm256_castsi256_si128(b),
+                                          _mm256_extracti128_si256(b, 1)), zero);
+    g8 = _mm_packus_epi16(_mm_packs_epi32(_mm256_castsi256_si128(g),
+                                          _mm256_extracti128_si256(g, 1)), zero);
+    r8 = _mm_packus_epi16(_mm_packs_epi32(_mm256_castsi256_si128(r),
+                                          _mm256_extracti128_si256(r, 1)), zero);
+    bg = _mm_unpacklo_epi8(b8, g8);
+    rx = _mm_unpacklo_epi8(r8, zero);
+    _mm256_storeu_si256((__m256i *)dest,
+                        _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_unpacklo_epi16(bg, rx)),
+                                                _mm_unpackhi_epi16(bg, rx), 1));
+}
+#endif
+
+#ifdef USE_ASPEED_YUV_NEON
+static inline int32x4_t scale_neon(int32x4_t v, int coef)
+{
+    /* vrshrq rounds by adding 1 << 15 before shifting */
+    return vrshrq_n_s32(vmulq_n_s32(v, coef), 16);
+}
+
+static inline void yuv_half_neon(int32x4_t y, int32x4_t cb, int32x4_t cr,
+                                 int32x4_t *b, int32x4_t *g, int32x4_t *r)
+{
+    int32x4_t Y = scale_neon(vsubq_s32(y, vdupq_n_s32(16)), COEF_Y);
+    int32x4_t Cb = vsubq_s32(cb, vdupq_n_s32(128));
+    int32x4_t Cr = vsubq_s32(cr, vdupq_n_s32(128));
+
+    *b = vaddq_s32(Y, scale_neon(Cb, COEF_CB_B));
+    *g = vaddq_s32(Y, vaddq_s32(scale_neon(Cb, COEF_CB_G), scale_neon(Cr, COEF_CR_G)));
+    *r = vaddq_s32(Y, scale_neon(Cr, COEF_CR_R));
+}
+
+static void yuv_row_neon(const guint8 *y, const guint8 *cb,
+                         const guint8 *cr, guint32 *dest)
+{
+    int16x8_t y16 = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(y)));
+    int16x8_t cb16 = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(cb)));
+    int16x8_t cr16 = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(cr)));
+    int32x4_t b0, b1, g0, g1, r0, r1;
+    uint8x8x4_t bgrx;
+
+    yuv_half_neon(vmovl_s16(vget_low_s16(y16)), vmovl_s16(vget_low_s16(cb16)),
+                  vmovl_s16(vget_low_s16(cr16)), &b0, &g0, &r0);
+    yuv_half_neon(vmovl_s16(vget_high_s16(y16)), vmovl_s16(vget_high_s16(cb16)),
+                  vmovl_s16(vget_high_s16(cr16)), &b1, &g1, &r1);
+
+    bgrx.val[0] = vqmovun_s16(vcombine_s16(vqmovn_s32(b0), vqmovn_s32(b1)));
+    bgrx.val[1] = vqmovun_s16(vcombine_s16(vqmovn_s32(g0), vqmovn_s32(g1)));
+    bgrx.val[2] = vqmovun_s16(vcombine_s16(vqmovn_s32(r0), vqmovn_s32(r1)));
+    bgrx.val[3] = vdup_n_u8(0);
+    vst4_u8((uint8_t *)dest, bgrx);
+}
+#endif
+
+G_GNUC_INTERNAL
+AspeedYuvRowFunc aspeed_yuv_get_row_func(AspeedYuvImpl impl)
+{
+    switch (impl) {
+    case ASPEED_YUV_IMPL_C:
+        return yuv_row_c;
+#ifdef USE_ASPEED_YUV_X86
+    case ASPEED_YUV_IMPL_SSE2:
+        if (__builtin_cpu_supports("sse2"))
+            return yuv_row_sse2;
+        break;
+    case ASPEED_YUV_IMPL_AVX2:
+        if (__builtin_cpu_supports("avx2"))
+            return yuv_row_avx2;
+        break;
+#endif
+#ifdef USE_ASPEED_YUV_NEON
+    case ASPEED_YUV_IMPL_NEON:
+        return yuv_row_neon;
+#endif
+    default:
+        break;
+    }
+
+    return NULL;
+}
+
+G_GNUC_INTERNAL
+const gchar *aspeed_yuv_impl_to_string(AspeedYuvImpl impl)
+{
+    static const gchar *names[] = {
+        [ ASPEED_YUV_IMPL_C ] = "c",
+        [ ASPEED_YUV_IMPL_SSE2 ] = "sse2",
+        [ ASPEED_YUV_IMPL_AVX2 ] = "avx2",
+        [ ASPEED_YUV_IMPL_NEON ] = "neon",
+    };
+
+    g_return_val_if_fail(impl < ASPEED_YUV_IMPL_LAST, NULL);
+
+    return names[impl];
+}
+
+/* picks the fastest implementation the CPU supports, unless
+ * SPICE_ASPEED_YUV names another supported one */
+G_GNUC_INTERNAL
+AspeedYuvImpl aspeed_yuv_get_default_impl(void)
+{
+    const gchar *env = g_getenv("SPICE_ASPEED_YUV");
+    AspeedYuvImpl impl;
+
+    if (env != NULL) {
+        for (impl = ASPEED_YUV_IMPL_C; impl < ASPEED_YUV_IMPL_LAST; impl++) {
+            if (g_ascii_strcasecmp(env, aspeed_yuv_impl_to_string(impl)) == 0 &&
+                aspeed_yuv_get_row_func(impl) != NULL)
+                return impl;
+        }
+        g_warning("unsupported SPICE_ASPEED_YUV value '%s'", env);
+    }
+
+    for (impl = ASPEED_YUV_IMPL_LAST - 1; impl > ASPEED_YUV_IMPL_C; impl--) {
+        if (aspeed_yuv_get_row_func(impl) != NULL)
+            return impl;
+    }
+
+    return ASPEED_YUV_IMPL_C;
+}
+
+static inline void convert_row(AspeedYuvRowFunc row_func, const guint8 *y,
+                               const guint8 *cb, const guint8 *cr,
+                               guint32 *dest, int width)
+{
+    guint32 tmp[8];
+
+    if (width >= 8) {
+        row_func(y, cb, cr, dest);
+        return;
+    }
+
+    row_func(y, cb, cr, tmp);
+    memcpy(dest, tmp, width * sizeof(guint32));
+}
+
+G_GNUC_INTERNAL
+void aspeed_yuv_convert_tile(AspeedYuvRowFunc row_func, const guint8 *tile,
+                             gboolean mode420, guint32 *dest, int stride,
+                             int width, int height)
+{
+    if (!mode420) {
+        for (int r = 0; r < height; r++, dest += stride)
+            convert_row(row_func, tile + r * 8, tile + 64 + r * 8,
+                        tile + 128 + r * 8, dest, width);
+        return;
+    }
+
+    for (int r = 0; r < height; r++, dest += stride) {
+        const guint8 *y = tile + (r >> 3) * 128 + (r & 7) * 8;
+        const guint8 *cb = tile + 256 + (r >> 1) * 8;
+        const guint8 *cr = tile + 320 + (r >> 1) * 8;
+        guint8 cb2[16];
+        guint8 cr2[16];
+
+        for (int k = 0; k < 8; k++) {
+            cb2[2 * k] = cb2[2 * k + 1] = cb[k];
+            cr2[2 * k] = cr2[2 * k + 1] = cr[k];
+        }
+
+        convert_row(row_func, y, cb2, cr2, dest, width);
+        if (width > 8)
+            convert_row(row_func, y + 64, cb2 + 8, cr2 + 8, dest + 8, width - 8);
+    }
+}
@@ -0,0 +1,51 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2010 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef CHANNEL_DISPLAY_ASPEED_YUV_H_
+# define CHANNEL_DISPLAY_ASPEED_YUV_H_
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef enum {
+    ASPEED_YUV_IMPL_C,
+    ASPEED_YUV_IMPL_SSE2,
+    ASPEED_YUV_IMPL_AVX2,
+    ASPEED_YUV_IMPL_NEON,
+
+    ASPEED_YUV_IMPL_LAST
+} AspeedYuvImpl;
+
+/* converts 8 YCbCr pixels to BGRX */
+typedef void (*AspeedYuvRowFunc)(const guint8 *y, const guint8 *cb,
+                                 const guint8 *cr, guint32 *dest);
+
+AspeedYuvRowFunc aspeed_yuv_get_row_func(AspeedYuvImpl impl);
+AspeedYuvImpl aspeed_yuv_get_default_impl(void);
+const gchar *aspeed_yuv_impl_to_string(AspeedYuvImpl impl);
+
+/* tile is the decoder YUV tile layout: Y, Cb, Cr 8x8 blocks in 4:4:4
+ * mode, four Y blocks followed by Cb and Cr in 4:2:0 mode. dest points
+ * to the top-left pixel, stride is in pixels and may be negative */
+void aspeed_yuv_convert_tile(AspeedYuvRowFunc row_func, const guint8 *tile,
+                             gboolean mode420, guint32 *dest, int stride,
+                             int width, int height);
+
+G_END_DECLS
+
+#endif // CHANNEL_DISPLAY_ASPEED_YUV_H_
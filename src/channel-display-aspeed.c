@@ -22,6 +22,7 @@
 #include "spice-channel-priv.h"
 
 #include "channel-display-priv.h"
+#include "channel-display-aspeed-yuv.h"
 
 struct ASTHeader
 {
@@ -78,6 +79,34 @@ struct ASTHeader
     short cur_ypos;
 } __attribute__((packed));
 
+/* the compressed data starts on the first word after the header */
+#define AST_HEADER_SIZE 88
+
+enum {
+    AST_BLOCK_JPEG,
+    AST_BLOCK_JPEG_PASS2,
+    AST_BLOCK_VQ,
+};
+
+/* a macroblock that went through entropy decoding, the IDCT and colour
+ * conversion are done later, possibly on another thread */
+struct ast_block {
+    uint8_t type;
+    uint8_t sel;
+    int txb;
+    int tyb;
+    union {
+        short coef[384];   /* JPEG: dezigzagged DCT coefficients */
+        uint8_t yuv[192];  /* VQ: 4:4:4 YUV samples */
+    } data;
+};
+
+/* number of blocks entropy decoded before they are reconstructed */
+#define AST_BLOCK_BATCH 1024
+/* below this a batch is not worth dispatching to the thread pool */
+#define AST_MIN_PARALLEL_BLOCKS 64
+#define AST_MAX_SLICES 16
+
 struct HuffmanTable {
     int8_t Length[17];
     short minor_code[17];
@@ -102,11 +131,14 @@ struct ast_decoder {
     int selector;
     int advance_selector;
     int Mapping;
-    int32_t *buf;
+    /* bit reader: the stream is a sequence of little-endian 32-bit words
+     * read MSB first, m_bits holds the next m_newbits bits left-aligned */
+    const uint32_t *buf;
     uint32_t length;
-    uint32_t *m_decodeBuf;
-    int _index;
+    uint32_t _index;
+    uint64_t m_bits;
     int m_newbits;
+    uint32_t *m_decodeBuf;
     int txb;
     int tyb;
     struct {
@@ -116,24 +148,38 @@ struct ast_decoder {
     } m_VQ;
     struct HuffmanTable m_HTDC[4];
     struct HuffmanTable m_HTAC[4];
-    int32_t YUVTile[768];
     int8_t  Y[64];
     int8_t  Cb[64];
     int8_t  Cr[64];
     int8_t  rangeLimitTable[1408];
-    int32_t calculatedRGBofY[256];
-    int32_t calculatedRGBofCrToR[256];
-    int32_t calculatedRGBofCbToB[256];
-    int32_t calculatedRGBofCrToG[256];
-    int32_t calculatedRGBofCbToG[256];
-    int32_t *YValueInTile;
-    int32_t YValueInTile420[4][64];
-    int32_t CbValueInTile[64];
-    int32_t CrValueInTile[64];
+
+    /* converts 8 YCbCr samples of a tile row to BGRX */
+    AspeedYuvRowFunc yuvRow;
 
     int64_t m_QT[4][64];
 
-//    int32_t previousYUVData[0x753000];
+    short DCY;
+    short DCCb;
+    short DCCr;
+
+    /* YUV samples of every tile of the previous frame, in tile order,
+     * refined in place by JPEG pass 2 blocks */
+    uint8_t *previousYUVData;
+    size_t previousYUVDataSize;
+
+    /* tiles written by the current frame */
+    uint8_t *dirtyTiles;
+
+    /* blocks of the current batch, see reconstructBlocks() */
+    struct ast_block *blocks;
+    int nblocks;
+    GAsyncQueue *slicesDone;
+
+    /* dimensions of the persistent output frame */
+    int frameWidth;
+    int frameHeight;
+    int tilesPerRow;
+    int tilesPerColumn;
 };
 
 #include <byteswap.h>
@@ -142,37 +188,6 @@ struct ast_decoder {
 #define WORD_hi_lo(byte0, byte1) (GET_SHORT(byte0) << 8 | GET_SHORT(byte1))
 #define GET_INT(i) ((int)(i & 0xffff))
 
-#if 0
-#define GET_LONG(x) (x)
-#else
-static int64_t GET_LONG(int32_t x) {
-//    printf("-- %x\n", x);
-    return x & 0xffffffffL;
-}
-#endif
-
-#define FIX_G(d) (int)((double)d * 65536 + 0.5)
-
-static void initColorTable(struct ast_decoder *dec)
-{
-    int l = 0x10000;
-    int i1 = l >> 1;
-    int i = 0;
-    for (int j = -128; i < 256; j++) {
-        dec->calculatedRGBofCrToR[i] = (FIX_G(1.597656) * j + i1) >> 16;
-        dec->calculatedRGBofCbToB[i] = (FIX_G(2.015625) * j + i1) >> 16;
-        dec->calculatedRGBofCrToG[i] = (-FIX_G(0.8125) * j + i1) >> 16;
-        dec->calculatedRGBofCbToG[i] = (-FIX_G(0.390625) * j + i1) >> 16;
-        i++;
-    }
-
-    i = 0;
-    for (int k = -16; i < 256; k++) {
-        dec->calculatedRGBofY[i] = (FIX_G(1.1639999999999999) * k + i1) >> 16;
-        i++;
-    }
-}
-
 static void initRangeLimitTable(struct ast_decoder *dec)
 {
     memset(dec->rangeLimitTable, 0, 255);
@@ -237,6 +252,9 @@ static void loadHuffmanTable(struct HuffmanTable *huffmantable, int8_t *abyte0,
             huffmantable->Len[k] = (int8_t)(ai[i + 1] & 0xff);
         }
     }
+    /* the all-ones prefix is not a valid code, give it the longest length
+     * so that lookups on corrupted data stay within the tables */
+    huffmantable->Len[65535] = huffmantable->Len[65534];
 }
 
 static void initHuffmanTable(struct ast_decoder *dec)
@@ -259,157 +277,63 @@ static void initHuffmanTable(struct ast_decoder *dec)
                      AC_CHROMINANCE_HUFFMANCODE);
 }
 
-void convertYUVtoRGB(struct ast_decoder *dec, int i, int j)
+static uint8_t *previousTile(struct ast_decoder *dec, int i, int j)
 {
-    uint8_t r;
-    uint8_t g;
-    uint8_t b;
-    int32_t end = dec->RealWIDTH * dec->RealHEIGHT;
-        if(dec->m_Mode420 == 0)
-        {
-            dec->YValueInTile = dec->YUVTile;
-            for(int k = 0; k < 64; k++)
-            {
-                dec->CbValueInTile[k] = dec->YUVTile[64 + k];
-                dec->CrValueInTile[k] = dec->YUVTile[128 + k];
-            }
+    int tileSize = dec->m_Mode420 ? 384 : 192;
 
-            int k5 = i * 8;
-            int i6 = j * 8;
-            int k2 = i6 * dec->RealWIDTH + k5;
-            int j8 = dec->RealWIDTH - k5;
-            if(j8 == 0 || j8 > 8)
-                j8 = 8;
-            for(int k1 = 0; k1 < 8; k1++)
-            {
-                for(int l = 0; l < j8; l++)
-                {
-                    int i3 = (k1 << 3) + l;
-                    int k3 = (k2 + l) * 3;
-                    int i4 = dec->YValueInTile[i3];
-                    int k4 = dec->CbValueInTile[i3];
-                    int i5 = dec->CrValueInTile[i3];
-//                    dec->previousYUVData[k3] = i4;
-//                    dec->previousYUVData[k3 + 1] = k4;
-//                    dec->previousYUVData[k3 + 2] = i5;
-                    int l6 = dec->calculatedRGBofY[i4] + dec->calculatedRGBofCbToB[k4];
-                    int j7 = dec->calculatedRGBofY[i4] + (dec->calculatedRGBofCbToG[k4] + dec->calculatedRGBofCrToG[i5]);
-                    int l7 = dec->calculatedRGBofY[i4] + dec->calculatedRGBofCrToR[i5];
-                    if(l6 >= 0)
-                        l6 += 256;
-                    else
-                        l6 = 0;
-                    if(j7 >= 0)
-                        j7 += 256;
-                    else
-                        j7 = 0;
-                    if(l7 >= 0)
-                        l7 += 256;
-                    else
-                        l7 = 0;
-                    if(k3 < dec->RealWIDTH * dec->RealHEIGHT * 3)
-                    {
-                        b = dec->rangeLimitTable[l6];
-                        g = dec->rangeLimitTable[j7];
-                        r = dec->rangeLimitTable[l7];
-                        dec->m_decodeBuf[end-(i6 + k1)*dec->RealWIDTH + k5 + l] = b | g << 8 | r << 16;
-                        //printf("444 k3=%d %d %d, %d %d %d  %08X\n", k3, k5 + l, i6 + k1, r, g, b, dec->m_decodeBuf[end-(i6 + k1)*dec->RealWIDTH + k5 + l]);
-                    }
-                }
-
-                k2 += dec->RealWIDTH;
-            }
+    if (dec->previousYUVData == NULL ||
+        i >= dec->tilesPerRow || j >= dec->tilesPerColumn)
+        return NULL;
 
-        } else
-        {
-            int k6 = 0;
-            for(int i1 = 0; i1 < 4; i1++)
-            {
-                for(int l1 = 0; l1 < 64; l1++)
-                {
-                    dec->YValueInTile420[i1][l1] = dec->YUVTile[k6];
-                    k6++;
-                }
+    return dec->previousYUVData + (j * dec->tilesPerRow + i) * tileSize;
+}
 
-            }
+static void storePreviousTile(struct ast_decoder *dec, const uint8_t *tile, int i, int j)
+{
+    uint8_t *prev = previousTile(dec, i, j);
+    int tileSize = dec->m_Mode420 ? 384 : 192;
 
-            for(int i2 = 0; i2 < 64; i2++)
-            {
-                dec->CbValueInTile[i2] = dec->YUVTile[k6];
-                dec->CrValueInTile[i2] = dec->YUVTile[k6 + 64];
-                k6++;
-            }
+    if (prev == NULL)
+        return;
 
-            int l5 = i * 16;
-            int j6 = j * 16;
-            int l2 = j6 * dec->WIDTH + l5;
-            int l8 = 0;
-            int i9 = 0;
-            int j9 = 0;
-            int k9 = 0;
-            int8_t byte1 = 16;
-            if(dec->HEIGHT == 608 && j == 37)
-                byte1 = 8;
-            for(int j2 = 0; j2 < byte1; j2++)
-            {
-                int i10 = (j2 >> 3) * 2;
-                int j10 = (j2 >> 1) << 3;
-                for(int j1 = 0; j1 < 16; j1++)
-                {
-                    int l9 = i10 + (j1 >> 3);
-                    int k8;
-                    switch(l9)
-                    {
-                    case 0: // '\0'
-                        k8 = l8++;
-                        break;
-
-                    case 1: // '\001'
-                        k8 = i9++;
-                        break;
-
-                    case 2: // '\002'
-                        k8 = j9++;
-                        break;
-
-                    default:
-                        k8 = k9++;
-                        break;
-                    }
-//                    int l3 = (l2 + j1) * 3;
-                    int j3 = j10 + (j1 >> 1);
-                    int j4 = dec->YValueInTile420[l9][k8];
-                    int l4 = dec->CbValueInTile[j3];
-                    int j5 = dec->CrValueInTile[j3];
-                    int B = dec->calculatedRGBofY[j4] + dec->calculatedRGBofCbToB[l4];
-                    int G = dec->calculatedRGBofY[j4] + (dec->calculatedRGBofCbToG[l4] + dec->calculatedRGBofCrToG[j5]);
-                    int R = dec->calculatedRGBofY[j4] + dec->calculatedRGBofCrToR[j5];
-                    if(B >= 0)
-                        b = dec->rangeLimitTable[B + 256];
-                    else
-                        b = 0;
-                    if(G >= 0)
-                        g = dec->rangeLimitTable[G + 256];
-                    else
-                        g = 0;
-                    if(R >= 0)
-                        r = dec->rangeLimitTable[R + 256];
-                    else
-                        r = 0;
-                    dec->m_decodeBuf[end-(j6 + j2)*dec->RealWIDTH + l5 + j1] = b | g << 8 | r << 16;
-//                    printf("420 %d %d, %d %d %d  %08X\n", l5 + j1, j6 + j2, b, g, r, dec->m_decodeBuf[(j6 + j2)*dec->RealWIDTH + l5 + j1]);
-                }
-
-                l2 += dec->RealWIDTH;
-            }
-        }
+    for (int k = 0; k < tileSize; k++)
+        prev[k] = tile[k];
+}
+
+static void markDirtyTile(struct ast_decoder *dec, int i, int j)
+{
+    if (dec->dirtyTiles == NULL ||
+        i >= dec->tilesPerRow || j >= dec->tilesPerColumn)
+        return;
+
+    dec->dirtyTiles[j * dec->tilesPerRow + i] = 1;
+}
+
+static void convertYUVtoRGB(struct ast_decoder *dec, const uint8_t *tile, int i, int j)
+{
+    int blockSize = dec->m_Mode420 ? 16 : 8;
+    int x = i * blockSize;
+    int y = j * blockSize;
+    int width = MIN(dec->RealWIDTH - x, blockSize);
+    int height = MIN(dec->RealHEIGHT - y, blockSize);
+
+    storePreviousTile(dec, tile, i, j);
+    markDirtyTile(dec, i, j);
+
+    if (width <= 0 || height <= 0)
+        return;
+
+    /* the frame is stored bottom-up */
+    aspeed_yuv_convert_tile(dec->yuvRow, tile, dec->m_Mode420,
+                            dec->m_decodeBuf + (dec->RealHEIGHT - 1 - y) * dec->RealWIDTH + x,
+                            -dec->RealWIDTH, width, height);
 }
 
 static void setQuantizationTable(int8_t *abyte0, int8_t byte0, int8_t *abyte1)
 {
     for(int8_t byte1 = 0; byte1 < 64; byte1++)
     {
-        int i = (abyte0[byte1] * 16) / byte0;
+        int i = (GET_SHORT(abyte0[byte1]) * 16) / byte0;
         if (i <= 0)
             i = 1;
         if (i > 255)
@@ -751,42 +675,53 @@ void loadPass2ChrominanceQuantizationTable(struct ast_decoder *dec, int64_t *al)
 }
 
 
-static void updateReadBuf(struct ast_decoder *dec, int i)
+/* keeps at least 33 bits in the window, past the end of the stream the
+ * window is filled with zeros and bitReaderOverrun() becomes true */
+static inline void refillBits(struct ast_decoder *dec)
 {
-    int64_t uprdbuf_readbuf;
-//    printf("--> updateReadBuf(%d)\n", i);
-    if (dec->m_newbits - i <= 0) {
-        uprdbuf_readbuf = GET_LONG(dec->buf[dec->_index]);
+    while (dec->m_newbits <= 32) {
+        uint32_t word = 0;
+
+        if (dec->_index < dec->length)
+            word = GUINT32_FROM_LE(dec->buf[dec->_index]);
         dec->_index++;
-        dec->buf[0] = (int32_t)(GET_LONG(dec->buf[0]) << i) | (int32_t)((GET_LONG(dec->buf[1]) | uprdbuf_readbuf >> dec->m_newbits) >> (32 - i));
-        dec->buf[1] = (int32_t)(uprdbuf_readbuf << (i - dec->m_newbits));
-        dec->m_newbits += 32 - i;
-    } else {
-        dec->buf[0] = (int32_t)(GET_LONG(dec->buf[0]) << i) | (int32_t)(GET_LONG(dec->buf[1]) >> (32 - i));
-        dec->buf[1] = (int32_t)(GET_LONG(dec->buf[1]) << i);
-        dec->m_newbits -= i;
+        dec->m_bits |= (uint64_t)word << (32 - dec->m_newbits);
+        dec->m_newbits += 32;
     }
 }
 
-static short lookKbits(struct ast_decoder *dec, uint8_t byte0)
+static void initBitReader(struct ast_decoder *dec, const uint32_t *buf, uint32_t length)
 {
-    return (short)(GET_LONG(dec->buf[0]) >> (32 - byte0));
+    dec->buf = buf;
+    dec->length = length;
+    dec->_index = 0;
+    dec->m_bits = 0;
+    dec->m_newbits = 0;
+    refillBits(dec);
 }
 
-static void skipKbits(struct ast_decoder *dec, uint8_t byte0)
+static inline uint64_t bitReaderPosition(struct ast_decoder *dec)
 {
-    if (dec->m_newbits - byte0 <= 0) {
-        if (dec->_index > dec->length - 1)
-            dec->_index = dec->length - 1;
-        dec->buf[0] = (int32_t)(GET_LONG(dec->buf[0]) << byte0) | (int32_t)((GET_LONG(dec->buf[1]) | GET_LONG(dec->buf[dec->_index]) >> dec->m_newbits) >> (32 - byte0));
-        dec->buf[1] = (int32_t)(GET_LONG(dec->buf[dec->_index]) << (byte0 - dec->m_newbits));
-        dec->m_newbits += 32 - byte0;
-        dec->_index++;
-    } else {
-        dec->buf[0] = (dec->buf[0] << byte0) | (int32_t)(GET_LONG(dec->buf[1]) >> (32 - byte0));
-        dec->buf[1] = (dec->buf[1] << byte0);
-        dec->m_newbits -= byte0;
-    }
+    return (uint64_t)dec->_index * 32 - dec->m_newbits;
+}
+
+static inline gboolean bitReaderOverrun(struct ast_decoder *dec)
+{
+    return bitReaderPosition(dec) > (uint64_t)dec->length * 32;
+}
+
+/* 1 <= byte0 <= 32 */
+static inline uint32_t lookKbits(struct ast_decoder *dec, uint8_t byte0)
+{
+    return (uint32_t)(dec->m_bits >> (64 - byte0));
+}
+
+/* byte0 <= 32 */
+static inline void skipKbits(struct ast_decoder *dec, uint8_t byte0)
+{
+    dec->m_bits <<= byte0;
+    dec->m_newbits -= byte0;
+    refillBits(dec);
 }
 
 static void moveBlockIndex(struct ast_decoder *dec)
@@ -819,73 +754,545 @@ static void moveBlockIndex(struct ast_decoder *dec)
 }
 
 
-static void decompressVQ(struct ast_decoder *dec, int i, int j, char byte0)
+static void reconstructBlocks(struct ast_decoder *dec);
+
+static struct ast_block *newBlock(struct ast_decoder *dec, int type, int sel)
 {
-    int k = 0;
-//    printf("--> decompressVQ(%d, %d, %d)\n", i, j, byte0);
-    if (dec->m_VQ.BitMapBits == 0) {
-        for (int l = 0; l < 64; l++) {
-            dec->YUVTile[k + 0] = (dec->m_VQ.Color[dec->m_VQ.Index[0]] & 0xff0000L) >> 16;
-            dec->YUVTile[k + 64] = (dec->m_VQ.Color[dec->m_VQ.Index[0]] & 65280L) >> 8;
-            dec->YUVTile[k + 128] = (dec->m_VQ.Color[dec->m_VQ.Index[0]] & 255L);
-            k++;
-        }
+    struct ast_block *block;
+
+    if (dec->nblocks == AST_BLOCK_BATCH)
+        reconstructBlocks(dec);
+
+    block = &dec->blocks[dec->nblocks++];
+    block->type = type;
+    block->sel = sel;
+    block->txb = dec->txb;
+    block->tyb = dec->tyb;
+
+    return block;
+}
+
+/* the bitmap of a VQ tile carries one BitMapBits wide colour index per
+ * pixel, they are decoded 32 bits at a time */
+static void decompressVQ(struct ast_decoder *dec)
+{
+    uint8_t *yuv = newBlock(dec, AST_BLOCK_VQ, 0)->data.yuv;
+    int bits = dec->m_VQ.BitMapBits;
+    uint8_t y[4], cb[4], cr[4];
+
+    for (int n = 0; n < 4; n++) {
+        int32_t color = dec->m_VQ.Color[dec->m_VQ.Index[n]];
+
+        y[n] = (color >> 16) & 0xff;
+        cb[n] = (color >> 8) & 0xff;
+        cr[n] = color & 0xff;
+    }
+
+    if (bits == 0) {
+        memset(yuv, y[0], 64);
+        memset(yuv + 64, cb[0], 64);
+        memset(yuv + 128, cr[0], 64);
     } else {
-        for (int i1 = 0; i1 < 64; i1++) {
-            short word0 = lookKbits(dec, dec->m_VQ.BitMapBits);
-            dec->YUVTile[k + 0] = (dec->m_VQ.Color[dec->m_VQ.Index[word0]] & 0xff0000L) >> 16;
-            dec->YUVTile[k + 64] = (dec->m_VQ.Color[dec->m_VQ.Index[word0]] & 65280L) >> 8;
-            dec->YUVTile[k + 128] = (dec->m_VQ.Color[dec->m_VQ.Index[word0]] & 255L);
-            k++;
-            skipKbits(dec, dec->m_VQ.BitMapBits);
+        uint32_t mask = (1 << bits) - 1;
+        int k = 0;
+
+        while (k < 64) {
+            uint32_t word = lookKbits(dec, 32);
+
+            skipKbits(dec, 32);
+            for (int shift = 32 - bits; shift >= 0; shift -= bits, k++) {
+                uint32_t index = (word >> shift) & mask;
+
+                yuv[k] = y[index];
+                yuv[k + 64] = cb[index];
+                yuv[k + 128] = cr[index];
+            }
         }
     }
+}
 
-    convertYUVtoRGB(dec, i, j);
+/* a VQ block header updates count colour cache entries, each either
+ * refers to a cached colour or carries a new YCbCr value */
+static void readVQHeader(struct ast_decoder *dec, int bitMapBits, int count)
+{
+    dec->m_VQ.BitMapBits = bitMapBits;
+    for (int n = 0; n < count; n++) {
+        uint32_t word = lookKbits(dec, 32);
+
+        dec->m_VQ.Index[n] = (word >> 29) & 3;
+        if ((word >> 31) == 0) {
+            skipKbits(dec, 3);
+        } else {
+            dec->m_VQ.Color[dec->m_VQ.Index[n]] = (word >> 5) & 0xffffff;
+            skipKbits(dec, 27);
+        }
+    }
 }
 
-G_GNUC_INTERNAL
-void stream_aspeed_init(display_stream *st)
+static short getKbits(struct ast_decoder *dec, uint8_t byte0)
+{
+    short word0 = lookKbits(dec, byte0);
+
+    /* JPEG magnitude categories: a clear top bit means a negative value */
+    if ((word0 & (1 << (byte0 - 1))) == 0)
+        word0 -= (1 << byte0) - 1;
+    skipKbits(dec, byte0);
+
+    return word0;
+}
+
+static gboolean decodeHuffmanCode(struct ast_decoder *dec,
+                                  struct HuffmanTable *huffmantable,
+                                  uint8_t *value)
+{
+    uint8_t len = huffmantable->Len[lookKbits(dec, 16)];
+    uint32_t code;
+    int index;
+
+    if (len == 0 || len > 16)
+        return FALSE;
+
+    code = lookKbits(dec, len);
+    skipKbits(dec, len);
+    index = code - huffmantable->minor_code[len];
+    *value = huffmantable->V[GET_INT(WORD_hi_lo(len, index))];
+
+    return TRUE;
+}
+
+/* Huffman decode one 8x8 data unit into dezigzagged DCT coefficients */
+static gboolean processHuffmanDataUnit(struct ast_decoder *dec, int DC_nr, int AC_nr,
+                                       short *previous_DC, short *coef)
+{
+    uint8_t size_val;
+    uint8_t count_0;
+    uint8_t value;
+    int k;
+
+    memset(coef, 0, 64 * sizeof(short));
+
+    if (!decodeHuffmanCode(dec, &dec->m_HTDC[DC_nr], &size_val))
+        return FALSE;
+    if (size_val > 11)
+        return FALSE;
+    if (size_val != 0)
+        *previous_DC += getKbits(dec, size_val);
+    coef[0] = *previous_DC;
+
+    k = 1;
+    while (k < 64) {
+        if (!decodeHuffmanCode(dec, &dec->m_HTAC[AC_nr], &value))
+            return FALSE;
+
+        size_val = value & 0xf;
+        count_0 = value >> 4;
+        if (size_val == 0) {
+            if (count_0 != 0xf)
+                break; /* EOB */
+            k += 16;
+        } else {
+            k += count_0;
+            if (k > 63)
+                return FALSE;
+            coef[dezigzag[k++]] = getKbits(dec, size_val);
+        }
+    }
+
+    return TRUE;
+}
+
+#define FIX_1_082392200  277
+#define FIX_1_414213562  362
+#define FIX_1_847759065  473
+#define FIX_2_613125930  669
+
+#define MULTIPLY(var, c) (((var) * (c)) >> 8)
+#define DEQUANTIZE(coef, quantval) ((int)(((int64_t)(coef) * (quantval)) >> 16))
+
+/* AAN fast integer IDCT, the quantization tables already carry the AAN
+ * scale factors (see loadLuminanceQuantizationTable()) */
+static void idctTransform(struct ast_decoder *dec, const short *coef, uint8_t *data, int sel)
+{
+    const int64_t *quantptr = dec->m_QT[sel];
+    const uint8_t *range_limit = (const uint8_t *)dec->rangeLimitTable + 384;
+    int workspace[64];
+    int tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7;
+    int tmp10, tmp11, tmp12, tmp13;
+    int z5, z10, z11, z12, z13;
+
+    for (int ctr = 0; ctr < 8; ctr++) {
+        const short *inptr = coef + ctr;
+        const int64_t *q = quantptr + ctr;
+        int *wsptr = workspace + ctr;
+
+        if ((inptr[8] | inptr[16] | inptr[24] | inptr[32] |
+             inptr[40] | inptr[48] | inptr[56]) == 0) {
+            int dcval = DEQUANTIZE(inptr[0], q[0]);
+
+            for (int row = 0; row < 64; row += 8)
+                wsptr[row] = dcval;
+            continue;
+        }
+
+        /* even part */
+        tmp0 = DEQUANTIZE(inptr[0], q[0]);
+        tmp1 = DEQUANTIZE(inptr[16], q[16]);
+        tmp2 = DEQUANTIZE(inptr[32], q[32]);
+        tmp3 = DEQUANTIZE(inptr[48], q[48]);
+
+        tmp10 = tmp0 + tmp2;
+        tmp11 = tmp0 - tmp2;
+        tmp13 = tmp1 + tmp3;
+        tmp12 = MULTIPLY(tmp1 - tmp3, FIX_1_414213562) - tmp13;
+
+        tmp0 = tmp10 + tmp13;
+        tmp3 = tmp10 - tmp13;
+        tmp1 = tmp11 + tmp12;
+        tmp2 = tmp11 - tmp12;
+
+        /* odd part */
+        tmp4 = DEQUANTIZE(inptr[8], q[8]);
+        tmp5 = DEQUANTIZE(inptr[24], q[24]);
+        tmp6 = DEQUANTIZE(inptr[40], q[40]);
+        tmp7 = DEQUANTIZE(inptr[56], q[56]);
+
+        z13 = tmp6 + tmp5;
+        z10 = tmp6 - tmp5;
+        z11 = tmp4 + tmp7;
+        z12 = tmp4 - tmp7;
+
+        tmp7 = z11 + z13;
+        tmp11 = MULTIPLY(z11 - z13, FIX_1_414213562);
+        z5 = MULTIPLY(z10 + z12, FIX_1_847759065);
+        tmp10 = MULTIPLY(z12, FIX_1_082392200) - z5;
+        tmp12 = MULTIPLY(z10, -FIX_2_613125930) + z5;
+
+        tmp6 = tmp12 - tmp7;
+        tmp5 = tmp11 - tmp6;
+        tmp4 = tmp10 + tmp5;
+
+        wsptr[0] = tmp0 + tmp7;
+        wsptr[56] = tmp0 - tmp7;
+        wsptr[8] = tmp1 + tmp6;
+        wsptr[48] = tmp1 - tmp6;
+        wsptr[16] = tmp2 + tmp5;
+        wsptr[40] = tmp2 - tmp5;
+        wsptr[32] = tmp3 + tmp4;
+        wsptr[24] = tmp3 - tmp4;
+    }
+
+    for (int ctr = 0; ctr < 8; ctr++) {
+        const int *wsptr = workspace + ctr * 8;
+        uint8_t *outptr = data + ctr * 8;
+
+        /* even part */
+        tmp10 = wsptr[0] + wsptr[4];
+        tmp11 = wsptr[0] - wsptr[4];
+        tmp13 = wsptr[2] + wsptr[6];
+        tmp12 = MULTIPLY(wsptr[2] - wsptr[6], FIX_1_414213562) - tmp13;
+
+        tmp0 = tmp10 + tmp13;
+        tmp3 = tmp10 - tmp13;
+        tmp1 = tmp11 + tmp12;
+        tmp2 = tmp11 - tmp12;
+
+        /* odd part */
+        z13 = wsptr[5] + wsptr[3];
+        z10 = wsptr[5] - wsptr[3];
+        z11 = wsptr[1] + wsptr[7];
+        z12 = wsptr[1] - wsptr[7];
+
+        tmp7 = z11 + z13;
+        tmp11 = MULTIPLY(z11 - z13, FIX_1_414213562);
+        z5 = MULTIPLY(z10 + z12, FIX_1_847759065);
+        tmp10 = MULTIPLY(z12, FIX_1_082392200) - z5;
+        tmp12 = MULTIPLY(z10, -FIX_2_613125930) + z5;
+
+        tmp6 = tmp12 - tmp7;
+        tmp5 = tmp11 - tmp6;
+        tmp4 = tmp10 + tmp5;
+
+        /* descale by 8 and level shift by 128 through the range table */
+        outptr[0] = range_limit[((tmp0 + tmp7) >> 3) & 1023];
+        outptr[7] = range_limit[((tmp0 - tmp7) >> 3) & 1023];
+        outptr[1] = range_limit[((tmp1 + tmp6) >> 3) & 1023];
+        outptr[6] = range_limit[((tmp1 - tmp6) >> 3) & 1023];
+        outptr[2] = range_limit[((tmp2 + tmp5) >> 3) & 1023];
+        outptr[5] = range_limit[((tmp2 - tmp5) >> 3) & 1023];
+        outptr[4] = range_limit[((tmp3 + tmp4) >> 3) & 1023];
+        outptr[3] = range_limit[((tmp3 - tmp4) >> 3) & 1023];
+    }
+}
+
+/* entropy decode the Y, Cb and Cr data units of one macroblock */
+static gboolean decompressJPEG(struct ast_decoder *dec, int type, int sel)
+{
+    struct ast_block *block = newBlock(dec, type, sel);
+    int yBlocks = dec->m_Mode420 ? 4 : 1;
+    short *coef = block->data.coef;
+
+    for (int k = 0; k < yBlocks; k++, coef += 64) {
+        if (!processHuffmanDataUnit(dec, 0, 0, &dec->DCY, coef))
+            goto error;
+    }
+    if (!processHuffmanDataUnit(dec, 1, 1, &dec->DCCb, coef) ||
+        !processHuffmanDataUnit(dec, 1, 1, &dec->DCCr, coef + 64))
+        goto error;
+
+    return TRUE;
+
+error:
+    dec->nblocks--;
+    return FALSE;
+}
+
+static void reconstructBlock(struct ast_decoder *dec, const struct ast_block *block,
+                             uint8_t *tile)
+{
+    int yBlocks = dec->m_Mode420 ? 4 : 1;
+    int tileSize = (yBlocks + 2) * 64;
+    const uint8_t *prev;
+
+    if (block->type == AST_BLOCK_VQ) {
+        memcpy(tile, block->data.yuv, sizeof(block->data.yuv));
+        convertYUVtoRGB(dec, tile, block->txb, block->tyb);
+        return;
+    }
+
+    for (int k = 0; k < yBlocks; k++)
+        idctTransform(dec, block->data.coef + k * 64, tile + k * 64, block->sel);
+    for (int k = yBlocks; k < yBlocks + 2; k++)
+        idctTransform(dec, block->data.coef + k * 64, tile + k * 64, block->sel + 1);
+
+    /* pass 2 blocks carry a residual (biased by 128) that refines the tile
+     * decoded at the same position in the previous frame */
+    if (block->type == AST_BLOCK_JPEG_PASS2 &&
+        (prev = previousTile(dec, block->txb, block->tyb)) != NULL) {
+        for (int k = 0; k < tileSize; k++)
+            tile[k] = CLAMP(prev[k] + tile[k] - 128, 0, 255);
+    }
+
+    convertYUVtoRGB(dec, tile, block->txb, block->tyb);
+}
+
+/* Entropy decoding has to be sequential: the DC predictors and the VQ
+ * colour cache carry over from block to block, and where a block ends is
+ * only known once it is Huffman decoded. Reconstruction of a block only
+ * touches its own tile, so a batch is reconstructed in slices of tile
+ * rows, blocks at the same position stay in the same slice and keep
+ * their order. */
+struct ast_slice {
+    struct ast_decoder *dec;
+    int index;
+    int count;
+};
+
+static void reconstructSlice(struct ast_slice *slice)
+{
+    struct ast_decoder *dec = slice->dec;
+    uint8_t tile[384];
+
+    for (int n = 0; n < dec->nblocks; n++) {
+        const struct ast_block *block = &dec->blocks[n];
+
+        if (block->tyb % slice->count == slice->index)
+            reconstructBlock(dec, block, tile);
+    }
+}
+
+static void reconstructWorker(gpointer data, gpointer user_data G_GNUC_UNUSED)
+{
+    struct ast_slice *slice = data;
+
+    reconstructSlice(slice);
+    g_async_queue_push(slice->dec->slicesDone, slice);
+}
+
+/* shared by all streams, the decoding thread reconstructs a slice too */
+static GThreadPool *getReconstructPool(int *threads)
+{
+    static gsize initialized;
+    static GThreadPool *pool;
+    static int poolThreads;
+
+    if (g_once_init_enter(&initialized)) {
+#if GLIB_CHECK_VERSION(2,36,0)
+        poolThreads = MIN(g_get_num_processors(), AST_MAX_SLICES) - 1;
+#else
+        poolThreads = 0;
+#endif
+        if (poolThreads > 0) {
+            GError *err = NULL;
+
+            pool = g_thread_pool_new(reconstructWorker, NULL, poolThreads, FALSE, &err);
+            if (pool == NULL) {
+                g_warning("aspeed: failed to create decoder threads: %s", err->message);
+                g_clear_error(&err);
+                poolThreads = 0;
+            }
+        }
+        g_once_init_leave(&initialized, 1);
+    }
+
+    *threads = poolThreads;
+    return pool;
+}
+
+static void reconstructBlocks(struct ast_decoder *dec)
+{
+    struct ast_slice slices[AST_MAX_SLICES];
+    GThreadPool *pool = NULL;
+    int threads = 0;
+
+    if (dec->nblocks >= AST_MIN_PARALLEL_BLOCKS)
+        pool = getReconstructPool(&threads);
+
+    for (int n = 0; n <= threads; n++) {
+        slices[n].dec = dec;
+        slices[n].index = n;
+        slices[n].count = threads + 1;
+        if (n > 0)
+            g_thread_pool_push(pool, &slices[n], NULL);
+    }
+
+    reconstructSlice(&slices[0]);
+    for (int n = 0; n < threads; n++)
+        g_async_queue_pop(dec->slicesDone);
+
+    dec->nblocks = 0;
+}
+
+static void allocPreviousYUVData(struct ast_decoder *dec)
+{
+    int tileSize = dec->m_Mode420 ? 384 : 192;
+    int blockSize = dec->m_Mode420 ? 16 : 8;
+    size_t size;
+
+    dec->tilesPerRow = dec->WIDTH / blockSize;
+    dec->tilesPerColumn = dec->HEIGHT / blockSize;
+    size = (size_t)dec->tilesPerRow * dec->tilesPerColumn * tileSize;
+
+    if (size != dec->previousYUVDataSize) {
+        g_free(dec->previousYUVData);
+        dec->previousYUVData = g_malloc0(size);
+        dec->previousYUVDataSize = size;
+
+        g_free(dec->dirtyTiles);
+        dec->dirtyTiles = g_malloc0(dec->tilesPerRow * dec->tilesPerColumn);
+    } else {
+        memset(dec->dirtyTiles, 0, dec->tilesPerRow * dec->tilesPerColumn);
+    }
+}
+
+/* turn the tiles touched by the frame into st->dirty, merging horizontal
+ * runs of tiles so the region stays small */
+static void updateDirtyRegion(display_stream *st)
+{
+    struct ast_decoder *dec = st->dec;
+    int blockSize = dec->m_Mode420 ? 16 : 8;
+
+    for (int j = 0; j < dec->tilesPerColumn; j++) {
+        uint8_t *row = dec->dirtyTiles + j * dec->tilesPerRow;
+        int i = 0;
+
+        while (i < dec->tilesPerRow) {
+            SpiceRect rect;
+            int first;
+
+            if (!row[i]) {
+                i++;
+                continue;
+            }
+            first = i;
+            while (i < dec->tilesPerRow && row[i])
+                i++;
+
+            /* st->dirty is in out_frame memory rows, which are bottom-up */
+            rect.left = first * blockSize;
+            rect.right = MIN(i * blockSize, dec->RealWIDTH);
+            rect.top = MAX(dec->RealHEIGHT - (j + 1) * blockSize, 0);
+            rect.bottom = dec->RealHEIGHT - j * blockSize;
+            if (rect.bottom > rect.top && rect.right > rect.left)
+                region_add(&st->dirty, &rect);
+        }
+    }
+}
+
+static gboolean stream_aspeed_init(display_stream *st)
 {
     st->dec = calloc(sizeof(struct ast_decoder), 1);
 
-    initColorTable(st->dec);
     initRangeLimitTable(st->dec);
+    st->dec->yuvRow = aspeed_yuv_get_row_func(aspeed_yuv_get_default_impl());
     initHuffmanTable(st->dec);
+    st->dec->blocks = g_new(struct ast_block, AST_BLOCK_BATCH);
+    st->dec->slicesDone = g_async_queue_new();
+
+    return TRUE;
 }
 
-G_GNUC_INTERNAL
-void stream_aspeed_data(display_stream *st)
+/* ASPEED frames only carry the macroblocks that changed since the previous
+ * frame, so the output surface is kept across frames and only reallocated
+ * when the stream dimensions change */
+static void allocFrame(display_stream *st, int width, int height)
+{
+    struct ast_decoder *dec = st->dec;
+
+    SpiceRect rect;
+
+    if (st->out_frame != NULL &&
+        dec->frameWidth == width && dec->frameHeight == height)
+        return;
+
+    g_free(st->out_frame);
+    st->out_frame = g_malloc0(width * height * 4);
+    dec->frameWidth = width;
+    dec->frameHeight = height;
+
+    rect.left = rect.top = 0;
+    rect.right = width;
+    rect.bottom = height;
+    region_add(&st->dirty, &rect);
+}
+
+static void stream_aspeed_data(display_stream *st)
 {
     int width;
     int height;
-    uint8_t *dest;
     size_t len;
-    int j;
+    uint8_t *data;
+    uint32_t comp_size;
     struct ASTHeader *hdr;
     struct ast_decoder *dec = st->dec;
 
     stream_get_dimensions(st, &width, &height);
-    dest = g_malloc0(width * height * 4 * 3);
-
-    g_free(st->out_frame);
-    st->out_frame = dest;
-
-    len = stream_get_current_frame(st, (void *)&dec->buf);
-    if (len < 86) return;
-
-    hdr = (struct ASTHeader *)dec->buf;
-    printf("### decode_frame(%zd): %dx%d (%dx%d)\n", len, width, height, hdr->src_mode_x, hdr->src_mode_y);
-    dec->buf += 88 >> 2;
+    region_clear(&st->dirty);
+    st->have_dirty = TRUE;
+    allocFrame(st, width, height);
+
+    len = stream_get_current_frame(st, &data);
+    if (len < AST_HEADER_SIZE) return;
+
+    hdr = (struct ASTHeader *)data;
+    SPICE_DEBUG("aspeed frame (%zd): %dx%d (%dx%d)", len, width, height, hdr->src_mode_x, hdr->src_mode_y);
+    if (hdr->src_mode_x != width || hdr->src_mode_y != height) {
+        SPICE_DEBUG("aspeed: frame size %dx%d does not match stream size %dx%d, skipping",
+                    hdr->src_mode_x, hdr->src_mode_y, width, height);
+        return;
+    }
 
-    j = hdr->comp_size >> 2;
+    comp_size = hdr->comp_size;
+    if (comp_size > len - AST_HEADER_SIZE) {
+        SPICE_DEBUG("aspeed: compressed size %u exceeds frame data %zd, truncating",
+                    comp_size, len - AST_HEADER_SIZE);
+        comp_size = len - AST_HEADER_SIZE;
+    }
+    initBitReader(dec, (const uint32_t *)(data + AST_HEADER_SIZE), comp_size >> 2);
 
     dec->m_decodeBuf = (void *)st->out_frame;
-    dec->length = j;
-    dec->_index = 2;
-    dec->m_newbits = 32;
     dec->txb = dec->tyb = 0;
     dec->byte_pos = 0;
+    dec->DCY = dec->DCCb = dec->DCCr = 0;
     dec->selector = hdr->jpeg_table;
     dec->advance_selector = hdr->adv_table;
     dec->Mapping = hdr->jpeg_yuv;
@@ -932,185 +1339,99 @@ void stream_aspeed_data(display_stream *st)
             dec->tmp_HEIGHTBy16 = (dec->tmp_HEIGHTBy16 + 8) - dec->tmp_HEIGHTBy16 % 8;
     }
 
+    allocPreviousYUVData(dec);
+
     loadLuminanceQuantizationTable(dec, dec->m_QT[0]);
     loadChrominanceQuantizationTable(dec, dec->m_QT[1]);
     loadPass2LuminanceQuantizationTable(dec, dec->m_QT[2]);
     loadPass2ChrominanceQuantizationTable(dec, dec->m_QT[3]);
 
-    int k = 0;
-    do {
-        switch ((GET_LONG(dec->buf[0]) >> 28) & 15L) {
+    while (bitReaderPosition(dec) < (uint64_t)dec->length * 32) {
+        uint32_t type = lookKbits(dec, 4);
+        gboolean ok = TRUE;
+
+        if (type == 9)
+            break; /* end of frame */
+
+        /* types 8 and above carry the position of the block */
+        if (type & 8) {
+            uint32_t word = lookKbits(dec, 32);
+
+            dec->txb = (word >> 20) & 0xff;
+            dec->tyb = (word >> 12) & 0xff;
+            skipKbits(dec, 20);
+        } else {
+            skipKbits(dec, 4);
+        }
+
+        switch (type & 7) {
         case 0:
-            updateReadBuf(dec, 4);
-            //decompressJPEG(dec, dec->txb, dec->tyb, 0);
-            moveBlockIndex(dec);
-            break;
-        case 8:
-            dec->txb = (int32_t)((GET_LONG(dec->buf[0]) & 0xff00000L) >> 20);
-            dec->tyb = (int32_t)((GET_LONG(dec->buf[0]) & 0xff000L) >> 12);
-            updateReadBuf(dec, 20);
-            // decompressJPEG(dec, dec->txb, dec->tyb, 0);
-            moveBlockIndex(dec);
+            ok = decompressJPEG(dec, AST_BLOCK_JPEG, 0);
             break;
         case 2:
-            updateReadBuf(dec, 4);
-            // decompressJPEGPass2(dec, dec->txb, dec->tyb, 2);
-            moveBlockIndex(dec);
+            ok = decompressJPEG(dec, AST_BLOCK_JPEG_PASS2, 2);
             break;
-        case 10:
-            dec->txb = (int32_t)((GET_LONG(dec->buf[0]) & 0xff00000L) >> 20);
-            dec->tyb = (int32_t)((GET_LONG(dec->buf[0]) & 0xff000L) >> 12);
-            updateReadBuf(dec, 20);
-            // decompressJPEGPass2(dec, dec->txb, dec->tyb, 2);
-            moveBlockIndex(dec);
+        case 4:
+            ok = decompressJPEG(dec, AST_BLOCK_JPEG, 2);
             break;
         case 5:
-            updateReadBuf(dec, 4);
-            dec->m_VQ.BitMapBits = 0;
-            for (int i1 = 0; i1 < 1; i1++) {
-                dec->m_VQ.Index[i1] = (GET_LONG(dec->buf[0]) >> 29) & 3L;
-                if (((GET_LONG(dec->buf[0]) >> 31) & 1L) == 0) {
-                    updateReadBuf(dec, 3);
-                } else {
-                    dec->m_VQ.Color[dec->m_VQ.Index[i1]] = (GET_LONG(dec->buf[0]) >> 5) & 0xffffff;
-                    updateReadBuf(dec, 27);
-                }
-
-                decompressVQ(dec, dec->txb, dec->tyb, 0);
-                moveBlockIndex(dec);
-            }
-            break;
-        case 13:
-            dec->txb = (int32_t)((GET_LONG(dec->buf[0]) & 0xff00000L) >> 20);
-            dec->tyb = (int32_t)((GET_LONG(dec->buf[0]) & 0xff000L) >> 12);
-            updateReadBuf(dec, 20);
-            dec->m_VQ.BitMapBits = 0;
-            for(int j1 = 0; j1 < 1; j1++)
-            {
-                dec->m_VQ.Index[j1] = (int32_t)((GET_LONG(dec->buf[0]) >> 29) & 3L);
-                if(((GET_LONG(dec->buf[0]) >> 31) & 1L) == 0L)
-                {
-                    updateReadBuf(dec, 3);
-                } else
-                {
-                    dec->m_VQ.Color[dec->m_VQ.Index[j1]] = (GET_LONG(dec->buf[0]) >> 5) & 0xffffffL;
-                    updateReadBuf(dec, 27);
-                }
-            }
-
-            decompressVQ(dec, dec->txb, dec->tyb, 0);
-            moveBlockIndex(dec);
+            readVQHeader(dec, 0, 1);
+            decompressVQ(dec);
             break;
         case 6:
-            updateReadBuf(dec, 4);
-            dec->m_VQ.BitMapBits = 1;
-            for(int k1 = 0; k1 < 2; k1++)
-            {
-                dec->m_VQ.Index[k1] = (int32_t)((GET_LONG(dec->buf[0]) >> 29) & 3L);
-                if(((GET_LONG(dec->buf[0]) >> 31) & 1L) == 0L)
-                {
-                    updateReadBuf(dec, 3);
-                } else
-                {
-                    dec->m_VQ.Color[dec->m_VQ.Index[k1]] = (GET_LONG(dec->buf[0]) >> 5) & 0xffffffL;
-                    updateReadBuf(dec, 27);
-                }
-            }
-            decompressVQ(dec, dec->txb, dec->tyb, 0);
-            moveBlockIndex(dec);
-            break;
-        case 14:
-            dec->txb = (int32_t)((GET_LONG(dec->buf[0]) & 0xff00000L) >> 20);
-            dec->tyb = (int32_t)((GET_LONG(dec->buf[0]) & 0xff000L) >> 12);
-            updateReadBuf(dec, 20);
-            dec->m_VQ.BitMapBits = 1;
-            for(int l1 = 0; l1 < 2; l1++)
-            {
-                dec->m_VQ.Index[l1] = (int32_t)((GET_LONG(dec->buf[0]) >> 29) & 3L);
-                if(((GET_LONG(dec->buf[0]) >> 31) & 1L) == 0L)
-                {
-                    updateReadBuf(dec, 3);
-                } else
-                {
-                    dec->m_VQ.Color[dec->m_VQ.Index[l1]] = (GET_LONG(dec->buf[0]) >> 5) & 0xffffffL;
-                    updateReadBuf(dec, 27);
-                }
-            }
-
-            decompressVQ(dec, dec->txb, dec->tyb, 0);
-            moveBlockIndex(dec);
+            readVQHeader(dec, 1, 2);
+            decompressVQ(dec);
             break;
         case 7:
-            updateReadBuf(dec, 4);
-            dec->m_VQ.BitMapBits = 2;
-            for(int i2 = 0; i2 < 4; i2++)
-            {
-                dec->m_VQ.Index[i2] = (int32_t)((GET_LONG(dec->buf[0]) >> 29) & 3L);
-                if(((GET_LONG(dec->buf[0]) >> 31) & 1L) == 0L)
-                {
-                    updateReadBuf(dec, 3);
-                } else
-                {
-                    dec->m_VQ.Color[dec->m_VQ.Index[i2]] = (GET_LONG(dec->buf[0]) >> 5) & 0xffffffL;
-                    updateReadBuf(dec, 27);
-                }
-            }
-
-            decompressVQ(dec, dec->txb, dec->tyb, 0);
-            moveBlockIndex(dec);
-            break;
-        case 15:
-            dec->txb = (int32_t)((GET_LONG(dec->buf[0]) & 0xff00000L) >> 20);
-            dec->tyb = (int32_t)((GET_LONG(dec->buf[0]) & 0xff000L) >> 12);
-            updateReadBuf(dec, 20);
-            dec->m_VQ.BitMapBits = 2;
-            for(int j2 = 0; j2 < 4; j2++)
-            {
-                dec->m_VQ.Index[j2] = (int32_t)((GET_LONG(dec->buf[0]) >> 29) & 3L);
-                if(((GET_LONG(dec->buf[0]) >> 31) & 1L) == 0L)
-                {
-                    updateReadBuf(dec, 3);
-                } else
-                {
-                    dec->m_VQ.Color[dec->m_VQ.Index[j2]] = (GET_LONG(dec->buf[0]) >> 5) & 0xffffffL;
-                    updateReadBuf(dec, 27);
-                }
-            }
-
-            decompressVQ(dec, dec->txb, dec->tyb, 0);
-            moveBlockIndex(dec);
-            break;
-        case 4:
-            updateReadBuf(dec, 4);
-            // decompressJPEG(dec, dec->txb, dec->tyb, 2);
-            moveBlockIndex(dec);
+            readVQHeader(dec, 2, 4);
+            decompressVQ(dec);
             break;
-        case 12:
-            dec->txb = (int32_t)((GET_LONG(dec->buf[0]) & 0xff00000L) >> 20);
-            dec->tyb = (int32_t)((GET_LONG(dec->buf[0]) & 0xff000L) >> 12);
-            updateReadBuf(dec, 20);
-            // decompressJPEG(dec, dec->txb, dec->tyb, 2);
-            moveBlockIndex(dec);
-            break;
-        case 9:
-            if(((GET_LONG(dec->buf[0]) >> 28) & 15L) == 9L)
-                goto done;
-            fprintf(stderr, "Unknow Marco Block type %08lx\n", GET_LONG(dec->buf[0]) >> 28);
-            moveBlockIndex(dec);
+        default:
+            SPICE_DEBUG("aspeed: unknown block type %u", type);
+            ok = FALSE;
             break;
         }
-        // m_view.repaint((txb - 1) * 16, tyb * 16, 16, 16);
-        k++;
-//        if (k == 5) exit(1);
-    } while (dec->_index < j);
+
+        if (!ok || bitReaderOverrun(dec))
+            goto corrupted;
+        moveBlockIndex(dec);
+    }
+
+    goto done;
+
+corrupted:
+    SPICE_DEBUG("aspeed: invalid block at %d,%d", dec->txb, dec->tyb);
 
 done:
-    return;
+    reconstructBlocks(dec);
+    updateDirtyRegion(st);
 }
 
-G_GNUC_INTERNAL
-void stream_aspeed_cleanup(display_stream *st)
+static void stream_aspeed_cleanup(display_stream *st)
 {
+    struct ast_decoder *dec = st->dec;
+
+    if (dec != NULL) {
+        g_free(dec->previousYUVData);
+        g_free(dec->dirtyTiles);
+        g_free(dec->blocks);
+        g_async_queue_unref(dec->slicesDone);
+        free(dec);
+        st->dec = NULL;
+    }
+
     g_free(st->out_frame);
     st->out_frame = NULL;
 }
+
+G_GNUC_INTERNAL
+const stream_codec stream_aspeed_codec = {
+    .type = SPICE_VIDEO_CODEC_TYPE_ASPEED,
+    .cap = SPICE_DISPLAY_CAP_CODEC_ASPEED,
+    /* frames only carry the macroblocks that changed */
+    .decode_dropped = TRUE,
+    .keep_frame = TRUE,
+    .init = stream_aspeed_init,
+    .decode = stream_aspeed_data,
+    .cleanup = stream_aspeed_cleanup,
+};
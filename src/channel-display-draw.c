@@ -0,0 +1,260 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2010 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include <string.h>
+
+#include "spice-client.h"
+#include "spice-common.h"
+#include "spice-channel-priv.h"
+
+#include "channel-display-priv.h"
+
+/*
+ * Draws to off-screen surfaces that only read other surfaces don't need
+ * the caches or the decoders, they run on worker threads. A draw job
+ * depends on the previous job of each surface it writes or reads, so
+ * the draws to a surface stay in order, and the coroutine waits for the
+ * jobs of a surface before it touches it itself.
+ *
+ * The jobs are created and freed in the main context, where the message
+ * refcounts are safe to use.
+ */
+
+/* submitting waits for the oldest job beyond that */
+#define DRAW_MAX_PENDING 64
+
+typedef struct draw_job draw_job;
+
+struct draw_job {
+    display_surface             *surface;
+    display_surface             *sources[DRAW_MAX_SOURCES];
+    guint                       nsources;
+    display_draw_func           func;
+    SpiceMsgIn                  *in;
+
+    /* protected by draw_lock */
+    guint                       pending;
+    GSList                      *dependents;
+    gboolean                    done;
+};
+
+static GMutex draw_lock;
+static GCond draw_cond;
+/* the job the worker thread runs, for display_draw_get_source() */
+static GPrivate draw_current;
+/* all the jobs not freed yet, in submission order, main context */
+static GQueue draw_jobs = G_QUEUE_INIT;
+
+static void draw_job_run(gpointer data, gpointer user_data);
+
+static GThreadPool *draw_get_pool(void)
+{
+    static gsize initialized = 0;
+    static GThreadPool *pool = NULL;
+
+    if (g_once_init_enter(&initialized)) {
+        int threads = 0;
+
+#if GLIB_CHECK_VERSION(2,36,0)
+        threads = g_get_num_processors() - 1;
+#endif
+        if (g_getenv("SPICE_DISABLE_DRAW_THREADS"))
+            threads = 0;
+
+        if (threads > 0) {
+            GError *err = NULL;
+
+            pool = g_thread_pool_new(draw_job_run, NULL, threads, FALSE, &err);
+            if (pool == NULL) {
+                g_warning("failed to create draw threads: %s", err->message);
+                g_clear_error(&err);
+            }
+        }
+        g_once_init_leave(&initialized, 1);
+    }
+
+    return pool;
+}
+
+/* worker thread */
+static void draw_job_run(gpointer data, gpointer user_data)
+{
+    draw_job *job = data;
+    GSList *l;
+
+    g_private_set(&draw_current, job);
+    job->func(job->surface, spice_msg_in_parsed(job->in));
+    g_private_set(&draw_current, NULL);
+
+    g_mutex_lock(&draw_lock);
+    job->done = TRUE;
+    for (l = job->dependents; l != NULL; l = l->next) {
+        draw_job *dependent = l->data;
+
+        if (--dependent->pending == 0)
+            g_thread_pool_push(draw_get_pool(), dependent, NULL);
+    }
+    g_cond_broadcast(&draw_cond);
+    g_mutex_unlock(&draw_lock);
+}
+
+/* main context, frees the jobs that are done from the oldest on */
+static void draw_reap(void)
+{
+    draw_job *job;
+
+    g_mutex_lock(&draw_lock);
+    while ((job = g_queue_peek_head(&draw_jobs)) != NULL && job->done) {
+        guint i;
+
+        g_queue_pop_head(&draw_jobs);
+        if (job->surface != NULL && job->surface->last_draw == job)
+            job->surface->last_draw = NULL;
+        for (i = 0; i < job->nsources; i++) {
+            if (job->sources[i] != NULL && job->sources[i]->last_draw == job)
+                job->sources[i]->last_draw = NULL;
+        }
+        g_slist_free(job->dependents);
+        spice_msg_in_unref(job->in);
+        g_slice_free(draw_job, job);
+    }
+    g_mutex_unlock(&draw_lock);
+}
+
+/* called with draw_lock held */
+static void draw_job_depend(draw_job *job, display_surface *surface)
+{
+    draw_job *last = surface->last_draw;
+
+    if (last != NULL && last != job && !last->done &&
+        g_slist_find(last->dependents, job) == NULL) {
+        last->dependents = g_slist_prepend(last->dependents, job);
+        job->pending++;
+    }
+    surface->last_draw = job;
+}
+
+static void draw_job_wait(draw_job *job)
+{
+    g_mutex_lock(&draw_lock);
+    while (!job->done)
+        g_cond_wait(&draw_cond, &draw_lock);
+    g_mutex_unlock(&draw_lock);
+}
+
+/* coroutine context, returns FALSE when the draw has to run inline */
+G_GNUC_INTERNAL
+gboolean display_draw_submit(display_surface *surface,
+                             display_surface **sources, guint nsources,
+                             display_draw_func func, SpiceMsgIn *in)
+{
+    GThreadPool *pool = draw_get_pool();
+    draw_job *job;
+    guint i;
+
+    g_return_val_if_fail(nsources <= DRAW_MAX_SOURCES, FALSE);
+
+    if (pool == NULL)
+        return FALSE;
+
+    draw_reap();
+    if (g_queue_get_length(&draw_jobs) >= DRAW_MAX_PENDING) {
+        draw_job_wait(g_queue_peek_head(&draw_jobs));
+        draw_reap();
+    }
+
+    job = g_slice_new0(draw_job);
+    job->surface = surface;
+    memcpy(job->sources, sources, nsources * sizeof(*sources));
+    job->nsources = nsources;
+    job->func = func;
+    job->in = in;
+    spice_msg_in_ref(in);
+
+    g_mutex_lock(&draw_lock);
+    draw_job_depend(job, surface);
+    for (i = 0; i < nsources; i++)
+        draw_job_depend(job, sources[i]);
+    g_queue_push_tail(&draw_jobs, job);
+    if (job->pending == 0)
+        g_thread_pool_push(pool, job, NULL);
+    g_mutex_unlock(&draw_lock);
+
+    return TRUE;
+}
+
+/* main or coroutine context, waits until the draws that use surface are
+ * done; the previous jobs of a surface are done when its last one is */
+G_GNUC_INTERNAL
+void display_surface_wait(display_surface *surface)
+{
+    if (surface->last_draw == NULL)
+        return;
+
+    draw_job_wait(surface->last_draw);
+    draw_reap();
+}
+
+/* main or coroutine context, surface is about to be freed */
+G_GNUC_INTERNAL
+void display_surface_release_draws(display_surface *surface)
+{
+    GList *l;
+    guint i;
+
+    display_surface_wait(surface);
+
+    /* done, but behind jobs that are not */
+    for (l = draw_jobs.head; l != NULL; l = l->next) {
+        draw_job *job = l->data;
+
+        if (job->surface == surface)
+            job->surface = NULL;
+        for (i = 0; i < job->nsources; i++) {
+            if (job->sources[i] == surface)
+                job->sources[i] = NULL;
+        }
+    }
+    surface->last_draw = NULL;
+}
+
+/* worker thread: the canvas of a surface of the running job,
+ * returns FALSE when not called from a draw job */
+G_GNUC_INTERNAL
+gboolean display_draw_get_source(guint32 surface_id, SpiceCanvas **canvas)
+{
+    draw_job *job = g_private_get(&draw_current);
+    guint i;
+
+    if (job == NULL)
+        return FALSE;
+
+    *canvas = NULL;
+    if (job->surface->surface_id == surface_id)
+        *canvas = job->surface->canvas;
+    for (i = 0; i < job->nsources; i++) {
+        if (job->sources[i]->surface_id == surface_id) {
+            *canvas = job->sources[i]->canvas;
+            break;
+        }
+    }
+    g_warn_if_fail(*canvas != NULL);
+
+    return TRUE;
+}
@@ -0,0 +1,347 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2010 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include <string.h>
+#include <gst/gst.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/app/gstappsink.h>
+#include <gst/video/video.h>
+
+#include "spice-client.h"
+#include "spice-common.h"
+#include "spice-channel-priv.h"
+
+#include "channel-display-priv.h"
+
+/* how long the decoder thread waits for the picture of a frame, and,
+ * once one was missed, for any picture */
+#define GST_DECODE_TIMEOUT (100 * GST_MSECOND)
+#define GST_LAG_TIMEOUT (10 * GST_MSECOND)
+/* the time between the timestamps of two frames, only their order
+ * matters */
+#define GST_FRAME_DURATION GST_MSECOND
+
+typedef struct gst_codec_info {
+    int                         type;
+    const gchar                 *caps;
+    /* optional */
+    const gchar                 *parser;
+    const gchar                 *decoder;
+} gst_codec_info;
+
+/* software decoders only, so that streams work the same everywhere */
+static const gst_codec_info gst_codecs[] = {
+    { SPICE_VIDEO_CODEC_TYPE_VP8, "video/x-vp8", NULL, "vp8dec" },
+    { SPICE_VIDEO_CODEC_TYPE_H264,
+      "video/x-h264,stream-format=byte-stream,alignment=au",
+      "h264parse", "avdec_h264" },
+};
+
+struct gst_decoder {
+    GstElement                  *pipeline;
+    GstAppSrc                   *appsrc;
+    GstAppSink                  *appsink;
+    /* the timestamp of the next frame, pictures are matched to frames
+     * by timestamp */
+    GstClockTime                next_pts;
+    /* the picture of the previous frame was missed, the pictures come
+     * after their frames */
+    gboolean                    lagging;
+};
+
+static const gst_codec_info *gst_find_codec(int type)
+{
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS(gst_codecs); i++) {
+        if (gst_codecs[i].type == type)
+            return &gst_codecs[i];
+    }
+
+    return NULL;
+}
+
+static gboolean gst_has_element(const gchar *name)
+{
+    GstElementFactory *factory;
+
+    if (name == NULL)
+        return TRUE;
+
+    factory = gst_element_factory_find(name);
+    if (factory == NULL)
+        return FALSE;
+
+    gst_object_unref(factory);
+    return TRUE;
+}
+
+static gboolean stream_gst_available(const stream_codec *codec)
+{
+    const gst_codec_info *info = gst_find_codec(codec->type);
+
+    g_return_val_if_fail(info != NULL, FALSE);
+
+    if (!gst_init_check(NULL, NULL, NULL))
+        return FALSE;
+
+    return gst_has_element(info->parser) && gst_has_element(info->decoder);
+}
+
+static void gst_decoder_free(struct gst_decoder *dec)
+{
+    if (dec->pipeline != NULL) {
+        gst_element_set_state(dec->pipeline, GST_STATE_NULL);
+        gst_object_unref(dec->pipeline);
+    }
+    if (dec->appsrc != NULL)
+        gst_object_unref(dec->appsrc);
+    if (dec->appsink != NULL)
+        gst_object_unref(dec->appsink);
+    g_free(dec);
+}
+
+/* frame threading delays each picture by a frame per thread, the
+ * pictures have to come out as the frames go in */
+static void gst_decoder_set_low_latency(GstElement *decoder)
+{
+    GObjectClass *klass = G_OBJECT_GET_CLASS(decoder);
+
+    if (g_object_class_find_property(klass, "thread-type") != NULL)
+        gst_util_set_object_arg(G_OBJECT(decoder), "thread-type", "slice");
+    else if (g_object_class_find_property(klass, "max-threads") != NULL)
+        g_object_set(decoder, "max-threads", 1, NULL);
+}
+
+static gboolean stream_gst_init(display_stream *st)
+{
+    const gst_codec_info *info = gst_find_codec(st->codec);
+    struct gst_decoder *dec;
+    GError *err = NULL;
+    GstElement *decoder;
+    GstCaps *caps;
+    gchar *desc;
+
+    g_return_val_if_fail(info != NULL, FALSE);
+
+    if (!gst_init_check(NULL, NULL, &err)) {
+        g_warning("failed to initialize GStreamer: %s", err->message);
+        g_clear_error(&err);
+        return FALSE;
+    }
+
+    desc = g_strdup_printf("appsrc name=src is-live=true format=time ! "
+                           "%s%s%s name=dec ! videoconvert ! video/x-raw,format=BGRx ! "
+                           "appsink name=sink sync=false",
+                           info->parser ? info->parser : "",
+                           info->parser ? " ! " : "",
+                           info->decoder);
+    dec = g_new0(struct gst_decoder, 1);
+    dec->pipeline = gst_parse_launch_full(desc, NULL, GST_PARSE_FLAG_FATAL_ERRORS, &err);
+    g_free(desc);
+    if (dec->pipeline == NULL) {
+        g_warning("failed to create GStreamer pipeline: %s", err->message);
+        g_clear_error(&err);
+        gst_decoder_free(dec);
+        return FALSE;
+    }
+
+    dec->appsrc = GST_APP_SRC(gst_bin_get_by_name(GST_BIN(dec->pipeline), "src"));
+    dec->appsink = GST_APP_SINK(gst_bin_get_by_name(GST_BIN(dec->pipeline), "sink"));
+    caps = gst_caps_from_string(info->caps);
+    gst_app_src_set_caps(dec->appsrc, caps);
+    gst_caps_unref(caps);
+
+    decoder = gst_bin_get_by_name(GST_BIN(dec->pipeline), "dec");
+    gst_decoder_set_low_latency(decoder);
+    gst_object_unref(decoder);
+
+    if (gst_element_set_state(dec->pipeline, GST_STATE_PLAYING) ==
+        GST_STATE_CHANGE_FAILURE) {
+        g_warning("failed to start GStreamer pipeline");
+        gst_decoder_free(dec);
+        return FALSE;
+    }
+
+    st->gst = dec;
+    return TRUE;
+}
+
+/* decoder thread, the newest picture up to the one of the frame stamped
+ * pts, NULL when there is none. An older picture is only thrown away for
+ * a newer one: in sync, it waits for the picture of the frame until
+ * GST_DECODE_TIMEOUT and falls back to the newest older one; lagging,
+ * it takes the newest picture ready, waiting GST_LAG_TIMEOUT at most
+ * for the first one. */
+static GstSample *gst_decoder_pull(struct gst_decoder *dec, GstClockTime pts,
+                                   gboolean *current)
+{
+    gint64 deadline = g_get_monotonic_time() +
+        (dec->lagging ? GST_LAG_TIMEOUT : GST_DECODE_TIMEOUT) / GST_USECOND;
+    GstSample *best = NULL;
+
+    *current = FALSE;
+    for (;;) {
+        GstClockTime timeout = 0;
+        GstClockTime sample_pts;
+        GstSample *sample;
+
+        if (best == NULL || !dec->lagging)
+            timeout = MAX(deadline - g_get_monotonic_time(), 0) * GST_USECOND;
+        sample = gst_app_sink_try_pull_sample(dec->appsink, timeout);
+        if (sample == NULL)
+            return best;
+
+        if (best != NULL)
+            gst_sample_unref(best);
+        best = sample;
+
+        sample_pts = GST_BUFFER_PTS(gst_sample_get_buffer(sample));
+        if (!GST_CLOCK_TIME_IS_VALID(sample_pts) || sample_pts >= pts) {
+            *current = TRUE;
+            return best;
+        }
+    }
+}
+
+/* decoder thread */
+static void stream_gst_flush(display_stream *st)
+{
+    GstElement *src = GST_ELEMENT(st->gst->appsrc);
+    GstPad *pad = gst_element_get_static_pad(src, "src");
+    GstPad *peer = gst_pad_get_peer(pad);
+
+    /* stopping appsrc drops the frames it still queues */
+    gst_element_set_state(src, GST_STATE_READY);
+
+    /* drops what the decoder and the sink still hold */
+    if (peer != NULL) {
+        gst_pad_send_event(peer, gst_event_new_flush_start());
+        gst_pad_send_event(peer, gst_event_new_flush_stop(FALSE));
+        gst_object_unref(peer);
+    }
+    gst_object_unref(pad);
+
+    gst_element_sync_state_with_parent(src);
+}
+
+/* decoder thread */
+static void stream_gst_data(display_stream *st)
+{
+    struct gst_decoder *dec = st->gst;
+    GstBuffer *buffer;
+    GstSample *sample;
+    GstClockTime pts;
+    gboolean current;
+    GstVideoInfo info;
+    GstVideoFrame frame;
+    uint8_t *data;
+    uint32_t size;
+    int width;
+    int height;
+    int y;
+
+    stream_get_dimensions(st, &width, &height);
+
+    /* the message belongs to the main context, GStreamer gets a copy */
+    size = stream_get_current_frame(st, &data);
+    buffer = gst_buffer_new_allocate(NULL, size, NULL);
+    gst_buffer_fill(buffer, 0, data, size);
+    pts = dec->next_pts;
+    dec->next_pts += GST_FRAME_DURATION;
+    GST_BUFFER_PTS(buffer) = pts;
+    GST_BUFFER_DURATION(buffer) = GST_FRAME_DURATION;
+    if (gst_app_src_push_buffer(dec->appsrc, buffer) != GST_FLOW_OK) {
+        SPICE_DEBUG("%s: GStreamer refused the frame", __FUNCTION__);
+        return;
+    }
+
+    /* the server encodes without frame reordering, and the decoder
+     * doesn't delay the pictures, every frame gives one right away */
+    sample = gst_decoder_pull(dec, pts, &current);
+    if (sample == NULL && !dec->lagging) {
+        /* the decoder is stuck */
+        SPICE_DEBUG("%s: no picture for the frame, flushing", __FUNCTION__);
+        stream_gst_flush(st);
+    }
+    dec->lagging = !current;
+    if (sample == NULL)
+        return;
+
+    if (!gst_video_info_from_caps(&info, gst_sample_get_caps(sample)) ||
+        GST_VIDEO_INFO_WIDTH(&info) != width ||
+        GST_VIDEO_INFO_HEIGHT(&info) != height) {
+        g_warning("unexpected picture from the GStreamer decoder");
+        gst_sample_unref(sample);
+        return;
+    }
+
+    if (!gst_video_frame_map(&frame, &info, gst_sample_get_buffer(sample),
+                             GST_MAP_READ)) {
+        gst_sample_unref(sample);
+        return;
+    }
+
+    g_free(st->out_frame);
+    st->out_frame = stream_get_frame_buffer(st, width, height);
+    for (y = 0; y < height; y++) {
+        memcpy(st->out_frame + y * width * 4,
+               (uint8_t *)GST_VIDEO_FRAME_PLANE_DATA(&frame, 0) +
+               y * GST_VIDEO_FRAME_PLANE_STRIDE(&frame, 0),
+               width * 4);
+    }
+
+    gst_video_frame_unmap(&frame);
+    gst_sample_unref(sample);
+}
+
+static void stream_gst_cleanup(display_stream *st)
+{
+    if (st->gst != NULL) {
+        gst_decoder_free(st->gst);
+        st->gst = NULL;
+    }
+
+    g_free(st->out_frame);
+    st->out_frame = NULL;
+}
+
+G_GNUC_INTERNAL
+const stream_codec stream_gst_vp8_codec = {
+    .type = SPICE_VIDEO_CODEC_TYPE_VP8,
+    .cap = SPICE_DISPLAY_CAP_CODEC_VP8,
+    .decode_dropped = TRUE,
+    .available = stream_gst_available,
+    .init = stream_gst_init,
+    .decode = stream_gst_data,
+    .flush = stream_gst_flush,
+    .cleanup = stream_gst_cleanup,
+};
+
+G_GNUC_INTERNAL
+const stream_codec stream_gst_h264_codec = {
+    .type = SPICE_VIDEO_CODEC_TYPE_H264,
+    .cap = SPICE_DISPLAY_CAP_CODEC_H264,
+    .decode_dropped = TRUE,
+    .available = stream_gst_available,
+    .init = stream_gst_init,
+    .decode = stream_gst_data,
+    .flush = stream_gst_flush,
+    .cleanup = stream_gst_cleanup,
+};
@@ -25,17 +25,23 @@
 
 static void mjpeg_src_init(struct jpeg_decompress_struct *cinfo)
 {
-    display_stream *st = SPICE_CONTAINEROF(cinfo->src, display_stream, mjpeg_src);
-    uint8_t *data;
+    mjpeg_decoder *dec = SPICE_CONTAINEROF(cinfo->src, mjpeg_decoder, src);
 
-    cinfo->src->bytes_in_buffer = stream_get_current_frame(st, &data);
-    cinfo->src->next_input_byte = data;
+    cinfo->src->bytes_in_buffer = dec->size;
+    cinfo->src->next_input_byte = dec->data;
 }
 
 static boolean mjpeg_src_fill(struct jpeg_decompress_struct *cinfo)
 {
-    g_critical("need more input data");
-    return 0;
+    static const JOCTET eoi[] = { 0xFF, JPEG_EOI };
+    mjpeg_decoder *dec = SPICE_CONTAINEROF(cinfo->src, mjpeg_decoder, src);
+
+    /* ends the frame there, the rest of the picture is made up */
+    g_warning("mjpeg frame is truncated");
+    dec->truncated = TRUE;
+    cinfo->src->next_input_byte = eoi;
+    cinfo->src->bytes_in_buffer = sizeof(eoi);
+    return TRUE;
 }
 
 static void mjpeg_src_skip(struct jpeg_decompress_struct *cinfo,
@@ -49,77 +55,96 @@ static void mjpeg_src_term(struct jpeg_decompress_struct *cinfo)
     /* nothing */
 }
 
-G_GNUC_INTERNAL
-void stream_mjpeg_init(display_stream *st)
+static void mjpeg_decoder_init(mjpeg_decoder *dec)
 {
-    st->mjpeg_cinfo.err = jpeg_std_error(&st->mjpeg_jerr);
-    jpeg_create_decompress(&st->mjpeg_cinfo);
-
-    st->mjpeg_src.init_source         = mjpeg_src_init;
-    st->mjpeg_src.fill_input_buffer   = mjpeg_src_fill;
-    st->mjpeg_src.skip_input_data     = mjpeg_src_skip;
-    st->mjpeg_src.resync_to_restart   = jpeg_resync_to_restart;
-    st->mjpeg_src.term_source         = mjpeg_src_term;
-    st->mjpeg_cinfo.src               = &st->mjpeg_src;
+    dec->cinfo.err = jpeg_std_error(&dec->jerr);
+    jpeg_create_decompress(&dec->cinfo);
+
+    dec->src.init_source         = mjpeg_src_init;
+    dec->src.fill_input_buffer   = mjpeg_src_fill;
+    dec->src.skip_input_data     = mjpeg_src_skip;
+    dec->src.resync_to_restart   = jpeg_resync_to_restart;
+    dec->src.term_source         = mjpeg_src_term;
+    dec->cinfo.src               = &dec->src;
 }
 
-G_GNUC_INTERNAL
-void stream_mjpeg_data(display_stream *st)
+static gboolean stream_mjpeg_init(display_stream *st)
 {
+    mjpeg_decoder_init(&st->mjpeg);
+
+    return TRUE;
+}
+
+/* decodes the frame to a width x height area at dest, stride is in bytes
+ * and has to be width * 4 when built without libjpeg-turbo; the area a
+ * smaller picture doesn't cover is cleared. Returns FALSE when the
+ * frame couldn't be decoded, dest is then left as is or partly
+ * written. */
+static gboolean mjpeg_decode(display_stream *st, mjpeg_decoder *dec,
+                             SpiceMsgIn *frame_msg, uint8_t *dest,
+                             int stride, int width, int height)
+{
+    struct jpeg_decompress_struct *cinfo = &dec->cinfo;
     gboolean back_compat = st->channel->priv->peer_hdr.major_version == 1;
-    int width;
-    int height;
-    uint8_t *dest;
+    uint8_t *start = dest;
     uint8_t *lines[4];
+    int y;
 
-    stream_get_dimensions(st, &width, &height);
-    dest = g_malloc0(width * height * 4);
+    dec->size = stream_get_frame_data(frame_msg, &dec->data);
+    dec->truncated = FALSE;
 
-    g_free(st->out_frame);
-    st->out_frame = dest;
-
-    jpeg_read_header(&st->mjpeg_cinfo, 1);
+    if (jpeg_read_header(cinfo, 1) != JPEG_HEADER_OK) {
+        jpeg_abort_decompress(cinfo);
+        return FALSE;
+    }
 #ifdef JCS_EXTENSIONS
     // requires jpeg-turbo
     if (back_compat)
-        st->mjpeg_cinfo.out_color_space = JCS_EXT_RGBX;
+        cinfo->out_color_space = JCS_EXT_RGBX;
     else
-        st->mjpeg_cinfo.out_color_space = JCS_EXT_BGRX;
+        cinfo->out_color_space = JCS_EXT_BGRX;
 #else
 #warning "You should consider building with libjpeg-turbo"
-    st->mjpeg_cinfo.out_color_space = JCS_RGB;
+    cinfo->out_color_space = JCS_RGB;
 #endif
 
 #ifndef SPICE_QUALITY
-    st->mjpeg_cinfo.dct_method = JDCT_IFAST;
-    st->mjpeg_cinfo.do_fancy_upsampling = FALSE;
-    st->mjpeg_cinfo.do_block_smoothing = FALSE;
-    st->mjpeg_cinfo.dither_mode = JDITHER_ORDERED;
+    cinfo->dct_method = JDCT_IFAST;
+    cinfo->do_fancy_upsampling = FALSE;
+    cinfo->do_block_smoothing = FALSE;
+    cinfo->dither_mode = JDITHER_ORDERED;
 #endif
-    // TODO: in theory should check cinfo.output_height match with our height
-    jpeg_start_decompress(&st->mjpeg_cinfo);
+    jpeg_start_decompress(cinfo);
+    /* don't write past the picture buffer */
+    if (cinfo->output_width > (JDIMENSION)width ||
+        cinfo->output_height > (JDIMENSION)height) {
+        g_warning("mjpeg frame is %ux%u, stream is %dx%d",
+                  cinfo->output_width, cinfo->output_height, width, height);
+        jpeg_abort_decompress(cinfo);
+        return FALSE;
+    }
     /* rec_outbuf_height is the recommended size of the output buffer we
      * pass to libjpeg for optimum performance
      */
-    if (st->mjpeg_cinfo.rec_outbuf_height > G_N_ELEMENTS(lines)) {
-        jpeg_abort_decompress(&st->mjpeg_cinfo);
-        g_return_if_reached();
+    if (cinfo->rec_outbuf_height > G_N_ELEMENTS(lines)) {
+        jpeg_abort_decompress(cinfo);
+        g_return_val_if_reached(FALSE);
     }
 
-    while (st->mjpeg_cinfo.output_scanline < st->mjpeg_cinfo.output_height) {
+    while (cinfo->output_scanline < cinfo->output_height) {
         /* only used when JCS_EXTENSIONS is undefined */
         G_GNUC_UNUSED unsigned int lines_read;
 
-        for (unsigned int j = 0; j < st->mjpeg_cinfo.rec_outbuf_height; j++) {
+        for (unsigned int j = 0; j < cinfo->rec_outbuf_height; j++) {
             lines[j] = dest;
 #ifdef JCS_EXTENSIONS
-            dest += 4 * width;
+            dest += stride;
 #else
             dest += 3 * width;
 #endif
         }
-        lines_read = jpeg_read_scanlines(&st->mjpeg_cinfo, lines,
-                                st->mjpeg_cinfo.rec_outbuf_height);
+        lines_read = jpeg_read_scanlines(cinfo, lines,
+                                cinfo->rec_outbuf_height);
 #ifndef JCS_EXTENSIONS
         {
             uint8_t *s = lines[0];
@@ -142,15 +167,59 @@ void stream_mjpeg_data(display_stream *st)
             }
         }
 #endif
-        dest = &st->out_frame[st->mjpeg_cinfo.output_scanline * width * 4];
+        dest = &start[cinfo->output_scanline * stride];
+    }
+    jpeg_finish_decompress(cinfo);
+
+    if (dec->truncated)
+        return FALSE;
+
+    if (cinfo->output_width < (JDIMENSION)width) {
+        for (y = 0; y < (int)cinfo->output_height; y++)
+            memset(start + y * stride + cinfo->output_width * 4, 0,
+                   (width - cinfo->output_width) * 4);
     }
-    jpeg_finish_decompress(&st->mjpeg_cinfo);
+    for (y = cinfo->output_height; y < height; y++)
+        memset(start + y * stride, 0, width * 4);
+
+    return TRUE;
 }
 
-G_GNUC_INTERNAL
-void stream_mjpeg_cleanup(display_stream *st)
+/* decoder thread */
+static void stream_mjpeg_data(display_stream *st)
+{
+    int width;
+    int height;
+    uint8_t *dest;
+
+    stream_get_dimensions(st, &width, &height);
+    /* pool buffers are not cleared, mjpeg_decode() writes every pixel
+     * when it succeeds */
+    dest = stream_get_frame_buffer(st, width, height);
+
+    g_free(st->out_frame);
+    st->out_frame = NULL;
+
+    if (!mjpeg_decode(st, &st->mjpeg, st->msg_data, dest, width * 4, width, height)) {
+        /* skipped rather than showing what the buffer held */
+        stream_put_frame_buffer(st, dest, width, height);
+        return;
+    }
+    st->out_frame = dest;
+}
+
+static void stream_mjpeg_cleanup(display_stream *st)
 {
-    jpeg_destroy_decompress(&st->mjpeg_cinfo);
+    jpeg_destroy_decompress(&st->mjpeg.cinfo);
     g_free(st->out_frame);
     st->out_frame = NULL;
 }
+
+G_GNUC_INTERNAL
+const stream_codec stream_mjpeg_codec = {
+    .type = SPICE_VIDEO_CODEC_TYPE_MJPEG,
+    .cap = SPICE_DISPLAY_CAP_CODEC_MJPEG,
+    .init = stream_mjpeg_init,
+    .decode = stream_mjpeg_data,
+    .cleanup = stream_mjpeg_cleanup,
+};
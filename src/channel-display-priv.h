@@ -32,9 +32,14 @@
 #include "common/quic.h"
 #include "common/rop3.h"
 
+#include "spice-surface-pool.h"
+
 G_BEGIN_DECLS
 
 struct ast_decoder;
+struct gst_decoder;
+typedef struct stream_codec stream_codec;
+struct draw_job;
 
 typedef struct display_surface {
     guint32                     surface_id;
@@ -47,8 +52,23 @@ typedef struct display_surface {
     SpiceGlzDecoder             *glz_decoder;
     SpiceZlibDecoder            *zlib_decoder;
     SpiceJpegDecoder            *jpeg_decoder;
+    /* data comes from it when shmid is -1 */
+    SpiceSurfacePool            *pool;
+    /* the last draw job using the surface, main context */
+    struct draw_job             *last_draw;
 } display_surface;
 
+typedef struct mjpeg_decoder {
+    struct jpeg_source_mgr         src;
+    struct jpeg_decompress_struct  cinfo;
+    struct jpeg_error_mgr          jerr;
+    /* the compressed frame being decoded */
+    uint8_t                        *data;
+    uint32_t                       size;
+    /* the frame ended before the picture */
+    gboolean                       truncated;
+} mjpeg_decoder;
+
 typedef struct drops_sequence_stats {
     uint32_t len;
     uint32_t start_mm_time;
@@ -66,20 +86,57 @@ typedef struct display_stream {
     QRegion                     region;
     int                         have_region;
     int                         codec;
+    const stream_codec          *codec_ops;
 
     /* mjpeg decoder */
-    struct jpeg_source_mgr         mjpeg_src;
-    struct jpeg_decompress_struct  mjpeg_cinfo;
-    struct jpeg_error_mgr          mjpeg_jerr;
+    mjpeg_decoder               mjpeg;
 
     /* aspeed decoder */
     struct ast_decoder          *dec;
 
+    /* gstreamer decoder */
+    struct gst_decoder          *gst;
+
     uint8_t                     *out_frame;
+    /* area of out_frame updated by the last decoded frame, in out_frame
+     * memory rows; the whole frame when have_dirty is FALSE */
+    QRegion                     dirty;
+    int                         have_dirty;
+    /* frames waiting for presentation, in order */
     GQueue                      *msgq;
     guint                       timeout;
     SpiceChannel                *channel;
 
+    /* frames are decoded on a decoder thread as soon as they arrive, the
+     * codec state above (msg_data to have_dirty) belongs to that thread */
+    GThreadPool                 *decoder;
+    /* one entry per decoded picture that may be waiting for presentation */
+    GAsyncQueue                 *decode_slots;
+    /* dropped frames the decoder is not done with yet */
+    GQueue                      *retired;
+    GSource                     *decode_source;
+    gint                        destroying;
+    /* the head of msgq is due but not decoded yet */
+    gboolean                    wait_decode;
+    /* a frame was dropped since the last presentation */
+    gboolean                    skipped;
+    /* keep_frame codecs, decoder thread: what the frames decoded but not
+     * handed to the main context changed, for the next one to carry, and
+     * the size of the last one handed */
+    QRegion                     carry_dirty;
+    gboolean                    carry_all;
+    int                         kept_width;
+    int                         kept_height;
+    /* keep_frame codecs, main context: the picture, patched with the
+     * area each frame changed */
+    uint8_t                     *present_frame;
+    int                         present_width;
+    int                         present_height;
+    /* recycled picture buffers of frame_pool_size bytes, the size is
+     * protected by the queue lock */
+    GAsyncQueue                 *frame_pool;
+    gsize                       frame_pool_size;
+
     /* stats */
     uint32_t             first_frame_mm_time;
     uint32_t             num_drops_on_receive;
@@ -92,6 +149,12 @@ typedef struct display_stream {
 
     uint32_t             playback_sync_drops_seq_len;
 
+    /* decode-ahead stats, main context */
+    uint32_t             num_decoded_frames;
+    uint32_t             decode_ahead_max;
+    uint64_t             decode_ahead_total;
+    uint32_t             num_decode_waits;
+
     /* playback quality report to server */
     gboolean report_is_active;
     uint32_t report_id;
@@ -104,18 +167,58 @@ typedef struct display_stream {
     uint32_t report_drops_seq_len;
 } display_stream;
 
+/* a stream codec; decode and flush run on the stream decoder thread,
+ * the other hooks in the main context */
+struct stream_codec {
+    int                         type;   /* SpiceVideoCodecType */
+    /* advertised when available, 0 for none */
+    uint32_t                    cap;
+    /* frames depend on the previous ones, decode them even when dropped */
+    gboolean                    decode_dropped;
+    /* out_frame is updated in place across frames, a frame only copies
+     * the area it changed instead of taking it */
+    gboolean                    keep_frame;
+
+    /* NULL when always available */
+    gboolean (*available)(const stream_codec *codec);
+    gboolean (*init)(display_stream *st);
+    /* decodes msg_data to out_frame */
+    void (*decode)(display_stream *st);
+    /* the frames before the one about to be decoded were dropped, may
+     * be NULL */
+    void (*flush)(display_stream *st);
+    void (*cleanup)(display_stream *st);
+};
+
 void stream_get_dimensions(display_stream *st, int *width, int *height);
 uint32_t stream_get_current_frame(display_stream *st, uint8_t **data);
+uint32_t stream_get_frame_data(SpiceMsgIn *frame_msg, uint8_t **data);
+uint8_t *stream_get_frame_buffer(display_stream *st, int width, int height);
+void stream_put_frame_buffer(display_stream *st, uint8_t *buf, int width, int height);
+
+/* channel-display-draw.c */
+#define DRAW_MAX_SOURCES 4
+
+typedef void (*display_draw_func)(display_surface *surface, gpointer op);
+
+gboolean display_draw_submit(display_surface *surface,
+                             display_surface **sources, guint nsources,
+                             display_draw_func func, SpiceMsgIn *in);
+void display_surface_wait(display_surface *surface);
+void display_surface_release_draws(display_surface *surface);
+gboolean display_draw_get_source(guint32 surface_id, SpiceCanvas **canvas);
 
 /* channel-display-mjpeg.c */
-void stream_mjpeg_init(display_stream *st);
-void stream_mjpeg_data(display_stream *st);
-void stream_mjpeg_cleanup(display_stream *st);
+extern const stream_codec stream_mjpeg_codec;
 
 /* channel-display-aspeed.c */
-void stream_aspeed_init(display_stream *st);
-void stream_aspeed_data(display_stream *st);
-void stream_aspeed_cleanup(display_stream *st);
+extern const stream_codec stream_aspeed_codec;
+
+#ifdef HAVE_GSTVIDEO
+/* channel-display-gst.c */
+extern const stream_codec stream_gst_vp8_codec;
+extern const stream_codec stream_gst_h264_codec;
+#endif
 
 G_END_DECLS
 
@@ -63,6 +63,13 @@
 
 #define MONITORS_MAX 256
 
+/* the invalidated area of the primary is emitted at the latest after
+ * that long, in us, even if the coroutine keeps reading messages or
+ * waits in the middle of one */
+#define INVALIDATE_MAX_DELAY 10000
+/* beyond that many rectangles, the bounding box is emitted instead */
+#define INVALIDATE_MAX_RECTS 64
+
 struct _SpiceDisplayChannelPrivate {
     GHashTable                  *surfaces;
     display_surface             *primary;
@@ -72,10 +79,14 @@ struct _SpiceDisplayChannelPrivate {
     SpicePaletteCache           palette_cache;
     SpiceImageSurfaces          image_surfaces;
     SpiceGlzDecoderWindow       *glz_window;
+    SpiceSurfacePool            *surface_pool;
     display_stream              **streams;
     int                         nstreams;
     gboolean                    mark;
     guint                       mark_false_event_id;
+    QRegion                     invalidate;
+    gint64                      invalidate_time;
+    guint                       invalidate_timeout_id;
     GArray                      *monitors;
     guint                       monitors_max;
     gboolean                    enable_adaptive_streaming;
@@ -115,8 +126,8 @@ static display_surface *find_surface(SpiceDisplayChannelPrivate *c, guint32 surf
 static gboolean display_stream_render(display_stream *st);
 static void spice_display_channel_reset(SpiceChannel *channel, gboolean migrating);
 static void spice_display_channel_reset_capabilities(SpiceChannel *channel);
+static void spice_display_channel_iterate_read(SpiceChannel *channel);
 static void destroy_canvas(display_surface *surface);
-static void _msg_in_unref_func(gpointer data, gpointer user_data);
 static void display_session_mm_time_reset_cb(SpiceSession *session, gpointer data);
 
 /* ------------------------------------------------------------------ */
@@ -130,6 +141,11 @@ static void spice_display_channel_dispose(GObject *object)
         c->mark_false_event_id = 0;
     }
 
+    if (c->invalidate_timeout_id != 0) {
+        g_source_remove(c->invalidate_timeout_id);
+        c->invalidate_timeout_id = 0;
+    }
+
     if (G_OBJECT_CLASS(spice_display_channel_parent_class)->dispose)
         G_OBJECT_CLASS(spice_display_channel_parent_class)->dispose(object);
 }
@@ -143,6 +159,8 @@ static void spice_display_channel_finalize(GObject *object)
     g_hash_table_unref(c->surfaces);
     clear_streams(SPICE_CHANNEL(object));
     g_clear_pointer(&c->palettes, cache_free);
+    g_clear_pointer(&c->surface_pool, surface_pool_unref);
+    region_destroy(&c->invalidate);
 
     if (G_OBJECT_CLASS(spice_display_channel_parent_class)->finalize)
         G_OBJECT_CLASS(spice_display_channel_parent_class)->finalize(object);
@@ -155,7 +173,9 @@ static void spice_display_channel_constructed(GObject *object)
 
     g_return_if_fail(s != NULL);
     spice_session_get_caches(s, &c->images, &c->glz_window);
-    c->palettes = cache_new(g_free);
+    c->palettes = cache_new("palettes", g_free);
+    /* the surfaces may outlive the session */
+    c->surface_pool = surface_pool_ref(spice_session_get_surface_pool(s));
 
     g_return_if_fail(c->glz_window != NULL);
     g_return_if_fail(c->images != NULL);
@@ -238,6 +258,7 @@ static void spice_display_channel_class_init(SpiceDisplayChannelClass *klass)
     channel_class->channel_up   = spice_display_channel_up;
     channel_class->channel_reset = spice_display_channel_reset;
     channel_class->channel_reset_capabilities = spice_display_channel_reset_capabilities;
+    channel_class->iterate_read = spice_display_channel_iterate_read;
 
     g_object_class_install_property
         (gobject_class, PROP_HEIGHT,
@@ -429,12 +450,17 @@ gboolean spice_display_get_primary(SpiceChannel *channel, guint32 surface_id,
 
 /* ------------------------------------------------------------------ */
 
+static gsize image_get_size(pixman_image_t *image)
+{
+    return (gsize)pixman_image_get_stride(image) * pixman_image_get_height(image);
+}
+
 static void image_put(SpiceImageCache *cache, uint64_t id, pixman_image_t *image)
 {
     SpiceDisplayChannelPrivate *c =
         SPICE_CONTAINEROF(cache, SpiceDisplayChannelPrivate, image_cache);
 
-    cache_add(c->images, id, pixman_image_ref(image));
+    cache_add(c->images, id, pixman_image_ref(image), image_get_size(image));
 }
 
 typedef struct _WaitImageData
@@ -445,20 +471,48 @@ typedef struct _WaitImageData
     pixman_image_t *image;
 } WaitImageData;
 
+static gboolean wait_image_found(WaitImageData *wait, display_cache_entry *entry)
+{
+    if (entry == NULL || (entry->lossy && !wait->lossy))
+        return FALSE;
+
+    wait->image = pixman_image_ref(entry->value);
+
+    return TRUE;
+}
+
+/* polled while waiting, doesn't count in the cache statistics */
 static gboolean wait_image(gpointer data)
 {
-    gboolean lossy;
     WaitImageData *wait = data;
     SpiceDisplayChannelPrivate *c =
         SPICE_CONTAINEROF(wait->cache, SpiceDisplayChannelPrivate, image_cache);
-    pixman_image_t *image = cache_find_lossy(c->images, wait->id, &lossy);
 
-    if (!image || (lossy && !wait->lossy))
-        return FALSE;
+    return wait_image_found(wait, cache_peek(c->images, wait->id));
+}
 
-    wait->image = pixman_image_ref(image);
+/* the images cache is shared by the display channels, the channel that
+ * adds the image wakes up the one waiting for it */
+static gboolean image_wait(SpiceImageCache *cache, WaitImageData *wait)
+{
+    SpiceDisplayChannelPrivate *c =
+        SPICE_CONTAINEROF(cache, SpiceDisplayChannelPrivate, image_cache);
+    display_cache_waiter waiter = {
+        .id = wait->id,
+        .notify = (display_cache_notify)g_coroutine_condition_signal,
+        .data = g_coroutine_self()
+    };
+    gboolean ret;
 
-    return TRUE;
+    /* a single hit or miss, however long the wait */
+    if (wait_image_found(wait, cache_lookup(c->images, wait->id)))
+        return TRUE;
+
+    cache_add_waiter(c->images, &waiter);
+    ret = g_coroutine_condition_wait_signalled(g_coroutine_self(), wait_image, wait);
+    cache_remove_waiter(c->images, &waiter);
+
+    return ret;
 }
 
 static pixman_image_t *image_get(SpiceImageCache *cache, uint64_t id)
@@ -469,7 +523,7 @@ static pixman_image_t *image_get(SpiceImageCache *cache, uint64_t id)
         .id = id,
         .image = NULL
     };
-    if (!g_coroutine_condition_wait(g_coroutine_self(), wait_image, &wait))
+    if (!image_wait(cache, &wait))
         SPICE_DEBUG("wait image got cancelled");
 
     return wait.image;
@@ -480,9 +534,9 @@ static void palette_put(SpicePaletteCache *cache, SpicePalette *palette)
     SpiceDisplayChannelPrivate *c =
         SPICE_CONTAINEROF(cache, SpiceDisplayChannelPrivate, palette_cache);
 
-    cache_add(c->palettes, palette->unique,
-              g_memdup(palette, sizeof(SpicePalette) +
-                       palette->num_ents * sizeof(palette->ents[0])));
+    gsize size = sizeof(SpicePalette) + palette->num_ents * sizeof(palette->ents[0]);
+
+    cache_add(c->palettes, palette->unique, g_memdup(palette, size), size);
 }
 
 static SpicePalette *palette_get(SpicePaletteCache *cache, uint64_t id)
@@ -516,10 +570,11 @@ static void image_put_lossy(SpiceImageCache *cache, uint64_t id,
         SPICE_CONTAINEROF(cache, SpiceDisplayChannelPrivate, image_cache);
 
 #ifndef NDEBUG
-    g_warn_if_fail(cache_find(c->images, id) == NULL);
+    g_warn_if_fail(cache_peek(c->images, id) == NULL);
 #endif
 
-    cache_add_lossy(c->images, id, pixman_image_ref(surface), TRUE);
+    cache_add_lossy(c->images, id, pixman_image_ref(surface),
+                    image_get_size(surface), TRUE);
 }
 
 static void image_replace_lossy(SpiceImageCache *cache, uint64_t id,
@@ -536,7 +591,7 @@ static pixman_image_t* image_get_lossless(SpiceImageCache *cache, uint64_t id)
         .id = id,
         .image = NULL
     };
-    if (!g_coroutine_condition_wait(g_coroutine_self(), wait_image, &wait))
+    if (!image_wait(cache, &wait))
         SPICE_DEBUG("wait lossless got cancelled");
 
     return wait.image;
@@ -547,6 +602,11 @@ static SpiceCanvas *surfaces_get(SpiceImageSurfaces *surfaces,
 {
     SpiceDisplayChannelPrivate *c =
         SPICE_CONTAINEROF(surfaces, SpiceDisplayChannelPrivate, image_surfaces);
+    SpiceCanvas *canvas;
+
+    /* the surfaces table belongs to the coroutine */
+    if (display_draw_get_source(surface_id, &canvas))
+        return canvas;
 
     display_surface *s =
         find_surface(c, surface_id);
@@ -584,14 +644,43 @@ static HDC create_compatible_dc(void)
 }
 #endif
 
+static const stream_codec *stream_codecs[] = {
+    &stream_mjpeg_codec,
+    &stream_aspeed_codec,
+#ifdef HAVE_GSTVIDEO
+    &stream_gst_vp8_codec,
+    &stream_gst_h264_codec,
+#endif
+};
+
+static const stream_codec *stream_find_codec(int type)
+{
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS(stream_codecs); i++) {
+        if (stream_codecs[i]->type == type)
+            return stream_codecs[i];
+    }
+
+    return NULL;
+}
+
 static void spice_display_channel_reset_capabilities(SpiceChannel *channel)
 {
+    guint i;
+
     spice_channel_set_capability(SPICE_CHANNEL(channel), SPICE_DISPLAY_CAP_SIZED_STREAM);
     spice_channel_set_capability(SPICE_CHANNEL(channel), SPICE_DISPLAY_CAP_MONITORS_CONFIG);
     spice_channel_set_capability(SPICE_CHANNEL(channel), SPICE_DISPLAY_CAP_COMPOSITE);
     spice_channel_set_capability(SPICE_CHANNEL(channel), SPICE_DISPLAY_CAP_A8_SURFACE);
     spice_channel_set_capability(SPICE_CHANNEL(channel), SPICE_DISPLAY_CAP_MULTI_CODEC);
-    spice_channel_set_capability(SPICE_CHANNEL(channel), SPICE_DISPLAY_CAP_CODEC_ASPEED);
+    for (i = 0; i < G_N_ELEMENTS(stream_codecs); i++) {
+        const stream_codec *codec = stream_codecs[i];
+
+        if (codec->cap != 0 &&
+            (codec->available == NULL || codec->available(codec)))
+            spice_channel_set_capability(SPICE_CHANNEL(channel), codec->cap);
+    }
 #ifdef USE_LZ4
     spice_channel_set_capability(SPICE_CHANNEL(channel), SPICE_DISPLAY_CAP_LZ4_COMPRESSION);
 #endif
@@ -604,6 +693,7 @@ static void destroy_surface(gpointer data)
 {
     display_surface *surface = data;
 
+    display_surface_release_draws(surface);
     destroy_canvas(surface);
     g_slice_free(display_surface, surface);
 }
@@ -618,6 +708,7 @@ static void spice_display_channel_init(SpiceDisplayChannel *channel)
     c->image_cache.ops = &image_cache_ops;
     c->palette_cache.ops = &palette_cache_ops;
     c->image_surfaces.ops = &image_surfaces_ops;
+    region_init(&c->invalidate);
 #if defined(G_OS_WIN32)
     c->dc = create_compatible_dc();
 #endif
@@ -646,6 +737,7 @@ static int create_canvas(SpiceChannel *channel, display_surface *surface)
                 return 0;
             }
 
+            region_clear(&c->invalidate);
             g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_PRIMARY_DESTROY], 0);
 
             g_hash_table_remove(c->surfaces, GINT_TO_POINTER(c->primary->surface_id));
@@ -668,8 +760,10 @@ static int create_canvas(SpiceChannel *channel, display_surface *surface)
         surface->shmid = -1;
     }
 
-    if (surface->shmid == -1)
-        surface->data = g_malloc0(surface->size);
+    if (surface->shmid == -1) {
+        surface->pool = c->surface_pool;
+        surface->data = surface_pool_alloc(surface->pool, surface->size);
+    }
 
     g_return_val_if_fail(c->glz_window, 0);
 
@@ -679,7 +773,7 @@ static int create_canvas(SpiceChannel *channel, display_surface *surface)
     g_warn_if_fail(surface->jpeg_decoder == NULL);
 
     surface->glz_decoder = glz_decoder_new(c->glz_window);
-    surface->zlib_decoder = zlib_decoder_new();
+    surface->zlib_decoder = zlib_decoder_new(surface->glz_decoder);
     surface->jpeg_decoder = jpeg_decoder_new();
 
     surface->canvas = canvas_create_for_data(surface->width,
@@ -727,7 +821,7 @@ static void destroy_canvas(display_surface *surface)
     jpeg_decoder_destroy(surface->jpeg_decoder);
 
     if (surface->shmid == -1) {
-        g_free(surface->data);
+        surface_pool_release(surface->pool, surface->data);
     }
 #ifdef HAVE_SYS_SHM_H
     else {
@@ -759,6 +853,7 @@ static void clear_surfaces(SpiceChannel *channel, gboolean keep_primary)
 
     if (!keep_primary) {
         c->primary = NULL;
+        region_clear(&c->invalidate);
         g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_PRIMARY_DESTROY], 0);
     }
 
@@ -774,13 +869,74 @@ static void clear_surfaces(SpiceChannel *channel, gboolean keep_primary)
     }
 }
 
-/* coroutine context */
+/* main or coroutine context, emits the area invalidated since the last
+ * flush */
+static void flush_invalidate(SpiceChannel *channel)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    SpiceRect *rects;
+    uint32_t num_rects;
+    uint32_t i;
+
+    if (c->invalidate_timeout_id != 0) {
+        g_source_remove(c->invalidate_timeout_id);
+        c->invalidate_timeout_id = 0;
+    }
+
+    if (region_is_empty(&c->invalidate))
+        return;
+
+    rects = region_dup_rects(&c->invalidate, &num_rects);
+    region_clear(&c->invalidate);
+
+    if (num_rects > INVALIDATE_MAX_RECTS) {
+        for (i = 1; i < num_rects; i++) {
+            rects[0].left = MIN(rects[0].left, rects[i].left);
+            rects[0].top = MIN(rects[0].top, rects[i].top);
+            rects[0].right = MAX(rects[0].right, rects[i].right);
+            rects[0].bottom = MAX(rects[0].bottom, rects[i].bottom);
+        }
+        num_rects = 1;
+    }
+
+    for (i = 0; i < num_rects; i++)
+        g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_INVALIDATE], 0,
+                                rects[i].left, rects[i].top,
+                                rects[i].right - rects[i].left,
+                                rects[i].bottom - rects[i].top);
+    free(rects);
+}
+
+/* main context, the coroutine is blocked in the middle of a message,
+ * waiting for an image or for the socket */
+static gboolean invalidate_timeout(gpointer data)
+{
+    SpiceChannel *channel = data;
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+
+    c->invalidate_timeout_id = 0;
+    flush_invalidate(channel);
+
+    return FALSE;
+}
+
+/* coroutine context, the area is emitted with the rest of the messages
+ * read in the same iteration, see spice_display_channel_iterate_read() */
 static void emit_invalidate(SpiceChannel *channel, SpiceRect *bbox)
 {
-    g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_INVALIDATE], 0,
-                            bbox->left, bbox->top,
-                            bbox->right - bbox->left,
-                            bbox->bottom - bbox->top);
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    gint64 now = g_get_monotonic_time();
+
+    if (region_is_empty(&c->invalidate)) {
+        c->invalidate_time = now;
+        if (c->invalidate_timeout_id == 0)
+            c->invalidate_timeout_id =
+                g_timeout_add(INVALIDATE_MAX_DELAY / 1000, invalidate_timeout, channel);
+    }
+    region_add(&c->invalidate, bbox);
+
+    if (now - c->invalidate_time >= INVALIDATE_MAX_DELAY)
+        flush_invalidate(channel);
 }
 
 /* ------------------------------------------------------------------ */
@@ -823,13 +979,105 @@ static void spice_display_channel_up(SpiceChannel *channel)
     }
 }
 
-#define DRAW(type) {                                                    \
+/* coroutine context */
+static void spice_display_channel_iterate_read(SpiceChannel *channel)
+{
+    SPICE_CHANNEL_CLASS(spice_display_channel_parent_class)->iterate_read(channel);
+
+    /* all the messages available were handled, a single invalidate per
+     * area for the lot before waiting for more */
+    flush_invalidate(channel);
+}
+
+/* coroutine context, or a draw thread */
+#define DRAW_FUNC(type, msg_type)                                       \
+static void draw_##type(display_surface *surface, gpointer data)        \
+{                                                                       \
+    msg_type *op = data;                                                \
+                                                                        \
+    surface->canvas->ops->draw_##type(surface->canvas, &op->base.box,   \
+                                      &op->base.clip, &op->data);       \
+}
+
+DRAW_FUNC(fill, SpiceMsgDisplayDrawFill)
+DRAW_FUNC(opaque, SpiceMsgDisplayDrawOpaque)
+DRAW_FUNC(copy, SpiceMsgDisplayDrawCopy)
+DRAW_FUNC(blend, SpiceMsgDisplayDrawBlend)
+DRAW_FUNC(blackness, SpiceMsgDisplayDrawBlackness)
+DRAW_FUNC(whiteness, SpiceMsgDisplayDrawWhiteness)
+DRAW_FUNC(invers, SpiceMsgDisplayDrawInvers)
+DRAW_FUNC(rop3, SpiceMsgDisplayDrawRop3)
+DRAW_FUNC(stroke, SpiceMsgDisplayDrawStroke)
+DRAW_FUNC(text, SpiceMsgDisplayDrawText)
+DRAW_FUNC(transparent, SpiceMsgDisplayDrawTransparent)
+DRAW_FUNC(alpha_blend, SpiceMsgDisplayDrawAlphaBlend)
+DRAW_FUNC(composite, SpiceMsgDisplayDrawComposite)
+
+static SpiceImage *brush_image(SpiceBrush *brush)
+{
+    return brush->type == SPICE_BRUSH_TYPE_PATTERN ? brush->u.pattern.pat : NULL;
+}
+
+/* coroutine context, images are the images the draw uses, NULL for
+ * none. A draw to an off-screen surface whose images are all surfaces
+ * runs on a draw thread, the others wait for the surfaces they use */
+static void display_draw(SpiceChannel *channel, display_surface *surface,
+                         SpiceImage **images, guint nimages,
+                         display_draw_func func, SpiceMsgIn *in)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    display_surface *sources[DRAW_MAX_SOURCES];
+    gboolean async = !surface->primary;
+    guint nsources = 0;
+    guint i;
+
+    g_return_if_fail(nimages <= DRAW_MAX_SOURCES);
+
+    for (i = 0; i < nimages; i++) {
+        SpiceImage *image = images[i];
+        display_surface *source;
+
+        if (image == NULL)
+            continue;
+
+        if (image->descriptor.type != SPICE_IMAGE_TYPE_SURFACE) {
+            /* needs the decoders */
+            async = FALSE;
+            continue;
+        }
+
+        /* needs the caches */
+        if (image->descriptor.flags & (SPICE_IMAGE_FLAGS_CACHE_ME |
+                                       SPICE_IMAGE_FLAGS_CACHE_REPLACE_ME))
+            async = FALSE;
+
+        /* waited for even when the draw runs inline, a draw thread may
+         * still be writing to it */
+        source = find_surface(c, image->u.surface.surface_id);
+        if (source == NULL) {
+            async = FALSE;
+        } else if (source != surface) {
+            sources[nsources++] = source;
+        }
+    }
+
+    if (async && display_draw_submit(surface, sources, nsources, func, in))
+        return;
+
+    display_surface_wait(surface);
+    for (i = 0; i < nsources; i++)
+        display_surface_wait(sources[i]);
+    func(surface, spice_msg_in_parsed(in));
+}
+
+#define DRAW(type, ...) {                                               \
+        SpiceImage *images[] = { __VA_ARGS__ };                         \
         display_surface *surface =                                      \
             find_surface(SPICE_DISPLAY_CHANNEL(channel)->priv,          \
                 op->base.surface_id);                                   \
         g_return_if_fail(surface != NULL);                              \
-        surface->canvas->ops->draw_##type(surface->canvas, &op->base.box, \
-                                          &op->base.clip, &op->data);   \
+        display_draw(channel, surface, images, G_N_ELEMENTS(images),    \
+                     draw_##type, in);                                  \
         if (surface->primary) {                                         \
             emit_invalidate(channel, &op->base.box);                    \
         }                                                               \
@@ -867,6 +1115,7 @@ static void display_handle_mark(SpiceChannel *channel, SpiceMsgIn *in)
 #endif
 
     c->mark = TRUE;
+    flush_invalidate(channel);
     g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_MARK], 0, TRUE);
 }
 
@@ -878,12 +1127,15 @@ static void display_handle_reset(SpiceChannel *channel, SpiceMsgIn *in)
 
     CHANNEL_DEBUG(channel, "%s: TODO detach_from_screen", __FUNCTION__);
 
-    if (surface != NULL)
+    if (surface != NULL) {
+        display_surface_wait(surface);
         surface->canvas->ops->clear(surface->canvas);
+    }
 
     cache_clear(c->palettes);
 
     c->mark = FALSE;
+    flush_invalidate(channel);
     g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_MARK], 0, FALSE);
 }
 
@@ -895,6 +1147,7 @@ static void display_handle_copy_bits(SpiceChannel *channel, SpiceMsgIn *in)
     display_surface *surface = find_surface(c, op->base.surface_id);
 
     g_return_if_fail(surface != NULL);
+    display_surface_wait(surface);
     surface->canvas->ops->copy_bits(surface->canvas, &op->base.box,
                                     &op->base.clip, &op->src_pos);
     if (surface->primary) {
@@ -971,6 +1224,381 @@ static void display_update_stream_region(display_stream *st)
     }
 }
 
+/* at most this many decoded pictures wait for presentation per stream */
+#define STREAM_MAX_DECODE_AHEAD 8
+
+typedef struct display_frame {
+    SpiceMsgIn                  *msg;
+    /* set by the decoder thread once it no longer touches the frame */
+    gint                        decoded;
+    /* set in the main context when the frame won't be presented */
+    gint                        dropped;
+
+    /* the decoded picture, NULL when there is nothing to present */
+    uint8_t                     *data;
+    int                         width;
+    int                         height;
+    /* area that changed since the previous frame, in data rows; the
+     * whole picture when have_dirty is FALSE */
+    QRegion                     dirty;
+    int                         have_dirty;
+    /* the frames queued before this one were dropped on a mm-time reset */
+    gboolean                    flush;
+    /* the frames decoded ahead, this one included, when it was decoded;
+     * 0 when there was no picture */
+    guint                       decode_ahead;
+} display_frame;
+
+static display_frame *display_frame_new(SpiceMsgIn *in)
+{
+    display_frame *frame = g_new0(display_frame, 1);
+
+    spice_msg_in_ref(in);
+    frame->msg = in;
+    region_init(&frame->dirty);
+
+    return frame;
+}
+
+/* decoder thread, returns a picture buffer for a width x height frame */
+G_GNUC_INTERNAL
+uint8_t *stream_get_frame_buffer(display_stream *st, int width, int height)
+{
+    gsize size = (gsize)width * height * 4;
+    uint8_t *buf;
+
+    g_async_queue_lock(st->frame_pool);
+    if (size != st->frame_pool_size) {
+        /* the stream was resized, the recycled buffers are useless */
+        while ((buf = g_async_queue_try_pop_unlocked(st->frame_pool)) != NULL)
+            g_free(buf);
+        st->frame_pool_size = size;
+    }
+    buf = g_async_queue_try_pop_unlocked(st->frame_pool);
+    g_async_queue_unlock(st->frame_pool);
+
+    return buf != NULL ? buf : g_malloc(size);
+}
+
+/* decoder thread or main context, gives back a buffer from
+ * stream_get_frame_buffer() */
+G_GNUC_INTERNAL
+void stream_put_frame_buffer(display_stream *st, uint8_t *buf,
+                             int width, int height)
+{
+    g_async_queue_lock(st->frame_pool);
+    if ((gsize)width * height * 4 == st->frame_pool_size)
+        g_async_queue_push_unlocked(st->frame_pool, buf);
+    else
+        g_free(buf);
+    g_async_queue_unlock(st->frame_pool);
+}
+
+/* main context, gives the picture buffer of frame back */
+static void display_frame_release_data(display_stream *st, display_frame *frame)
+{
+    stream_put_frame_buffer(st, frame->data, frame->width, frame->height);
+    frame->data = NULL;
+    g_async_queue_push(st->decode_slots, GINT_TO_POINTER(1));
+}
+
+/* main context, copies the area frame changed to the picture of a
+ * keep_frame stream, frames have to be patched in order */
+static void display_stream_patch(display_stream *st, display_frame *frame)
+{
+    int stride = frame->width * 4;
+
+    if (st->present_frame == NULL ||
+        st->present_width != frame->width ||
+        st->present_height != frame->height) {
+        /* the decoder sends the whole picture after a resize */
+        g_free(st->present_frame);
+        st->present_frame = g_malloc0((gsize)stride * frame->height);
+        st->present_width = frame->width;
+        st->present_height = frame->height;
+    }
+
+    if (frame->have_dirty) {
+        SpiceRect *rects;
+        uint32_t num_rects;
+        uint32_t i;
+        int y;
+
+        rects = region_dup_rects(&frame->dirty, &num_rects);
+        for (i = 0; i < num_rects; i++) {
+            for (y = rects[i].top; y < rects[i].bottom; y++)
+                memcpy(st->present_frame + y * stride + rects[i].left * 4,
+                       frame->data + y * stride + rects[i].left * 4,
+                       (rects[i].right - rects[i].left) * 4);
+        }
+        free(rects);
+    } else {
+        memcpy(st->present_frame, frame->data, (gsize)stride * frame->height);
+    }
+
+    display_frame_release_data(st, frame);
+}
+
+/* main context */
+static void display_frame_free(display_stream *st, display_frame *frame)
+{
+    if (frame->decode_ahead != 0) {
+        st->num_decoded_frames++;
+        st->decode_ahead_total += frame->decode_ahead;
+        st->decode_ahead_max = MAX(st->decode_ahead_max, frame->decode_ahead);
+    }
+    if (frame->data != NULL) {
+        /* a dropped frame still has to update the picture */
+        if (st->codec_ops->keep_frame && !g_atomic_int_get(&st->destroying))
+            display_stream_patch(st, frame);
+        else
+            display_frame_release_data(st, frame);
+    }
+    region_destroy(&frame->dirty);
+    spice_msg_in_unref(frame->msg);
+    g_free(frame);
+}
+
+/* main context, frees the dropped frames that are decoded */
+static void display_stream_reap(display_stream *st)
+{
+    display_frame *frame;
+
+    /* frames are decoded in order */
+    while ((frame = g_queue_peek_head(st->retired)) != NULL &&
+           g_atomic_int_get(&frame->decoded)) {
+        g_queue_pop_head(st->retired);
+        display_frame_free(st, frame);
+    }
+}
+
+/* main context, for frames that won't be presented */
+static void display_frame_drop(display_stream *st, display_frame *frame)
+{
+    st->skipped = TRUE;
+    if (g_atomic_int_get(&frame->decoded)) {
+        /* the frames dropped before it go first */
+        display_stream_reap(st);
+        display_frame_free(st, frame);
+    } else {
+        g_atomic_int_set(&frame->dropped, 1);
+        g_queue_push_tail(st->retired, frame);
+    }
+}
+
+static void display_stream_drop_frames(display_stream *st)
+{
+    display_frame *frame;
+
+    while ((frame = g_queue_pop_head(st->msgq)) != NULL)
+        display_frame_drop(st, frame);
+    st->wait_decode = FALSE;
+}
+
+/* decoder thread, copies the area of out_frame that changed since the
+ * previous frame handed to the main context, and sets the frame dirty
+ * area to it */
+static void display_frame_copy_dirty(display_stream *st, display_frame *frame)
+{
+    int stride = frame->width * 4;
+    SpiceRect *rects;
+    uint32_t num_rects;
+    uint32_t i;
+    int y;
+
+    frame->data = stream_get_frame_buffer(st, frame->width, frame->height);
+    frame->have_dirty = st->have_dirty && !st->carry_all &&
+                        st->kept_width == frame->width &&
+                        st->kept_height == frame->height;
+    st->carry_all = FALSE;
+    st->kept_width = frame->width;
+    st->kept_height = frame->height;
+
+    if (!frame->have_dirty) {
+        memcpy(frame->data, st->out_frame, (gsize)stride * frame->height);
+        region_clear(&st->carry_dirty);
+        return;
+    }
+
+    region_or(&frame->dirty, &st->dirty);
+    region_or(&frame->dirty, &st->carry_dirty);
+    region_clear(&st->carry_dirty);
+
+    rects = region_dup_rects(&frame->dirty, &num_rects);
+    for (i = 0; i < num_rects; i++) {
+        for (y = rects[i].top; y < rects[i].bottom; y++)
+            memcpy(frame->data + y * stride + rects[i].left * 4,
+                   st->out_frame + y * stride + rects[i].left * 4,
+                   (rects[i].right - rects[i].left) * 4);
+    }
+    free(rects);
+}
+
+/* decoder thread */
+static void display_stream_decode(gpointer data, gpointer user_data)
+{
+    display_frame *frame = data;
+    display_stream *st = user_data;
+    const stream_codec *codec = st->codec_ops;
+    gboolean present;
+
+    if (g_atomic_int_get(&st->destroying) || codec == NULL)
+        goto done;
+
+    if (frame->flush) {
+        if (codec->flush != NULL)
+            codec->flush(st);
+        st->carry_all = TRUE;
+    }
+
+    present = !g_atomic_int_get(&frame->dropped);
+    if (!present && !codec->decode_dropped)
+        goto done;
+
+    if (present)
+        g_async_queue_pop(st->decode_slots);
+
+    st->msg_data = frame->msg;
+    codec->decode(st);
+
+    if (present && st->out_frame != NULL) {
+        stream_get_dimensions(st, &frame->width, &frame->height);
+        if (!codec->keep_frame) {
+            /* the codec decodes every frame into a new pool buffer */
+            frame->data = st->out_frame;
+            st->out_frame = NULL;
+            frame->have_dirty = st->have_dirty;
+            if (st->have_dirty)
+                region_or(&frame->dirty, &st->dirty);
+        } else {
+            display_frame_copy_dirty(st, frame);
+        }
+
+        /* counted in the main context when the frame is freed */
+        frame->decode_ahead = STREAM_MAX_DECODE_AHEAD -
+                              g_async_queue_length(st->decode_slots);
+    } else if (present) {
+        g_async_queue_push(st->decode_slots, GINT_TO_POINTER(1));
+    } else if (st->out_frame != NULL && !codec->keep_frame) {
+        int width, height;
+
+        stream_get_dimensions(st, &width, &height);
+        stream_put_frame_buffer(st, st->out_frame, width, height);
+        st->out_frame = NULL;
+    } else if (codec->keep_frame) {
+        /* the next frame handed to the main context carries it */
+        if (st->have_dirty)
+            region_or(&st->carry_dirty, &st->dirty);
+        else
+            st->carry_all = TRUE;
+    }
+    st->msg_data = NULL;
+
+done:
+    g_atomic_int_set(&frame->decoded, 1);
+    g_main_context_wakeup(NULL);
+}
+
+/* wakes up the main context when a frame it waits for is decoded */
+typedef struct display_stream_source {
+    GSource                     source;
+    display_stream              *st;
+} display_stream_source;
+
+static gboolean display_stream_source_ready(GSource *source)
+{
+    display_stream *st = ((display_stream_source *)source)->st;
+    display_frame *frame;
+
+    frame = g_queue_peek_head(st->retired);
+    if (frame != NULL && g_atomic_int_get(&frame->decoded))
+        return TRUE;
+
+    if (!st->wait_decode)
+        return FALSE;
+
+    frame = g_queue_peek_head(st->msgq);
+    return frame != NULL && g_atomic_int_get(&frame->decoded);
+}
+
+static gboolean display_stream_source_prepare(GSource *source, gint *timeout)
+{
+    *timeout = -1;
+    return display_stream_source_ready(source);
+}
+
+static gboolean display_stream_source_dispatch(GSource *source,
+                                               GSourceFunc callback G_GNUC_UNUSED,
+                                               gpointer user_data G_GNUC_UNUSED)
+{
+    display_stream *st = ((display_stream_source *)source)->st;
+    display_frame *frame;
+
+    display_stream_reap(st);
+
+    frame = g_queue_peek_head(st->msgq);
+    if (st->wait_decode && frame != NULL && g_atomic_int_get(&frame->decoded)) {
+        st->wait_decode = FALSE;
+        display_stream_render(st);
+    }
+
+    return TRUE;
+}
+
+static GSourceFuncs display_stream_source_funcs = {
+    .prepare = display_stream_source_prepare,
+    .check = display_stream_source_ready,
+    .dispatch = display_stream_source_dispatch,
+};
+
+static void display_stream_start_decoder(display_stream *st)
+{
+    GError *err = NULL;
+    int i;
+
+    st->retired = g_queue_new();
+    st->frame_pool = g_async_queue_new_full(g_free);
+    st->decode_slots = g_async_queue_new();
+    for (i = 0; i < STREAM_MAX_DECODE_AHEAD; i++)
+        g_async_queue_push(st->decode_slots, GINT_TO_POINTER(1));
+
+    st->decode_source = g_source_new(&display_stream_source_funcs,
+                                     sizeof(display_stream_source));
+    ((display_stream_source *)st->decode_source)->st = st;
+    g_source_attach(st->decode_source, NULL);
+
+    /* a single thread keeps the frames in order */
+    st->decoder = g_thread_pool_new(display_stream_decode, st, 1, FALSE, &err);
+    if (err != NULL) {
+        g_critical("failed to start stream decoder: %s", err->message);
+        g_clear_error(&err);
+    }
+}
+
+static void display_stream_stop_decoder(display_stream *st)
+{
+    display_frame *frame;
+
+    if (st->decoder != NULL) {
+        g_atomic_int_set(&st->destroying, 1);
+        /* in case the decoder waits for a slot */
+        g_async_queue_push(st->decode_slots, GINT_TO_POINTER(1));
+        g_thread_pool_free(st->decoder, FALSE, TRUE);
+        st->decoder = NULL;
+    }
+
+    g_source_destroy(st->decode_source);
+    g_source_unref(st->decode_source);
+
+    while ((frame = g_queue_pop_head(st->msgq)) != NULL)
+        display_frame_free(st, frame);
+    while ((frame = g_queue_pop_head(st->retired)) != NULL)
+        display_frame_free(st, frame);
+    g_queue_free(st->retired);
+    g_async_queue_unref(st->decode_slots);
+    g_async_queue_unref(st->frame_pool);
+}
+
 /* coroutine context */
 static void display_handle_stream_create(SpiceChannel *channel, SpiceMsgIn *in)
 {
@@ -1005,16 +1633,19 @@ static void display_handle_stream_create(SpiceChannel *channel, SpiceMsgIn *in)
     st->drops_seqs_stats_arr = g_array_new(FALSE, FALSE, sizeof(drops_sequence_stats));
 
     region_init(&st->region);
+    region_init(&st->dirty);
+    region_init(&st->carry_dirty);
     display_update_stream_region(st);
 
-    switch (st->codec) {
-    case SPICE_VIDEO_CODEC_TYPE_MJPEG:
-        stream_mjpeg_init(st);
-        break;
-    case SPICE_VIDEO_CODEC_TYPE_ASPEED:
-        stream_aspeed_init(st);
-        break;
+    st->codec_ops = stream_find_codec(st->codec);
+    if (st->codec_ops == NULL) {
+        g_warning("unsupported stream codec %d", st->codec);
+    } else if (!st->codec_ops->init(st)) {
+        g_warning("failed to initialize stream codec %d", st->codec);
+        st->codec_ops = NULL;
     }
+
+    display_stream_start_decoder(st);
 }
 
 /* coroutine or main context */
@@ -1023,20 +1654,20 @@ static gboolean display_stream_schedule(display_stream *st)
     SpiceSession *session = spice_channel_get_session(st->channel);
     guint32 time, d;
     SpiceStreamDataHeader *op;
-    SpiceMsgIn *in;
+    display_frame *frame;
 
     SPICE_DEBUG("%s", __FUNCTION__);
-    if (st->timeout || !session)
+    if (st->timeout || st->wait_decode || !session)
         return TRUE;
 
     time = spice_session_get_mm_time(session);
-    in = g_queue_peek_head(st->msgq);
+    frame = g_queue_peek_head(st->msgq);
 
-    if (in == NULL) {
+    if (frame == NULL) {
         return TRUE;
     }
 
-    op = spice_msg_in_parsed(in);
+    op = spice_msg_in_parsed(frame->msg);
     if (time < op->multi_media_time) {
         d = op->multi_media_time - time;
         SPICE_DEBUG("scheduling next stream render in %u ms", d);
@@ -1046,8 +1677,7 @@ static gboolean display_stream_schedule(display_stream *st)
         SPICE_DEBUG("%s: rendering too late by %u ms (ts: %u, mmtime: %u), dropping ",
                     __FUNCTION__, time - op->multi_media_time,
                     op->multi_media_time, time);
-        in = g_queue_pop_head(st->msgq);
-        spice_msg_in_unref(in);
+        display_frame_drop(st, g_queue_pop_head(st->msgq));
         st->num_drops_on_playback++;
         if (g_queue_get_length(st->msgq) == 0)
             return TRUE;
@@ -1056,15 +1686,14 @@ static gboolean display_stream_schedule(display_stream *st)
     return FALSE;
 }
 
-static SpiceRect *stream_get_dest(display_stream *st)
+static SpiceRect *stream_get_dest(display_stream *st, SpiceMsgIn *msg_data)
 {
-    if (st->msg_data == NULL ||
-        spice_msg_in_type(st->msg_data) != SPICE_MSG_DISPLAY_STREAM_DATA_SIZED) {
+    if (spice_msg_in_type(msg_data) != SPICE_MSG_DISPLAY_STREAM_DATA_SIZED) {
         SpiceMsgDisplayStreamCreate *info = spice_msg_in_parsed(st->msg_create);
 
         return &info->dest;
     } else {
-        SpiceMsgDisplayStreamDataSized *op = spice_msg_in_parsed(st->msg_data);
+        SpiceMsgDisplayStreamDataSized *op = spice_msg_in_parsed(msg_data);
 
         return &op->dest;
    }
@@ -1079,22 +1708,17 @@ static uint32_t stream_get_flags(display_stream *st)
 }
 
 G_GNUC_INTERNAL
-uint32_t stream_get_current_frame(display_stream *st, uint8_t **data)
+uint32_t stream_get_frame_data(SpiceMsgIn *frame_msg, uint8_t **data)
 {
-    if (st->msg_data == NULL) {
-        *data = NULL;
-        return 0;
-    }
-
-    if (spice_msg_in_type(st->msg_data) == SPICE_MSG_DISPLAY_STREAM_DATA) {
-        SpiceMsgDisplayStreamData *op = spice_msg_in_parsed(st->msg_data);
+    if (spice_msg_in_type(frame_msg) == SPICE_MSG_DISPLAY_STREAM_DATA) {
+        SpiceMsgDisplayStreamData *op = spice_msg_in_parsed(frame_msg);
 
         *data = op->data;
         return op->data_size;
     } else {
-        SpiceMsgDisplayStreamDataSized *op = spice_msg_in_parsed(st->msg_data);
+        SpiceMsgDisplayStreamDataSized *op = spice_msg_in_parsed(frame_msg);
 
-        g_return_val_if_fail(spice_msg_in_type(st->msg_data) ==
+        g_return_val_if_fail(spice_msg_in_type(frame_msg) ==
                              SPICE_MSG_DISPLAY_STREAM_DATA_SIZED, 0);
         *data = op->data;
         return op->data_size;
@@ -1103,84 +1727,186 @@ uint32_t stream_get_current_frame(display_stream *st, uint8_t **data)
 }
 
 G_GNUC_INTERNAL
-void stream_get_dimensions(display_stream *st, int *width, int *height)
+uint32_t stream_get_current_frame(display_stream *st, uint8_t **data)
 {
-    g_return_if_fail(width != NULL);
-    g_return_if_fail(height != NULL);
+    if (st->msg_data == NULL) {
+        *data = NULL;
+        return 0;
+    }
+
+    return stream_get_frame_data(st->msg_data, data);
+}
 
-    if (st->msg_data == NULL ||
-        spice_msg_in_type(st->msg_data) != SPICE_MSG_DISPLAY_STREAM_DATA_SIZED) {
+static void stream_get_frame_dimensions(display_stream *st, SpiceMsgIn *frame_msg,
+                                        int *width, int *height)
+{
+    if (frame_msg == NULL ||
+        spice_msg_in_type(frame_msg) != SPICE_MSG_DISPLAY_STREAM_DATA_SIZED) {
         SpiceMsgDisplayStreamCreate *info = spice_msg_in_parsed(st->msg_create);
 
         *width = info->stream_width;
         *height = info->stream_height;
     } else {
-        SpiceMsgDisplayStreamDataSized *op = spice_msg_in_parsed(st->msg_data);
+        SpiceMsgDisplayStreamDataSized *op = spice_msg_in_parsed(frame_msg);
 
         *width = op->width;
         *height = op->height;
    }
 }
 
-/* main context */
-static gboolean display_stream_render(display_stream *st)
+G_GNUC_INTERNAL
+void stream_get_dimensions(display_stream *st, int *width, int *height)
 {
-    SpiceMsgIn *in;
+    g_return_if_fail(width != NULL);
+    g_return_if_fail(height != NULL);
 
-    st->timeout = 0;
-    do {
-        in = g_queue_pop_head(st->msgq);
+    stream_get_frame_dimensions(st, st->msg_data, width, height);
+}
 
-        g_return_val_if_fail(in != NULL, FALSE);
+/* maps the decoder dirty area of a frame to destination coordinates */
+static void stream_get_dest_dirty(display_stream *st, display_frame *frame,
+                                  QRegion *dirty, SpiceRect *dest)
+{
+    int width = frame->width;
+    int height = frame->height;
+    int dest_width = dest->right - dest->left;
+    int dest_height = dest->bottom - dest->top;
+    gboolean scaled = dest_width != width || dest_height != height;
+    gboolean top_down = stream_get_flags(st) & SPICE_STREAM_FLAGS_TOP_DOWN;
+    SpiceRect *rects;
+    uint32_t num_rects;
+    uint32_t i;
 
-        st->msg_data = in;
-        switch (st->codec) {
-        case SPICE_VIDEO_CODEC_TYPE_MJPEG:
-            stream_mjpeg_data(st);
-            break;
-        case SPICE_VIDEO_CODEC_TYPE_ASPEED:
-            stream_aspeed_data(st);
-            break;
+    rects = region_dup_rects(&frame->dirty, &num_rects);
+    for (i = 0; i < num_rects; i++) {
+        SpiceRect r = rects[i];
+        SpiceRect d;
+
+        if (!top_down) {
+            int top = height - r.bottom;
+            r.bottom = height - r.top;
+            r.top = top;
         }
 
-        if (st->out_frame) {
-            int width;
-            int height;
-            SpiceRect *dest;
-            uint8_t *data;
-            int stride;
-
-            stream_get_dimensions(st, &width, &height);
-            dest = stream_get_dest(st);
-
-            data = st->out_frame;
-            stride = width * sizeof(uint32_t);
-            if (!(stream_get_flags(st) & SPICE_STREAM_FLAGS_TOP_DOWN)) {
-                data += stride * (height - 1);
-                stride = -stride;
-            }
+        d.left = dest->left + r.left * dest_width / width;
+        d.right = dest->left + (r.right * dest_width + width - 1) / width;
+        d.top = dest->top + r.top * dest_height / height;
+        d.bottom = dest->top + (r.bottom * dest_height + height - 1) / height;
+        if (scaled) {
+            /* filtering may reach the neighbouring pixels */
+            d.left = MAX(d.left - 1, dest->left);
+            d.top = MAX(d.top - 1, dest->top);
+            d.right = MIN(d.right + 1, dest->right);
+            d.bottom = MIN(d.bottom + 1, dest->bottom);
+        }
+        region_add(dirty, &d);
+    }
+    free(rects);
+}
+
+/* main context */
+static void display_stream_present(display_stream *st, display_frame *frame)
+{
+    int width = frame->width;
+    int height = frame->height;
+    SpiceRect *dest;
+    uint8_t *data;
+    int stride;
+    QRegion dirty;
+    QRegion *clip;
+    gboolean have_dirty;
+
+    dest = stream_get_dest(st, frame->msg);
+
+    if (st->codec_ops->keep_frame) {
+        display_stream_patch(st, frame);
+        data = st->present_frame;
+    } else {
+        data = frame->data;
+    }
+    stride = width * sizeof(uint32_t);
+    if (!(stream_get_flags(st) & SPICE_STREAM_FLAGS_TOP_DOWN)) {
+        data += stride * (height - 1);
+        stride = -stride;
+    }
+
+    /* the area of dropped frames has to be redrawn too */
+    have_dirty = frame->have_dirty && !st->skipped;
+    st->skipped = FALSE;
+
+    region_init(&dirty);
+    if (have_dirty) {
+        stream_get_dest_dirty(st, frame, &dirty, dest);
+        if (st->have_region)
+            region_and(&dirty, &st->region);
+        clip = &dirty;
+    } else {
+        clip = st->have_region ? &st->region : NULL;
+    }
 
-            st->surface->canvas->ops->put_image(
-                st->surface->canvas,
+    if (clip == NULL || !region_is_empty(clip)) {
+        display_surface_wait(st->surface);
+        st->surface->canvas->ops->put_image(
+            st->surface->canvas,
 #ifdef G_OS_WIN32
-                SPICE_DISPLAY_CHANNEL(st->channel)->priv->dc,
+            SPICE_DISPLAY_CHANNEL(st->channel)->priv->dc,
 #endif
-                dest, data,
-                width, height, stride,
-                st->have_region ? &st->region : NULL);
+            dest, data,
+            width, height, stride,
+            clip);
+    }
+
+    if (st->surface->primary) {
+        if (have_dirty) {
+            SpiceRect *rects;
+            uint32_t num_rects;
+            uint32_t i;
 
-            if (st->surface->primary)
+            rects = region_dup_rects(&dirty, &num_rects);
+            for (i = 0; i < num_rects; i++)
                 g_signal_emit(st->channel, signals[SPICE_DISPLAY_INVALIDATE], 0,
-                    dest->left, dest->top,
-                    dest->right - dest->left,
-                    dest->bottom - dest->top);
+                    rects[i].left, rects[i].top,
+                    rects[i].right - rects[i].left,
+                    rects[i].bottom - rects[i].top);
+            free(rects);
+        } else {
+            g_signal_emit(st->channel, signals[SPICE_DISPLAY_INVALIDATE], 0,
+                dest->left, dest->top,
+                dest->right - dest->left,
+                dest->bottom - dest->top);
         }
+    }
+    region_destroy(&dirty);
+}
+
+/* main context */
+static gboolean display_stream_render(display_stream *st)
+{
+    display_frame *frame;
+
+    st->timeout = 0;
+    do {
+        frame = g_queue_peek_head(st->msgq);
+
+        g_return_val_if_fail(frame != NULL, FALSE);
 
-        st->msg_data = NULL;
-        spice_msg_in_unref(in);
+        if (!g_atomic_int_get(&frame->decoded)) {
+            /* display_stream_source_dispatch() resumes once it is decoded */
+            SPICE_DEBUG("%s: frame not decoded yet, waiting", __FUNCTION__);
+            st->num_decode_waits++;
+            st->wait_decode = TRUE;
+            return FALSE;
+        }
+
+        g_queue_pop_head(st->msgq);
+        /* the dropped frames patch the picture before this one does */
+        display_stream_reap(st);
+        if (frame->data != NULL)
+            display_stream_present(st, frame);
+        display_frame_free(st, frame);
 
-        in = g_queue_peek_head(st->msgq);
-        if (in == NULL)
+        frame = g_queue_peek_head(st->msgq);
+        if (frame == NULL)
             break;
 
         if (display_stream_schedule(st))
@@ -1316,20 +2042,20 @@ static void display_session_mm_time_reset_cb(SpiceSession *session, gpointer dat
 
 /* coroutine context */
 static void display_stream_test_frames_mm_time_reset(display_stream *st,
-                                                     SpiceMsgIn *new_frame_msg,
+                                                     display_frame *new_frame,
                                                      guint32 mm_time)
 {
     SpiceStreamDataHeader *tail_op, *new_op;
-    SpiceMsgIn *tail_msg;
+    display_frame *tail_frame;
 
     SPICE_DEBUG("%s", __FUNCTION__);
-    g_return_if_fail(new_frame_msg != NULL);
-    tail_msg = g_queue_peek_tail(st->msgq);
-    if (!tail_msg) {
+    g_return_if_fail(new_frame != NULL);
+    tail_frame = g_queue_peek_tail(st->msgq);
+    if (!tail_frame) {
         return;
     }
-    tail_op = spice_msg_in_parsed(tail_msg);
-    new_op = spice_msg_in_parsed(new_frame_msg);
+    tail_op = spice_msg_in_parsed(tail_frame->msg);
+    new_op = spice_msg_in_parsed(new_frame->msg);
 
     if (new_op->multi_media_time < tail_op->multi_media_time) {
         SPICE_DEBUG("new-frame-time < tail-frame-time (%u < %u):"
@@ -1337,9 +2063,9 @@ static void display_stream_test_frames_mm_time_reset(display_stream *st,
                     new_op->multi_media_time,
                     tail_op->multi_media_time,
                     new_op->id);
-        g_queue_foreach(st->msgq, _msg_in_unref_func, NULL);
-        g_queue_clear(st->msgq);
+        display_stream_drop_frames(st);
         display_stream_reset_rendering_timer(st);
+        new_frame->flush = TRUE;
     }
 }
 
@@ -1387,11 +2113,27 @@ static void display_handle_stream_data(SpiceChannel *channel, SpiceMsgIn *in)
         }
         st->cur_drops_seq_stats.len++;
         st->playback_sync_drops_seq_len++;
+
+        if (st->codec_ops != NULL && st->codec_ops->decode_dropped &&
+            st->decoder != NULL) {
+            /* still needed to decode the frames that follow; dropped
+             * first, so the decoder doesn't hand it to the main context
+             * behind the frames queued before it */
+            display_frame *frame = display_frame_new(in);
+
+            display_frame_drop(st, frame);
+            g_thread_pool_push(st->decoder, frame, NULL);
+        }
     } else {
+        display_frame *frame = display_frame_new(in);
+
         CHANNEL_DEBUG(channel, "video latency: %d", latency);
-        spice_msg_in_ref(in);
-        display_stream_test_frames_mm_time_reset(st, in, mmtime);
-        g_queue_push_tail(st->msgq, in);
+        display_stream_test_frames_mm_time_reset(st, frame, mmtime);
+        if (st->decoder != NULL)
+            g_thread_pool_push(st->decoder, frame, NULL);
+        else
+            g_atomic_int_set(&frame->decoded, 1);
+        g_queue_push_tail(st->msgq, frame);
         while (!display_stream_schedule(st)) {
         }
         if (st->cur_drops_seq_stats.len) {
@@ -1435,11 +2177,6 @@ static void display_handle_stream_clip(SpiceChannel *channel, SpiceMsgIn *in)
     display_update_stream_region(st);
 }
 
-static void _msg_in_unref_func(gpointer data, gpointer user_data)
-{
-    spice_msg_in_unref(data);
-}
-
 static void destroy_stream(SpiceChannel *channel, int id)
 {
     SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
@@ -1485,20 +2222,26 @@ static void destroy_stream(SpiceChannel *channel, int id)
 
     g_array_free(st->drops_seqs_stats_arr, TRUE);
 
-    switch (st->codec) {
-    case SPICE_VIDEO_CODEC_TYPE_MJPEG:
-        stream_mjpeg_cleanup(st);
-        break;
-    case SPICE_VIDEO_CODEC_TYPE_ASPEED:
-        stream_aspeed_cleanup(st);
-        break;
-    }
+    display_stream_stop_decoder(st);
+    CHANNEL_DEBUG(channel, "%s: #decoded-frames=%u avg-decode-ahead=%.2f "
+        "max-decode-ahead=%u #decode-waits=%u", __FUNCTION__,
+        st->num_decoded_frames,
+        st->num_decoded_frames ? st->decode_ahead_total / (double)st->num_decoded_frames : 0,
+        st->decode_ahead_max,
+        st->num_decode_waits);
+
+    if (st->codec_ops != NULL)
+        st->codec_ops->cleanup(st);
+
+    region_destroy(&st->region);
+    region_destroy(&st->dirty);
+    region_destroy(&st->carry_dirty);
+    g_free(st->present_frame);
 
     if (st->msg_clip)
         spice_msg_in_unref(st->msg_clip);
     spice_msg_in_unref(st->msg_create);
 
-    g_queue_foreach(st->msgq, _msg_in_unref_func, NULL);
     g_queue_free(st->msgq);
     if (st->timeout != 0)
         g_source_remove(st->timeout);
@@ -1566,90 +2309,93 @@ static void display_handle_stream_activate_report(SpiceChannel *channel, SpiceMs
 static void display_handle_draw_fill(SpiceChannel *channel, SpiceMsgIn *in)
 {
     SpiceMsgDisplayDrawFill *op = spice_msg_in_parsed(in);
-    DRAW(fill);
+    DRAW(fill, brush_image(&op->data.brush), op->data.mask.bitmap);
 }
 
 /* coroutine context */
 static void display_handle_draw_opaque(SpiceChannel *channel, SpiceMsgIn *in)
 {
     SpiceMsgDisplayDrawOpaque *op = spice_msg_in_parsed(in);
-    DRAW(opaque);
+    DRAW(opaque, op->data.src_bitmap, brush_image(&op->data.brush),
+         op->data.mask.bitmap);
 }
 
 /* coroutine context */
 static void display_handle_draw_copy(SpiceChannel *channel, SpiceMsgIn *in)
 {
     SpiceMsgDisplayDrawCopy *op = spice_msg_in_parsed(in);
-    DRAW(copy);
+    DRAW(copy, op->data.src_bitmap, op->data.mask.bitmap);
 }
 
 /* coroutine context */
 static void display_handle_draw_blend(SpiceChannel *channel, SpiceMsgIn *in)
 {
     SpiceMsgDisplayDrawBlend *op = spice_msg_in_parsed(in);
-    DRAW(blend);
+    DRAW(blend, op->data.src_bitmap, op->data.mask.bitmap);
 }
 
 /* coroutine context */
 static void display_handle_draw_blackness(SpiceChannel *channel, SpiceMsgIn *in)
 {
     SpiceMsgDisplayDrawBlackness *op = spice_msg_in_parsed(in);
-    DRAW(blackness);
+    DRAW(blackness, op->data.mask.bitmap);
 }
 
 static void display_handle_draw_whiteness(SpiceChannel *channel, SpiceMsgIn *in)
 {
     SpiceMsgDisplayDrawWhiteness *op = spice_msg_in_parsed(in);
-    DRAW(whiteness);
+    DRAW(whiteness, op->data.mask.bitmap);
 }
 
 /* coroutine context */
 static void display_handle_draw_invers(SpiceChannel *channel, SpiceMsgIn *in)
 {
     SpiceMsgDisplayDrawInvers *op = spice_msg_in_parsed(in);
-    DRAW(invers);
+    DRAW(invers, op->data.mask.bitmap);
 }
 
 /* coroutine context */
 static void display_handle_draw_rop3(SpiceChannel *channel, SpiceMsgIn *in)
 {
     SpiceMsgDisplayDrawRop3 *op = spice_msg_in_parsed(in);
-    DRAW(rop3);
+    DRAW(rop3, op->data.src_bitmap, brush_image(&op->data.brush),
+         op->data.mask.bitmap);
 }
 
 /* coroutine context */
 static void display_handle_draw_stroke(SpiceChannel *channel, SpiceMsgIn *in)
 {
     SpiceMsgDisplayDrawStroke *op = spice_msg_in_parsed(in);
-    DRAW(stroke);
+    DRAW(stroke, brush_image(&op->data.brush));
 }
 
 /* coroutine context */
 static void display_handle_draw_text(SpiceChannel *channel, SpiceMsgIn *in)
 {
     SpiceMsgDisplayDrawText *op = spice_msg_in_parsed(in);
-    DRAW(text);
+    DRAW(text, brush_image(&op->data.fore_brush),
+         brush_image(&op->data.back_brush));
 }
 
 /* coroutine context */
 static void display_handle_draw_transparent(SpiceChannel *channel, SpiceMsgIn *in)
 {
     SpiceMsgDisplayDrawTransparent *op = spice_msg_in_parsed(in);
-    DRAW(transparent);
+    DRAW(transparent, op->data.src_bitmap);
 }
 
 /* coroutine context */
 static void display_handle_draw_alpha_blend(SpiceChannel *channel, SpiceMsgIn *in)
 {
     SpiceMsgDisplayDrawAlphaBlend *op = spice_msg_in_parsed(in);
-    DRAW(alpha_blend);
+    DRAW(alpha_blend, op->data.src_bitmap);
 }
 
 /* coroutine context */
 static void display_handle_draw_composite(SpiceChannel *channel, SpiceMsgIn *in)
 {
     SpiceMsgDisplayDrawComposite *op = spice_msg_in_parsed(in);
-    DRAW(composite);
+    DRAW(composite, op->data.src_bitmap, op->data.mask_bitmap);
 }
 
 /* coroutine context */
@@ -1715,6 +2461,7 @@ static void display_handle_surface_destroy(SpiceChannel *channel, SpiceMsgIn *in
             c->mark_false_event_id = g_timeout_add_seconds(1, display_mark_false, channel);
         }
         c->primary = NULL;
+        region_clear(&c->invalidate);
         g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_PRIMARY_DESTROY], 0);
     }
 
@@ -1765,6 +2512,43 @@ static void display_handle_monitors_config(SpiceChannel *channel, SpiceMsgIn *in
     g_coroutine_object_notify(G_OBJECT(channel), "monitors");
 }
 
+/* main context */
+static void display_stats_to_json(SpiceChannel *channel, GString *json)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+
+    const char *sep = "";
+    int i;
+
+    g_string_append(json, ",\"caches\":{");
+    cache_stats_to_json(c->images, json);
+    g_string_append_c(json, ',');
+    cache_stats_to_json(c->palettes, json);
+    g_string_append(json, "},\"streams\":[");
+    for (i = 0; i < c->nstreams; i++) {
+        display_stream *st = c->streams[i];
+
+        if (st == NULL)
+            continue;
+        g_string_append_printf(json,
+                               "%s{\"id\":%d,\"codec\":%d"
+                               ",\"input-frames\":%u"
+                               ",\"drops-on-receive\":%u"
+                               ",\"drops-on-playback\":%u"
+                               ",\"decoded-frames\":%u"
+                               ",\"decode-ahead-total\":%" G_GUINT64_FORMAT
+                               ",\"decode-ahead-max\":%u"
+                               ",\"decode-waits\":%u}",
+                               sep, i, st->codec, st->num_input_frames,
+                               st->num_drops_on_receive,
+                               st->num_drops_on_playback,
+                               st->num_decoded_frames, st->decode_ahead_total,
+                               st->decode_ahead_max, st->num_decode_waits);
+        sep = ",";
+    }
+    g_string_append_c(json, ']');
+}
+
 static void channel_set_handlers(SpiceChannelClass *klass)
 {
     static const spice_msg_handler handlers[] = {
@@ -1806,4 +2590,5 @@ static void channel_set_handlers(SpiceChannelClass *klass)
     };
 
     spice_channel_set_handlers(klass, handlers, G_N_ELEMENTS(handlers));
+    klass->priv->stats_to_json = display_stats_to_json;
 }
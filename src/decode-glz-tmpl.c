@@ -171,21 +171,27 @@
 // TODO: separate into routines that decode to dist,len. and to a routine that
 // actually copies the data.
 
-/* returns num of bytes read from in buf.
+/* advances in past the bytes read.
    size should be in PIXEL */
-static size_t FNAME(decode)(SpiceGlzDecoderWindow *window,
-                            uint8_t* in_buf, uint8_t *out_buf, int size,
-                            uint64_t image_id, SpicePalette *plt)
+static gboolean FNAME(decode)(SpiceGlzDecoderWindow *window,
+                              struct glz_input *in, uint8_t *out_buf, int size,
+                              uint64_t image_id, SpicePalette *plt)
 {
-    uint8_t      *ip = in_buf;
+    uint8_t      *ip = in->ip;
     OUT_PIXEL    *out_pix_buf = (OUT_PIXEL *)out_buf;
     OUT_PIXEL    *op = out_pix_buf;
     OUT_PIXEL    *op_limit = out_pix_buf + size;
 
-    uint32_t ctrl = *(ip++);
+    uint32_t ctrl;
     int loop = true;
 
+    GLZ_INPUT_FILL(in, ip);
+    ctrl = *(ip++);
+
     do {
+        /* the whole token, and the next control byte */
+        GLZ_INPUT_FILL(in, ip);
+
         if (ctrl >= MAX_COPY) { // reference (dictionary/RLE)
             OUT_PIXEL *ref = op;
             uint32_t len = ctrl >> 5;
@@ -202,6 +208,7 @@ static size_t FNAME(decode)(SpiceGlzDecoderWindow *window,
 
             if (len == 7) { // match length is bigger than 7
                 do {
+                    GLZ_INPUT_FILL(in, ip);
                     code = *(ip++);
                     len += code;
                 } while (code == 255); // remaining of len
@@ -314,7 +321,8 @@ static size_t FNAME(decode)(SpiceGlzDecoderWindow *window,
         }
     } while (LZ_EXPECT_CONDITIONAL(loop));
 
-    return (ip - in_buf);
+    in->ip = ip;
+    return TRUE;
 }
 #undef LZ_PLT
 #undef PLT8
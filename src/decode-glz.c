@@ -18,6 +18,7 @@
 #include "config.h"
 
 #include <stdio.h>
+#include <string.h>
 #include <stdbool.h>
 #include <inttypes.h>
 
@@ -76,59 +77,121 @@ static void glz_image_destroy(struct glz_image *img)
 
 /* ------------------------------------------------------------------ */
 
-#define INIT_IMAGES_CAPACITY 100
-#define WIN_OVERFLOW_FACTOR 1.5
-#define WIN_REALLOC_FACTOR 1.5
+#define GLZ_WINDOW_INIT_SLOTS 16
+/* the server window is at most a few thousand images */
+#define GLZ_WINDOW_MAX_SLOTS (1 << 20)
+
+struct glz_window_waiter {
+    uint64_t                id;
+    GCoroutine              *coroutine;
+};
 
 struct SpiceGlzDecoderWindow {
+    /* ring of nimages slots, a power of two, for the images from
+     * oldest on; images[head] is image oldest */
     struct glz_image        **images;
     uint32_t                nimages;
+    uint32_t                head;
     uint64_t                oldest;
     uint64_t                tail_gap;
+    /* gross pixels of the images held */
+    uint64_t                pixels;
+    uint64_t                pixels_high_water;
+    /* glz_window_waiter, decoders waiting for an image of another display */
+    GSList                  *waiters;
+    /* microseconds spent waiting for them */
+    uint64_t                wait_time;
 };
 
-static void glz_decoder_window_resize(SpiceGlzDecoderWindow *w)
+static struct glz_image **glz_decoder_window_slot(SpiceGlzDecoderWindow *w,
+                                                  uint64_t id)
 {
-    struct glz_image  **new_images;
-    int i, new_slot;
-
-    SPICE_DEBUG("%s: array resize %d -> %d", __FUNCTION__,
-                w->nimages, w->nimages * 2);
-    new_images = g_new0(struct glz_image*, w->nimages * 2);
-    for (i = 0; i < w->nimages; i++) {
-        if (w->images[i] == NULL) {
-            /*
-             * We can have empty slots when images come in out of order, this
-             * can happen when a vm has multiple displays, since each display
-             * uses its own socket there is no guarantee that images
-             * originating from different displays are received in id order.
-             */
-            continue;
-        }
-        new_slot = w->images[i]->hdr.id % (w->nimages * 2);
-        new_images[new_slot] = w->images[i];
-    }
-    free(w->images);
+    if (id < w->oldest || id - w->oldest >= w->nimages)
+        return NULL;
+
+    return &w->images[(w->head + (id - w->oldest)) & (w->nimages - 1)];
+}
+
+static struct glz_image *glz_decoder_window_find(SpiceGlzDecoderWindow *w,
+                                                 uint64_t id)
+{
+    struct glz_image **slot = glz_decoder_window_slot(w, id);
+
+    return slot != NULL ? *slot : NULL;
+}
+
+/* the images keep their order, so growing only has to unwrap the ring */
+static void glz_decoder_window_grow(SpiceGlzDecoderWindow *w, uint64_t id)
+{
+    struct glz_image **new_images;
+    uint32_t nimages = w->nimages;
+    uint32_t tail = w->nimages - w->head;
+
+    while (id - w->oldest >= nimages)
+        nimages *= 2;
+
+    SPICE_DEBUG("%s: %u -> %u slots", __FUNCTION__, w->nimages, nimages);
+    new_images = g_new0(struct glz_image*, nimages);
+    memcpy(new_images, w->images + w->head, tail * sizeof(*new_images));
+    memcpy(new_images + tail, w->images, w->head * sizeof(*new_images));
+    g_free(w->images);
     w->images = new_images;
-    w->nimages *= 2;
+    w->nimages = nimages;
+    w->head = 0;
 }
 
-static void glz_decoder_window_add(SpiceGlzDecoderWindow *w,
+static void glz_decoder_window_put(SpiceGlzDecoderWindow *w,
+                                   struct glz_image **slot,
                                    struct glz_image *img)
 {
-    int slot = img->hdr.id % w->nimages;
+    if (*slot != NULL) {
+        w->pixels -= (*slot)->hdr.gross_pixels;
+        glz_image_destroy(*slot);
+    }
+    if (img != NULL) {
+        w->pixels += img->hdr.gross_pixels;
+        w->pixels_high_water = MAX(w->pixels_high_water, w->pixels);
+    }
+    *slot = img;
+}
 
-    if (w->images[slot]) {
-        /* need more space */
-        glz_decoder_window_resize(w);
-        slot = img->hdr.id % w->nimages;
+static void glz_decoder_window_add(SpiceGlzDecoderWindow *w,
+                                   struct glz_image *img)
+{
+    uint64_t id = img->hdr.id;
+    struct glz_image **slot;
+    GSList *l;
+
+    /*
+     * Images don't necessarily come in id order, this can happen when a
+     * vm has multiple displays, since each display uses its own socket
+     * there is no guarantee that images originating from different
+     * displays are received in id order. Slots of images still to come
+     * stay empty.
+     */
+    if (id < w->oldest || id - w->oldest >= GLZ_WINDOW_MAX_SLOTS) {
+        g_warning("glz image %" G_GUINT64_FORMAT " outside of the window "
+                  "starting at %" G_GUINT64_FORMAT, id, w->oldest);
+        glz_image_destroy(img);
+        return;
     }
 
-    w->images[slot] = img;
+    if (id - w->oldest >= w->nimages)
+        glz_decoder_window_grow(w, id);
+
+    slot = glz_decoder_window_slot(w, id);
+    glz_decoder_window_put(w, slot, img);
 
     /* close the gap */
-    while (w->tail_gap <= img->hdr.id && w->images[w->tail_gap % w->nimages] != NULL)
+    while (w->tail_gap <= id && glz_decoder_window_find(w, w->tail_gap) != NULL)
         w->tail_gap++;
+
+    for (l = w->waiters; l != NULL; l = l->next) {
+        struct glz_window_waiter *waiter = l->data;
+
+        if (waiter->id == id)
+            g_coroutine_condition_signal(waiter->coroutine);
+    }
 }
 
 struct wait_for_image_data {
@@ -139,11 +202,27 @@ struct wait_for_image_data {
 static gboolean wait_for_image(gpointer data)
 {
     struct wait_for_image_data *wait = data;
-    int slot = wait->id % wait->window->nimages;
-    struct glz_image *image = wait->window->images[slot];
-    gboolean ready = image && image->hdr.id == wait->id;
 
-    return ready;
+    return glz_decoder_window_find(wait->window, wait->id) != NULL;
+}
+
+/* the image is decoded by another display channel, sleep until
+ * glz_decoder_window_add() wakes us up */
+static void glz_decoder_window_wait(SpiceGlzDecoderWindow *w,
+                                    struct wait_for_image_data *data)
+{
+    struct glz_window_waiter waiter = {
+        .id = data->id,
+        .coroutine = g_coroutine_self(),
+    };
+    gint64 start = g_get_monotonic_time();
+
+    w->waiters = g_slist_prepend(w->waiters, &waiter);
+    if (!g_coroutine_condition_wait_signalled(waiter.coroutine, wait_for_image, data))
+        SPICE_DEBUG("wait for image cancelled");
+    w->waiters = g_slist_remove(w->waiters, &waiter);
+
+    w->wait_time += g_get_monotonic_time() - start;
 }
 
 static void *glz_decoder_window_bits(SpiceGlzDecoderWindow *w, uint64_t id,
@@ -153,42 +232,93 @@ static void *glz_decoder_window_bits(SpiceGlzDecoderWindow *w, uint64_t id,
         .window = w,
         .id = id - dist,
     };
+    struct glz_image *image;
 
-    if (!g_coroutine_condition_wait(g_coroutine_self(), wait_for_image, &data))
-        SPICE_DEBUG("wait for image cancelled");
+    if (!wait_for_image(&data))
+        glz_decoder_window_wait(w, &data);
 
-    int slot = (id - dist) % w->nimages;
+    image = glz_decoder_window_find(w, id - dist);
 
-    g_return_val_if_fail(w->images[slot] != NULL, NULL);
-    g_return_val_if_fail(w->images[slot]->hdr.id == id - dist, NULL);
-    g_return_val_if_fail(w->images[slot]->hdr.gross_pixels >= offset, NULL);
+    g_return_val_if_fail(image != NULL, NULL);
+    g_return_val_if_fail(image->hdr.id == id - dist, NULL);
+    g_return_val_if_fail(image->hdr.gross_pixels >= offset, NULL);
 
-    return w->images[slot]->data + offset * 4;
+    return image->data + offset * 4;
 }
 
 static void glz_decoder_window_release(SpiceGlzDecoderWindow *w,
                                        uint64_t oldest)
 {
-    int slot;
+    if (oldest > w->oldest && oldest - w->oldest >= w->nimages) {
+        uint32_t i;
+
+        /* the whole window goes */
+        for (i = 0; i < w->nimages; i++)
+            glz_decoder_window_put(w, &w->images[i], NULL);
+        w->head = 0;
+        w->oldest = oldest;
+        return;
+    }
 
     while (w->oldest < oldest) {
-        slot = w->oldest % w->nimages;
-        glz_image_destroy(w->images[slot]);
-        w->images[slot] = NULL;
+        glz_decoder_window_put(w, &w->images[w->head], NULL);
+        w->head = (w->head + 1) & (w->nimages - 1);
         w->oldest++;
     }
 }
 
 /* ------------------------------------------------------------------ */
 
+#define GLZ_STREAM_BUF_SIZE (64 * 1024)
+/* the most input a token uses, with the control byte of the next one */
+#define GLZ_STREAM_MIN 128
+
+struct glz_input {
+    uint8_t                 *ip;
+    /* when streaming, the input is read to buf as it is decoded */
+    glz_decoder_read_func   read;
+    gpointer                opaque;
+    uint8_t                 *buf;
+    uint8_t                 *end;
+};
+
 typedef struct GlibGlzDecoder {
     SpiceGlzDecoder         base;
-    uint8_t                 *in_start;
-    uint8_t                 *in_now;
+    struct glz_input        in;
     SpiceGlzDecoderWindow   *window;
     struct glz_image_hdr    image;
+    /* set by glz_decoder_set_stream() for the next image */
+    uint8_t                 *stream_data;
+    glz_decoder_read_func   stream_read;
+    gpointer                stream_opaque;
 } GlibGlzDecoder;
 
+/* keeps the unread input and reads more after it */
+static uint8_t *glz_input_fill(struct glz_input *in, uint8_t *ip)
+{
+    /* broken images can get past the end, into the zeros */
+    size_t left = ip < in->end ? in->end - ip : 0;
+    uint8_t *limit = in->buf + GLZ_STREAM_BUF_SIZE;
+    int n;
+
+    memmove(in->buf, ip, left);
+    in->end = in->buf + left;
+    while (in->end < limit) {
+        n = in->read(in->opaque, in->end, limit - in->end);
+        if (n <= 0)
+            break;
+        in->end += n;
+    }
+    /* so that they read zeros rather than past the buffer */
+    memset(in->end, 0, GLZ_STREAM_MIN);
+
+    return in->buf;
+}
+
+#define GLZ_INPUT_FILL(in, ip)                                                  \
+    if (G_UNLIKELY((in)->read != NULL && (in)->end - (ip) < GLZ_STREAM_MIN))    \
+        (ip) = glz_input_fill((in), (ip))
+
 /*
  * Give hints to the compiler for branch prediction optimization.
  */
@@ -285,9 +415,9 @@ typedef uint16_t rgb16_pixel_t;
 #undef LZ_UNEXPECT_CONDITIONAL
 #undef LZ_EXPECT_CONDITIONAL
 
-typedef size_t (*decode_function)(SpiceGlzDecoderWindow *window,
-                                  uint8_t* in_buf, uint8_t *out_buf, int size,
-                                  uint64_t id, SpicePalette *plt);
+typedef gboolean (*decode_function)(SpiceGlzDecoderWindow *window,
+                                    struct glz_input *in, uint8_t *out_buf, int size,
+                                    uint64_t id, SpicePalette *plt);
 
 // ordered according to LZ_IMAGE_TYPE
 const decode_function DECODE_TO_RGB32[] = {
@@ -319,13 +449,13 @@ const decode_function DECODE_TO_SAME[] = {
 static uint32_t decode_32(GlibGlzDecoder *d)
 {
     uint32_t word = 0;
-    word |= *(d->in_now++);
+    word |= *(d->in.ip++);
     word <<= 8;
-    word |= *(d->in_now++);
+    word |= *(d->in.ip++);
     word <<= 8;
-    word |= *(d->in_now++);
+    word |= *(d->in.ip++);
     word <<= 8;
-    word |= *(d->in_now++);
+    word |= *(d->in.ip++);
     return word;
 }
 
@@ -350,7 +480,7 @@ static void decode_header(GlibGlzDecoder *d)
     version = decode_32(d);
     g_return_if_fail(version == LZ_VERSION);
 
-    tmp = *(d->in_now++);
+    tmp = *(d->in.ip++);
 
     d->image.type = (LzImageType)(tmp & LZ_IMAGE_TYPE_MASK);
     d->image.top_down = (tmp >> LZ_IMAGE_TYPE_LOG) ? true : false;
@@ -381,11 +511,19 @@ static void decode(SpiceGlzDecoder *decoder,
     GlibGlzDecoder *d = SPICE_CONTAINEROF(decoder, GlibGlzDecoder, base);
     LzImageType decoded_type;
     struct glz_image *decoded_image;
-    size_t n_in_bytes_decoded;
 
-    d->in_start = data;
-    d->in_now = data;
+    d->in.ip = data;
+    d->in.read = NULL;
+    if (d->stream_read != NULL && d->stream_data == data) {
+        if (d->in.buf == NULL)
+            d->in.buf = g_malloc(GLZ_STREAM_BUF_SIZE + GLZ_STREAM_MIN);
+        d->in.read = d->stream_read;
+        d->in.opaque = d->stream_opaque;
+        d->in.ip = d->in.end = d->in.buf;
+    }
+    d->stream_read = NULL;
 
+    GLZ_INPUT_FILL(&d->in, d->in.ip);
     decode_header(d);
 
     if (d->image.type == LZ_IMAGE_TYPE_RGBA) {
@@ -396,14 +534,12 @@ static void decode(SpiceGlzDecoder *decoder,
 
     decoded_image = glz_image_new(&d->image, decoded_type, usr_data);
 
-    n_in_bytes_decoded = DECODE_TO_RGB32[d->image.type]
-        (d->window, d->in_now, decoded_image->data,
+    DECODE_TO_RGB32[d->image.type]
+        (d->window, &d->in, decoded_image->data,
          d->image.gross_pixels, d->image.id, palette);
 
-    d->in_now += n_in_bytes_decoded;
-
     if (d->image.type == LZ_IMAGE_TYPE_RGBA) {
-        glz_rgb_alpha_decode(d->window, d->in_now, decoded_image->data,
+        glz_rgb_alpha_decode(d->window, &d->in, decoded_image->data,
                              d->image.gross_pixels, d->image.id, palette);
     }
 
@@ -411,7 +547,7 @@ static void decode(SpiceGlzDecoder *decoder,
 
     { /* release old images from last tail_gap, only if the gap is closed  */
         uint64_t oldest;
-        struct glz_image *image = d->window->images[(d->window->tail_gap - 1) % d->window->nimages];
+        struct glz_image *image = glz_decoder_window_find(d->window, d->window->tail_gap - 1);
 
         g_return_if_fail(image != NULL);
 
@@ -428,19 +564,18 @@ static SpiceGlzDecoderOps glz_decoder_ops = {
 
 void glz_decoder_window_clear(SpiceGlzDecoderWindow *w)
 {
-    int i;
+    uint32_t i;
 
     g_return_if_fail(w->nimages == 0 || w->images != NULL);
 
-    for (i = 0; i < w->nimages; i++) {
-        if (w->images[i]) {
-            glz_image_destroy(w->images[i]);
-        }
-    }
+    for (i = 0; i < w->nimages; i++)
+        glz_decoder_window_put(w, &w->images[i], NULL);
 
-    w->nimages = 16;
+    w->nimages = GLZ_WINDOW_INIT_SLOTS;
     g_free(w->images);
     w->images = g_new0(struct glz_image*, w->nimages);
+    w->head = 0;
+    w->oldest = 0;
     w->tail_gap = 0;
 }
 
@@ -451,11 +586,36 @@ SpiceGlzDecoderWindow *glz_decoder_window_new(void)
     return w;
 }
 
+/* microseconds decoders spent waiting for images decoded by other
+ * display channels */
+uint64_t glz_decoder_window_get_wait_time(SpiceGlzDecoderWindow *w)
+{
+    g_return_val_if_fail(w != NULL, 0);
+
+    return w->wait_time;
+}
+
+/* bytes held by the window, the images are decoded to 32 bits per pixel */
+uint64_t glz_decoder_window_get_size(SpiceGlzDecoderWindow *w)
+{
+    g_return_val_if_fail(w != NULL, 0);
+
+    return w->pixels * 4;
+}
+
+uint64_t glz_decoder_window_get_high_water(SpiceGlzDecoderWindow *w)
+{
+    g_return_val_if_fail(w != NULL, 0);
+
+    return w->pixels_high_water * 4;
+}
+
 void glz_decoder_window_destroy(SpiceGlzDecoderWindow *w)
 {
     if (w == NULL)
         return;
 
+    g_warn_if_fail(w->waiters == NULL);
     glz_decoder_window_clear(w);
     free(w->images);
     free(w);
@@ -469,7 +629,26 @@ SpiceGlzDecoder *glz_decoder_new(SpiceGlzDecoderWindow *w)
     return &d->base;
 }
 
-void glz_decoder_destroy(SpiceGlzDecoder *d)
+/* the next image decoded from data is read with read() as it is decoded,
+ * instead of from data */
+void glz_decoder_set_stream(SpiceGlzDecoder *decoder, uint8_t *data,
+                            glz_decoder_read_func read, gpointer opaque)
 {
+    GlibGlzDecoder *d = SPICE_CONTAINEROF(decoder, GlibGlzDecoder, base);
+
+    d->stream_data = data;
+    d->stream_read = read;
+    d->stream_opaque = opaque;
+}
+
+void glz_decoder_destroy(SpiceGlzDecoder *decoder)
+{
+    GlibGlzDecoder *d;
+
+    if (decoder == NULL)
+        return;
+
+    d = SPICE_CONTAINEROF(decoder, GlibGlzDecoder, base);
+    g_free(d->in.buf);
     free(d);
 }
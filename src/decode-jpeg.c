@@ -31,8 +31,21 @@
 #endif
 
 #include <stdio.h>
+#include <stddef.h>
 #include <jpeglib.h>
 
+#ifndef JCS_EXTENSIONS
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define USE_JPEG_SSSE3 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON)
+#define USE_JPEG_NEON 1
+#include <arm_neon.h>
+#endif
+#endif
+
 typedef struct GlibJpegDecoder
 {
     SpiceJpegDecoder              base;
@@ -44,6 +57,9 @@ typedef struct GlibJpegDecoder
     int      _data_size;
     int      _width;
     int      _height;
+#ifndef JCS_EXTENSIONS
+    void     (*_rgb_to_bgrx)(uint8_t* src, uint8_t* dest, int width);
+#endif
 } GlibJpegDecoder;
 
 static void begin_decode(SpiceJpegDecoder *decoder,
@@ -74,7 +90,8 @@ static void begin_decode(SpiceJpegDecoder *decoder,
     *out_height = d->_height;
 }
 
-/* TODO: move it elsewhere and reuse it in get_pixbuf(), optimize? */
+#ifndef JCS_EXTENSIONS
+/* without libjpeg-turbo, we get RGB and convert it */
 typedef void (*converter_rgb_t)(uint8_t* src, uint8_t* dest, int width);
 
 static void convert_rgb_to_bgr(uint8_t* src, uint8_t* dest, int width)
@@ -102,37 +119,131 @@ static void convert_rgb_to_bgrx(uint8_t* src, uint8_t* dest, int width)
     }
 }
 
+#ifdef USE_JPEG_SSSE3
+/* 4 pixels at a time, each load reads 4 bytes past them */
+__attribute__((target("ssse3")))
+static void convert_rgb_to_bgrx_ssse3(uint8_t* src, uint8_t* dest, int width)
+{
+    const __m128i shuffle = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1,
+                                          8, 7, 6, -1, 11, 10, 9, -1);
+    int x;
+
+    for (x = 0; x + 6 <= width; x += 4) {
+        __m128i rgb = _mm_loadu_si128((const __m128i *)src);
+
+        _mm_storeu_si128((__m128i *)dest, _mm_shuffle_epi8(rgb, shuffle));
+        src += 12;
+        dest += 16;
+    }
+    convert_rgb_to_bgrx(src, dest, width - x);
+}
+#endif
+
+#ifdef USE_JPEG_NEON
+static void convert_rgb_to_bgrx_neon(uint8_t* src, uint8_t* dest, int width)
+{
+    int x;
+
+    for (x = 0; x + 8 <= width; x += 8) {
+        uint8x8x3_t rgb = vld3_u8(src);
+        uint8x8x4_t bgrx;
+
+        bgrx.val[0] = rgb.val[2];
+        bgrx.val[1] = rgb.val[1];
+        bgrx.val[2] = rgb.val[0];
+        bgrx.val[3] = vdup_n_u8(0);
+        vst4_u8(dest, bgrx);
+        src += 24;
+        dest += 32;
+    }
+    convert_rgb_to_bgrx(src, dest, width - x);
+}
+#endif
+
+static converter_rgb_t get_rgb_to_bgrx(void)
+{
+#ifdef USE_JPEG_SSSE3
+    if (__builtin_cpu_supports("ssse3"))
+        return convert_rgb_to_bgrx_ssse3;
+#endif
+#ifdef USE_JPEG_NEON
+    return convert_rgb_to_bgrx_neon;
+#endif
+    return convert_rgb_to_bgrx;
+}
+#endif
+
 static void decode(SpiceJpegDecoder *decoder,
                    uint8_t* dest, int stride, int format)
 {
     GlibJpegDecoder *d = SPICE_CONTAINEROF(decoder, GlibJpegDecoder, base);
-    uint8_t* scan_line = g_alloca(d->_width * 3);
+    struct jpeg_decompress_struct *cinfo = &d->_cinfo;
+    uint8_t *lines[4];
+    unsigned int row, n, i;
+#ifndef JCS_EXTENSIONS
     converter_rgb_t converter = NULL;
-    int row;
+    uint8_t *scan_lines;
+#endif
 
     switch (format) {
     case SPICE_BITMAP_FMT_24BIT:
+#ifdef JCS_EXTENSIONS
+        cinfo->out_color_space = JCS_EXT_BGR;
+#else
         converter = convert_rgb_to_bgr;
+#endif
         break;
     case SPICE_BITMAP_FMT_32BIT:
-        converter = convert_rgb_to_bgrx;
+#ifdef JCS_EXTENSIONS
+        cinfo->out_color_space = JCS_EXT_BGRX;
+#else
+        converter = d->_rgb_to_bgrx;
+#endif
         break;
     default:
         g_warning("bad bitmap format, %d", format);
         return;
     }
 
-    g_return_if_fail(converter != NULL);
+    jpeg_start_decompress(cinfo);
 
-    jpeg_start_decompress(&d->_cinfo);
+    /* libjpeg is the most efficient when given rec_outbuf_height rows */
+    if (cinfo->rec_outbuf_height > G_N_ELEMENTS(lines)) {
+        jpeg_abort_decompress(cinfo);
+        g_return_if_reached();
+    }
+#ifndef JCS_EXTENSIONS
+    scan_lines = g_malloc(cinfo->rec_outbuf_height * d->_width * 3);
+#endif
 
-    for (row = 0; row < d->_height; row++) {
-        jpeg_read_scanlines(&d->_cinfo, &scan_line, 1);
-        converter(scan_line, dest, d->_width);
-        dest += stride;
+    while (cinfo->output_scanline < cinfo->output_height) {
+        row = cinfo->output_scanline;
+        for (i = 0; i < cinfo->rec_outbuf_height; i++) {
+#ifdef JCS_EXTENSIONS
+            lines[i] = dest + (ptrdiff_t)(row + i) * stride;
+#else
+            lines[i] = scan_lines + i * d->_width * 3;
+#endif
+        }
+
+        n = jpeg_read_scanlines(cinfo, lines, cinfo->rec_outbuf_height);
+        if (n == 0) {
+            /* the data ended early, finishing would be an error */
+            g_warning("truncated jpeg image");
+            jpeg_abort_decompress(cinfo);
+            break;
+        }
+#ifndef JCS_EXTENSIONS
+        for (i = 0; i < n; i++)
+            converter(lines[i], dest + (ptrdiff_t)(row + i) * stride, d->_width);
+#endif
     }
 
-    jpeg_finish_decompress(&d->_cinfo);
+#ifndef JCS_EXTENSIONS
+    g_free(scan_lines);
+#endif
+    if (cinfo->output_scanline == cinfo->output_height)
+        jpeg_finish_decompress(cinfo);
 }
 
 static SpiceJpegDecoderOps jpeg_decoder_ops = {
@@ -178,6 +289,9 @@ SpiceJpegDecoder *jpeg_decoder_new(void)
     d->_cinfo.src->term_source = jpeg_decoder_term_source;
 
     d->base.ops = &jpeg_decoder_ops;
+#ifndef JCS_EXTENSIONS
+    d->_rgb_to_bgrx = get_rgb_to_bgrx();
+#endif
 
     return &d->base;
 }
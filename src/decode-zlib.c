@@ -29,8 +29,33 @@ typedef struct GlibZlibDecoder
 {
     SpiceZlibDecoder         base;
     z_stream                 _z_strm;
+    /* decodes what we inflate, when set */
+    SpiceGlzDecoder          *glz;
+    int                      out_left;
 } GlibZlibDecoder;
 
+/* called by the glz decoder as it needs input */
+static int glz_read(gpointer opaque, uint8_t *buf, int size)
+{
+    GlibZlibDecoder *d = opaque;
+    int z_ret;
+
+    size = MIN(size, d->out_left);
+    d->_z_strm.next_out = buf;
+    d->_z_strm.avail_out = size;
+
+    z_ret = inflate(&d->_z_strm, Z_SYNC_FLUSH);
+
+    /* Z_BUF_ERROR is when there is nothing left */
+    if (z_ret != Z_OK && z_ret != Z_STREAM_END && z_ret != Z_BUF_ERROR) {
+        g_warning("zlib inflate failed, error %d", z_ret);
+    }
+
+    size -= d->_z_strm.avail_out;
+    d->out_left -= size;
+    return size;
+}
+
 static void decode(SpiceZlibDecoder *decoder,
                    uint8_t *data, int data_size,
                    uint8_t *dest, int dest_size)
@@ -41,6 +66,15 @@ static void decode(SpiceZlibDecoder *decoder,
     inflateReset(&d->_z_strm);
     d->_z_strm.next_in = data;
     d->_z_strm.avail_in = data_size;
+
+    if (d->glz != NULL) {
+        /* dest is only read by the glz decoder, which inflates as it
+         * decodes rather than going through the whole image in dest */
+        d->out_left = dest_size;
+        glz_decoder_set_stream(d->glz, dest, glz_read, d);
+        return;
+    }
+
     d->_z_strm.next_out = dest;
     d->_z_strm.avail_out = dest_size;
 
@@ -55,7 +89,8 @@ static SpiceZlibDecoderOps zlib_decoder_ops = {
     .decode = decode,
 };
 
-SpiceZlibDecoder *zlib_decoder_new(void)
+/* glz, if not NULL, is the decoder the output goes to */
+SpiceZlibDecoder *zlib_decoder_new(SpiceGlzDecoder *glz)
 {
     GlibZlibDecoder *d = g_new0(GlibZlibDecoder, 1);
     int z_ret;
@@ -72,6 +107,7 @@ SpiceZlibDecoder *zlib_decoder_new(void)
     }
 
     d->base.ops = &zlib_decoder_ops;
+    d->glz = glz;
 
     return &d->base;
 
@@ -29,11 +29,19 @@ typedef struct SpiceGlzDecoderWindow SpiceGlzDecoderWindow;
 SpiceGlzDecoderWindow *glz_decoder_window_new(void);
 void glz_decoder_window_clear(SpiceGlzDecoderWindow *w);
 void glz_decoder_window_destroy(SpiceGlzDecoderWindow *w);
+uint64_t glz_decoder_window_get_wait_time(SpiceGlzDecoderWindow *w);
+uint64_t glz_decoder_window_get_size(SpiceGlzDecoderWindow *w);
+uint64_t glz_decoder_window_get_high_water(SpiceGlzDecoderWindow *w);
+
+/* reads up to size bytes of input to buf, returns how many */
+typedef int (*glz_decoder_read_func)(gpointer opaque, uint8_t *buf, int size);
 
 SpiceGlzDecoder *glz_decoder_new(SpiceGlzDecoderWindow *w);
+void glz_decoder_set_stream(SpiceGlzDecoder *d, uint8_t *data,
+                            glz_decoder_read_func read, gpointer opaque);
 void glz_decoder_destroy(SpiceGlzDecoder *d);
 
-SpiceZlibDecoder *zlib_decoder_new(void);
+SpiceZlibDecoder *zlib_decoder_new(SpiceGlzDecoder *glz);
 void zlib_decoder_destroy(SpiceZlibDecoder *d);
 
 SpiceJpegDecoder *jpeg_decoder_new(void);
@@ -28,6 +28,8 @@ typedef struct _GConditionWaitSource
     GSource src;
     GConditionWaitFunc func;
     gpointer data;
+    /* only check func after g_coroutine_condition_signal() */
+    gboolean signalled;
 } GConditionWaitSource;
 
 GCoroutine* g_coroutine_self(void)
@@ -91,6 +93,17 @@ void g_coroutine_wakeup(GCoroutine *coroutine)
         coroutine_yieldto(&coroutine->coroutine, NULL);
 }
 
+static gboolean g_condition_wait_ready(GConditionWaitSource *vsrc)
+{
+    if (vsrc->signalled) {
+        if (!vsrc->self->condition_signalled)
+            return FALSE;
+        vsrc->self->condition_signalled = FALSE;
+    }
+
+    return vsrc->func(vsrc->data);
+}
+
 /*
  * Call immediately before the main loop does an iteration. Returns
  * true if the condition we're checking is ready for dispatch
@@ -99,7 +112,7 @@ static gboolean g_condition_wait_prepare(GSource *src,
 					 int *timeout) {
     GConditionWaitSource *vsrc = (GConditionWaitSource *)src;
     *timeout = -1;
-    return vsrc->func(vsrc->data);
+    return g_condition_wait_ready(vsrc);
 }
 
 /*
@@ -109,7 +122,7 @@ static gboolean g_condition_wait_prepare(GSource *src,
 static gboolean g_condition_wait_check(GSource *src)
 {
     GConditionWaitSource *vsrc = (GConditionWaitSource *)src;
-    return vsrc->func(vsrc->data);
+    return g_condition_wait_ready(vsrc);
 }
 
 static gboolean g_condition_wait_dispatch(GSource *src G_GNUC_UNUSED,
@@ -131,21 +144,8 @@ static gboolean g_condition_wait_helper(gpointer data)
     return FALSE;
 }
 
-/*
- * g_coroutine_condition_wait:
- * @coroutine: the coroutine to wait on
- * @func: the condition callback
- * @data: the user data passed to @func callback
- *
- * This function will wait on caller coroutine until @func returns %TRUE.
- *
- * @func is called when entering the main loop from the main context (coroutine).
- *
- * The condition can be cancelled by calling g_coroutine_wakeup()
- *
- * Returns: %TRUE if condition reached, %FALSE if not and cancelled
- */
-gboolean g_coroutine_condition_wait(GCoroutine *self, GConditionWaitFunc func, gpointer data)
+static gboolean condition_wait(GCoroutine *self, GConditionWaitFunc func,
+                               gpointer data, gboolean signalled)
 {
     GSource *src;
     GConditionWaitSource *vsrc;
@@ -160,7 +160,7 @@ gboolean g_coroutine_condition_wait(GCoroutine *self, GConditionWaitFunc func, g
 
     /*
      * Don't have it, so yield to the main loop, checking the condition
-     * on each iteration of the main loop
+     * on each iteration of the main loop, or once signalled
      */
     src = g_source_new(&waitFuncs, sizeof(GConditionWaitSource));
     vsrc = (GConditionWaitSource *)src;
@@ -168,6 +168,8 @@ gboolean g_coroutine_condition_wait(GCoroutine *self, GConditionWaitFunc func, g
     vsrc->func = func;
     vsrc->data = data;
     vsrc->self = self;
+    vsrc->signalled = signalled;
+    self->condition_signalled = FALSE;
 
     self->condition_id = g_source_attach(src, NULL);
     g_source_set_callback(src, g_condition_wait_helper, self, NULL);
@@ -182,6 +184,57 @@ gboolean g_coroutine_condition_wait(GCoroutine *self, GConditionWaitFunc func, g
     return TRUE;
 }
 
+/*
+ * g_coroutine_condition_wait:
+ * @coroutine: the coroutine to wait on
+ * @func: the condition callback
+ * @data: the user data passed to @func callback
+ *
+ * This function will wait on caller coroutine until @func returns %TRUE.
+ *
+ * @func is called when entering the main loop from the main context (coroutine).
+ *
+ * The condition can be cancelled by calling g_coroutine_wakeup()
+ *
+ * Returns: %TRUE if condition reached, %FALSE if not and cancelled
+ */
+gboolean g_coroutine_condition_wait(GCoroutine *self, GConditionWaitFunc func, gpointer data)
+{
+    return condition_wait(self, func, data, FALSE);
+}
+
+/*
+ * g_coroutine_condition_wait_signalled:
+ * @coroutine: the coroutine to wait on
+ * @func: the condition callback
+ * @data: the user data passed to @func callback
+ *
+ * Like g_coroutine_condition_wait(), but @func is only checked again
+ * after g_coroutine_condition_signal() is called for @coroutine, instead
+ * of on every main loop iteration.
+ *
+ * Returns: %TRUE if condition reached, %FALSE if not and cancelled
+ */
+gboolean g_coroutine_condition_wait_signalled(GCoroutine *self,
+                                              GConditionWaitFunc func, gpointer data)
+{
+    return condition_wait(self, func, data, TRUE);
+}
+
+/*
+ * g_coroutine_condition_signal:
+ * @coroutine: a coroutine in g_coroutine_condition_wait_signalled()
+ *
+ * Makes @coroutine check its condition on the next main loop iteration.
+ */
+void g_coroutine_condition_signal(GCoroutine *coroutine)
+{
+    g_return_if_fail(coroutine != NULL);
+
+    coroutine->condition_signalled = TRUE;
+    g_main_context_wakeup(NULL);
+}
+
 struct signal_data
 {
     gpointer instance;
@@ -33,6 +33,8 @@ struct _GCoroutine
     struct coroutine coroutine;
     guint wait_id;
     guint condition_id;
+    /* g_coroutine_condition_signal() was called since the last check */
+    gboolean condition_signalled;
 };
 
 /*
@@ -54,6 +56,9 @@ GIOCondition g_coroutine_socket_wait    (GCoroutine *coroutine,
                                          GSocket *sock, GIOCondition cond);
 gboolean     g_coroutine_condition_wait (GCoroutine *coroutine,
                                          GConditionWaitFunc func, gpointer data);
+gboolean     g_coroutine_condition_wait_signalled(GCoroutine *coroutine,
+                                         GConditionWaitFunc func, gpointer data);
+void         g_coroutine_condition_signal(GCoroutine *coroutine);
 void         g_coroutine_condition_cancel(GCoroutine *coroutine);
 
 void         g_coroutine_signal_emit (gpointer instance, guint signal_id,
@@ -19,118 +19,450 @@
 # define SPICE_CHANNEL_CACHE_H_
 
 #include <inttypes.h> /* For PRIx64 */
+#include <string.h>
 #include "common/mem.h"
 #include "common/ring.h"
+#include "spice-util.h"
 
 G_BEGIN_DECLS
 
-typedef struct display_cache_item {
+#define CACHE_NONE G_MAXUINT32
+
+typedef struct display_cache_entry {
     guint64                     id;
-    gboolean                    lossy;
+    gpointer                    value;
+    gsize                       size;
     guint32                     ref_count;
-} display_cache_item;
+    gboolean                    lossy;
+    /* entry indices in the LRU list, CACHE_NONE terminated; next is the
+     * next free entry for unused entries */
+    guint32                     prev;
+    guint32                     next;
+} display_cache_entry;
+
+typedef struct display_cache_slot {
+    guint64                     id;
+    /* entry index + 1, 0 for an empty slot */
+    guint32                     entry;
+} display_cache_slot;
+
+typedef struct display_cache_stats {
+    guint64     hits;
+    guint64     misses;
+    guint64     evictions;
+    gsize       bytes;
+    /* the most bytes held at once */
+    gsize       high_water;
+} display_cache_stats;
+
+/* called when an entry is added for the id someone waits for */
+typedef void (*display_cache_notify)(gpointer data);
+
+typedef struct display_cache_waiter {
+    guint64                     id;
+    display_cache_notify        notify;
+    gpointer                    data;
+} display_cache_waiter;
 
+/* an open addressing table keyed by the 64-bit id with linear probing;
+ * the slots only hold the id and an index into the entries array so
+ * that probing stays within a few cache lines and entries don't move
+ * when the table grows */
 typedef struct display_cache {
-    GHashTable  *table;
-    gboolean    ref_counted;
+    display_cache_slot  *slots;
+    guint32             mask;
+    guint32             count;
+    display_cache_entry *entries;
+    guint32             n_entries;
+    guint32             free_entry;
+    /* most recently used first */
+    guint32             lru_head;
+    guint32             lru_tail;
+    GDestroyNotify      value_destroy;
+    gboolean            ref_counted;
+    const char          *name;
+    /* least recently used entries are evicted above this, 0 for no limit */
+    gsize               max_bytes;
+    display_cache_stats stats;
+    /* display_cache_waiter, there are few at a time */
+    GSList              *waiters;
 }display_cache;
 
-static inline display_cache_item* cache_item_new(guint64 id, gboolean lossy)
+#define CACHE_MIN_SLOTS 64
+
+static inline display_cache* cache_new(const char *name, GDestroyNotify value_destroy)
+{
+    display_cache * self = g_slice_new0(display_cache);
+    self->slots = g_new0(display_cache_slot, CACHE_MIN_SLOTS);
+    self->mask = CACHE_MIN_SLOTS - 1;
+    self->free_entry = CACHE_NONE;
+    self->lru_head = self->lru_tail = CACHE_NONE;
+    self->value_destroy = value_destroy;
+    self->ref_counted = FALSE;
+    self->name = name;
+    return self;
+}
+
+static inline display_cache * cache_image_new(const char *name, GDestroyNotify value_destroy)
 {
-    display_cache_item *self = g_slice_new(display_cache_item);
-    self->id = id;
-    self->lossy = lossy;
-    self->ref_count = 1;
+    display_cache * self = cache_new(name, value_destroy);
+    self->ref_counted = TRUE;
     return self;
+};
+
+/* entries are normally removed when the server says so, only set a limit
+ * on caches whose misses are harmless */
+static inline void cache_set_max_bytes(display_cache *cache, gsize max_bytes)
+{
+    cache->max_bytes = max_bytes;
 }
 
-static inline void cache_item_free(display_cache_item *self)
+static inline const display_cache_stats *cache_get_stats(display_cache *cache)
 {
-    g_slice_free(display_cache_item, self);
+    return &cache->stats;
 }
 
-static inline display_cache* cache_new(GDestroyNotify value_destroy)
+static inline void cache_log_stats(display_cache *cache)
 {
-    display_cache * self = g_slice_new(display_cache);
-    self->table = g_hash_table_new_full(g_int64_hash, g_int64_equal,
-                                       (GDestroyNotify) cache_item_free,
-                                       value_destroy);
-    self->ref_counted = FALSE;
-    return self;
+    SPICE_DEBUG("%s cache: %" G_GUINT64_FORMAT " hits, %" G_GUINT64_FORMAT
+                " misses, %" G_GUINT64_FORMAT " evictions, %" G_GSIZE_FORMAT
+                " bytes, %" G_GSIZE_FORMAT " bytes at most",
+                cache->name, cache->stats.hits, cache->stats.misses,
+                cache->stats.evictions, cache->stats.bytes,
+                cache->stats.high_water);
 }
 
-static inline display_cache * cache_image_new(GDestroyNotify value_destroy)
+/* appends "name":{...} with the statistics of the cache */
+static inline void cache_stats_to_json(display_cache *cache, GString *json)
 {
-    display_cache * self = cache_new(value_destroy);
-    self->ref_counted = TRUE;
-    return self;
-};
+    g_string_append_printf(json,
+                           "\"%s\":{\"hits\":%" G_GUINT64_FORMAT
+                           ",\"misses\":%" G_GUINT64_FORMAT
+                           ",\"evictions\":%" G_GUINT64_FORMAT
+                           ",\"bytes\":%" G_GSIZE_FORMAT
+                           ",\"high-water\":%" G_GSIZE_FORMAT "}",
+                           cache->name, cache->stats.hits, cache->stats.misses,
+                           cache->stats.evictions, cache->stats.bytes,
+                           cache->stats.high_water);
+}
+
+static inline guint32 cache_hash(guint64 id)
+{
+    /* ids are often sequential, mix all the bits in */
+    id ^= id >> 33;
+    id *= G_GUINT64_CONSTANT(0xff51afd7ed558ccd);
+    id ^= id >> 33;
+    return (guint32)id;
+}
+
+/* returns the slot holding id, CACHE_NONE if there is none */
+static inline guint32 cache_lookup_slot(display_cache *cache, guint64 id)
+{
+    guint32 i = cache_hash(id) & cache->mask;
+
+    while (cache->slots[i].entry != 0) {
+        if (cache->slots[i].id == id)
+            return i;
+        i = (i + 1) & cache->mask;
+    }
+
+    return CACHE_NONE;
+}
+
+static inline void cache_insert_slot(display_cache *cache, guint64 id, guint32 entry)
+{
+    guint32 i = cache_hash(id) & cache->mask;
+
+    while (cache->slots[i].entry != 0)
+        i = (i + 1) & cache->mask;
+
+    cache->slots[i].id = id;
+    cache->slots[i].entry = entry + 1;
+}
+
+static inline void cache_grow_slots(display_cache *cache)
+{
+    display_cache_slot *old = cache->slots;
+    guint32 n_old = cache->mask + 1;
+    guint32 i;
+
+    cache->slots = g_new0(display_cache_slot, n_old * 2);
+    cache->mask = n_old * 2 - 1;
+    for (i = 0; i < n_old; i++) {
+        if (old[i].entry != 0)
+            cache_insert_slot(cache, old[i].id, old[i].entry - 1);
+    }
+    g_free(old);
+}
+
+/* backward shift deletion, keeps every probe sequence unbroken */
+static inline void cache_delete_slot(display_cache *cache, guint32 i)
+{
+    guint32 j = i;
+
+    for (;;) {
+        guint32 home;
+
+        j = (j + 1) & cache->mask;
+        if (cache->slots[j].entry == 0)
+            break;
+
+        /* move j into the hole unless its home lies cyclically in (i, j] */
+        home = cache_hash(cache->slots[j].id) & cache->mask;
+        if (((j - home) & cache->mask) >= ((j - i) & cache->mask)) {
+            cache->slots[i] = cache->slots[j];
+            i = j;
+        }
+    }
+    cache->slots[i].entry = 0;
+}
+
+static inline void cache_lru_unlink(display_cache *cache, guint32 e)
+{
+    display_cache_entry *entry = &cache->entries[e];
+
+    if (entry->prev != CACHE_NONE)
+        cache->entries[entry->prev].next = entry->next;
+    else
+        cache->lru_head = entry->next;
+    if (entry->next != CACHE_NONE)
+        cache->entries[entry->next].prev = entry->prev;
+    else
+        cache->lru_tail = entry->prev;
+}
+
+static inline void cache_lru_push_head(display_cache *cache, guint32 e)
+{
+    display_cache_entry *entry = &cache->entries[e];
+
+    entry->prev = CACHE_NONE;
+    entry->next = cache->lru_head;
+    if (cache->lru_head != CACHE_NONE)
+        cache->entries[cache->lru_head].prev = e;
+    else
+        cache->lru_tail = e;
+    cache->lru_head = e;
+}
+
+static inline guint32 cache_entry_new(display_cache *cache)
+{
+    guint32 e;
+
+    if (cache->free_entry == CACHE_NONE) {
+        guint32 n = MAX(cache->n_entries * 2, 16);
+
+        cache->entries = g_renew(display_cache_entry, cache->entries, n);
+        for (e = cache->n_entries; e < n; e++)
+            cache->entries[e].next = e + 1 < n ? e + 1 : CACHE_NONE;
+        cache->free_entry = cache->n_entries;
+        cache->n_entries = n;
+    }
+
+    e = cache->free_entry;
+    cache->free_entry = cache->entries[e].next;
+
+    return e;
+}
+
+/* drops the entry in slot i, the caller destroys the value */
+static inline gpointer cache_delete(display_cache *cache, guint32 i)
+{
+    guint32 e = cache->slots[i].entry - 1;
+    display_cache_entry *entry = &cache->entries[e];
+    gpointer value = entry->value;
+
+    cache_delete_slot(cache, i);
+    cache->count--;
+    cache_lru_unlink(cache, e);
+    cache->stats.bytes -= entry->size;
+    entry->next = cache->free_entry;
+    cache->free_entry = e;
+
+    return value;
+}
+
+static inline void cache_destroy_value(display_cache *cache, gpointer value)
+{
+    if (cache->value_destroy)
+        cache->value_destroy(value);
+}
+
+/* looks id up without counting it in the statistics nor touching the
+ * LRU order, for checks that are repeated */
+static inline display_cache_entry *cache_peek(display_cache *cache, uint64_t id)
+{
+    guint32 i = cache_lookup_slot(cache, id);
+
+    if (i == CACHE_NONE)
+        return NULL;
+
+    return &cache->entries[cache->slots[i].entry - 1];
+}
+
+static inline display_cache_entry *cache_lookup(display_cache *cache, uint64_t id)
+{
+    display_cache_entry *entry = cache_peek(cache, id);
+    guint32 e;
+
+    if (entry == NULL) {
+        cache->stats.misses++;
+        return NULL;
+    }
+
+    cache->stats.hits++;
+    e = entry - cache->entries;
+    if (cache->lru_head != e) {
+        cache_lru_unlink(cache, e);
+        cache_lru_push_head(cache, e);
+    }
+
+    return &cache->entries[e];
+}
 
 static inline gpointer cache_find(display_cache *cache, uint64_t id)
 {
-    return g_hash_table_lookup(cache->table, &id);
+    display_cache_entry *entry = cache_lookup(cache, id);
+
+    return entry != NULL ? entry->value : NULL;
 }
 
 static inline gpointer cache_find_lossy(display_cache *cache, uint64_t id, gboolean *lossy)
 {
-    gpointer value;
-    display_cache_item *item;
+    display_cache_entry *entry = cache_lookup(cache, id);
 
-    if (!g_hash_table_lookup_extended(cache->table, &id, (gpointer*)&item, &value))
+    if (entry == NULL)
         return NULL;
 
-    *lossy = item->lossy;
+    *lossy = entry->lossy;
 
-    return value;
+    return entry->value;
 }
 
+/* waiter is notified whenever an entry is added for waiter->id, until
+ * it is removed with cache_remove_waiter() */
+static inline void cache_add_waiter(display_cache *cache, display_cache_waiter *waiter)
+{
+    cache->waiters = g_slist_prepend(cache->waiters, waiter);
+}
+
+static inline void cache_remove_waiter(display_cache *cache, display_cache_waiter *waiter)
+{
+    cache->waiters = g_slist_remove(cache->waiters, waiter);
+}
+
+static inline void cache_notify_waiters(display_cache *cache, guint64 id)
+{
+    GSList *l;
+
+    for (l = cache->waiters; l != NULL; l = l->next) {
+        display_cache_waiter *waiter = l->data;
+
+        if (waiter->id == id)
+            waiter->notify(waiter->data);
+    }
+}
+
+static inline void cache_evict(display_cache *cache)
+{
+    /* never the entry that was just added */
+    while (cache->stats.bytes > cache->max_bytes &&
+           cache->lru_tail != cache->lru_head) {
+        guint64 id = cache->entries[cache->lru_tail].id;
+
+        cache->stats.evictions++;
+        cache_destroy_value(cache, cache_delete(cache, cache_lookup_slot(cache, id)));
+    }
+}
+
+/* size is the memory used by the value, for the accounting */
 static inline void cache_add_lossy(display_cache *cache, uint64_t id,
-                                   gpointer value, gboolean lossy)
+                                   gpointer value, gsize size, gboolean lossy)
 {
-    display_cache_item *item = cache_item_new(id, lossy);
-    display_cache_item *current_item;
-    gpointer            current_image;
+    guint32 ref_count = 1;
+    guint32 i;
+    guint32 e;
 
-    //If image is currently in the table add its reference count before replacing it
-    if(cache->ref_counted) {
-        if(g_hash_table_lookup_extended(cache->table, &id, (gpointer*) &current_item,
-                                        (gpointer*) &current_image)) {
-            item->ref_count = current_item->ref_count + 1;
-        }
+    i = cache_lookup_slot(cache, id);
+    if (i != CACHE_NONE) {
+        //If image is currently in the table add its reference count before replacing it
+        if (cache->ref_counted)
+            ref_count = cache->entries[cache->slots[i].entry - 1].ref_count + 1;
+        cache_destroy_value(cache, cache_delete(cache, i));
     }
-    g_hash_table_replace(cache->table, item, value);
+
+    /* keep the load factor under 3/4 */
+    if ((cache->count + 1) * 4 > (cache->mask + 1) * 3)
+        cache_grow_slots(cache);
+
+    e = cache_entry_new(cache);
+    cache->entries[e].id = id;
+    cache->entries[e].value = value;
+    cache->entries[e].size = size;
+    cache->entries[e].ref_count = ref_count;
+    cache->entries[e].lossy = lossy;
+    cache_insert_slot(cache, id, e);
+    cache->count++;
+    cache_lru_push_head(cache, e);
+
+    cache->stats.bytes += size;
+    if (cache->max_bytes != 0)
+        cache_evict(cache);
+    cache->stats.high_water = MAX(cache->stats.high_water, cache->stats.bytes);
+
+    if (cache->waiters != NULL)
+        cache_notify_waiters(cache, id);
 }
 
-static inline void cache_add(display_cache *cache, uint64_t id, gpointer value)
+static inline void cache_add(display_cache *cache, uint64_t id, gpointer value,
+                             gsize size)
 {
-    cache_add_lossy(cache, id, value, FALSE);
+    cache_add_lossy(cache, id, value, size, FALSE);
 }
 
 static inline gboolean cache_remove(display_cache *cache, uint64_t id)
 {
-    display_cache_item * item;
-    gpointer value;
+    guint32 i = cache_lookup_slot(cache, id);
+    display_cache_entry *entry;
 
-    if( g_hash_table_lookup_extended(cache->table, &id, (gpointer*) &item, &value)) {
-        --item->ref_count;
-        if(!cache->ref_counted || item->ref_count == 0 ) {
-            return g_hash_table_remove(cache->table, &id);
-        }
-    }
-    else {
+    if (i == CACHE_NONE)
         return FALSE;
-    }
+
+    entry = &cache->entries[cache->slots[i].entry - 1];
+    --entry->ref_count;
+    if (!cache->ref_counted || entry->ref_count == 0)
+        cache_destroy_value(cache, cache_delete(cache, i));
+
     return TRUE;
 }
 
 static inline void cache_clear(display_cache *cache)
 {
-    g_hash_table_remove_all(cache->table);
+    guint32 e;
+
+    cache_log_stats(cache);
+
+    /* the values may be destroyed once the cache is consistent again */
+    e = cache->lru_head;
+    memset(cache->slots, 0, (cache->mask + 1) * sizeof(display_cache_slot));
+    cache->count = 0;
+    cache->lru_head = cache->lru_tail = CACHE_NONE;
+    cache->stats.bytes = 0;
+    while (e != CACHE_NONE) {
+        guint32 next = cache->entries[e].next;
+
+        cache_destroy_value(cache, cache->entries[e].value);
+        cache->entries[e].next = cache->free_entry;
+        cache->free_entry = e;
+        e = next;
+    }
 }
 
 static inline void cache_free(display_cache *cache)
 {
-    g_hash_table_unref(cache->table);
+    cache_clear(cache);
+    g_warn_if_fail(cache->waiters == NULL);
+    g_free(cache->slots);
+    g_free(cache->entries);
     g_slice_free(display_cache, cache);
 }
 
@@ -31,6 +31,7 @@
 #include "spice-util-priv.h"
 #include "coroutine.h"
 #include "gio-coroutine.h"
+#include "spice-channel-stats.h"
 
 #include "common/client_marshallers.h"
 #include "common/client_demarshallers.h"
@@ -57,6 +58,8 @@ struct _SpiceMsgIn {
     SpiceChannel          *channel;
     uint8_t               header[MAX_SPICE_DATA_HEADER_SIZE];
     uint8_t               *data;
+    /* allocated size of data, 0 when it belongs to the parent */
+    uint32_t              dsize;
     int                   dpos;
     uint8_t               *parsed;
     size_t                psize;
@@ -77,6 +80,9 @@ enum spice_channel_state {
 struct _SpiceChannelClassPrivate
 {
     GArray *handlers;
+    /* appends ,"name":value members to the spice_channel_get_stats()
+     * object, main context */
+    void (*stats_to_json)(SpiceChannel *channel, GString *json);
 };
 
 struct _SpiceChannelPrivate {
@@ -96,6 +102,11 @@ struct _SpiceChannelPrivate {
     unsigned int                sasl_decoded_offset;
 #endif
 
+    /* read from the wire, not consumed yet */
+    guint8                      *rbuf;
+    gsize                       rbuf_pos;
+    gsize                       rbuf_end;
+
     gboolean                    use_mini_header;
     uint64_t                    out_serial;
     uint64_t                    in_serial;
@@ -138,6 +149,11 @@ struct _SpiceChannelPrivate {
     GArray                      *remote_common_caps;
 
     gsize                       total_read_bytes;
+    gsize                       total_read_calls;
+    gsize                       total_read_messages;
+    gsize                       total_write_calls;
+    gsize                       total_write_messages;
+    channel_stats               stats;
     uint64_t                    last_message_serial;
     GSList                      *flushing;
 
@@ -0,0 +1,157 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2010 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include <string.h>
+
+#include "spice-channel-stats.h"
+
+/*
+ * Counters and latency histograms of a channel, updated in the
+ * coroutine context and read from the main context. The histograms have
+ * power of two buckets, cheap to update and precise enough to tell a
+ * stall from a slow handler.
+ */
+
+static guint channel_histogram_bucket(gint64 us)
+{
+    guint bucket = 0;
+
+    while (us > 0 && bucket < CHANNEL_HISTOGRAM_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+
+    return bucket;
+}
+
+G_GNUC_INTERNAL
+void channel_histogram_add(channel_histogram *h, gint64 us)
+{
+    if (us < 0)
+        us = 0;
+
+    h->count++;
+    h->total += us;
+    h->max = MAX(h->max, (guint64)us);
+    h->buckets[channel_histogram_bucket(us)]++;
+}
+
+static void channel_type_stats_free(gpointer data)
+{
+    g_slice_free(channel_type_stats, data);
+}
+
+G_GNUC_INTERNAL
+void channel_stats_init(channel_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->rx = g_ptr_array_new_with_free_func(channel_type_stats_free);
+    stats->tx = g_ptr_array_new_with_free_func(channel_type_stats_free);
+}
+
+G_GNUC_INTERNAL
+void channel_stats_clear(channel_stats *stats)
+{
+    g_clear_pointer(&stats->rx, g_ptr_array_unref);
+    g_clear_pointer(&stats->tx, g_ptr_array_unref);
+}
+
+G_GNUC_INTERNAL
+channel_type_stats *channel_stats_get_type(GPtrArray *types, guint type)
+{
+    if (type >= types->len)
+        g_ptr_array_set_size(types, type + 1);
+    if (g_ptr_array_index(types, type) == NULL)
+        g_ptr_array_index(types, type) = g_slice_new0(channel_type_stats);
+
+    return g_ptr_array_index(types, type);
+}
+
+G_GNUC_INTERNAL
+void channel_stats_add_rx(channel_stats *stats, guint type, gsize bytes)
+{
+    channel_type_stats *t = channel_stats_get_type(stats->rx, type);
+
+    t->messages++;
+    t->bytes += bytes;
+}
+
+G_GNUC_INTERNAL
+void channel_stats_add_tx(channel_stats *stats, guint type, gsize bytes)
+{
+    channel_type_stats *t = channel_stats_get_type(stats->tx, type);
+
+    t->messages++;
+    t->bytes += bytes;
+}
+
+G_GNUC_INTERNAL
+void channel_stats_add_handler(channel_stats *stats, guint type, gint64 us)
+{
+    channel_histogram_add(&channel_stats_get_type(stats->rx, type)->handler, us);
+}
+
+/* {"count":..,"total-us":..,"max-us":..,"buckets":[..]}, without the
+ * empty buckets at the end */
+G_GNUC_INTERNAL
+void channel_histogram_to_json(const channel_histogram *h, GString *json)
+{
+    guint i, n = CHANNEL_HISTOGRAM_BUCKETS;
+
+    while (n > 0 && h->buckets[n - 1] == 0)
+        n--;
+
+    g_string_append_printf(json,
+                           "{\"count\":%" G_GUINT64_FORMAT
+                           ",\"total-us\":%" G_GUINT64_FORMAT
+                           ",\"max-us\":%" G_GUINT64_FORMAT
+                           ",\"buckets\":[",
+                           h->count, h->total, h->max);
+    for (i = 0; i < n; i++)
+        g_string_append_printf(json, "%s%" G_GUINT64_FORMAT,
+                               i ? "," : "", h->buckets[i]);
+    g_string_append(json, "]}");
+}
+
+/* {"<type>":{"messages":..,"bytes":..[,"handler":{..}]},..} */
+G_GNUC_INTERNAL
+void channel_stats_types_to_json(GPtrArray *types, gboolean handler, GString *json)
+{
+    gboolean first = TRUE;
+    guint i;
+
+    g_string_append_c(json, '{');
+    for (i = 0; i < types->len; i++) {
+        const channel_type_stats *t = g_ptr_array_index(types, i);
+
+        if (t == NULL)
+            continue;
+        g_string_append_printf(json,
+                               "%s\"%u\":{\"messages\":%" G_GUINT64_FORMAT
+                               ",\"bytes\":%" G_GUINT64_FORMAT,
+                               first ? "" : ",", i, t->messages, t->bytes);
+        if (handler) {
+            g_string_append(json, ",\"handler\":");
+            channel_histogram_to_json(&t->handler, json);
+        }
+        g_string_append_c(json, '}');
+        first = FALSE;
+    }
+    g_string_append_c(json, '}');
+}
@@ -0,0 +1,70 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2010 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef SPICE_CHANNEL_STATS_H_
+# define SPICE_CHANNEL_STATS_H_
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* bucket i counts the times from 2^(i-1) us up to 2^i us, the last one
+ * everything from about 4s on */
+#define CHANNEL_HISTOGRAM_BUCKETS 24
+
+typedef struct channel_histogram {
+    guint64     count;
+    /* in us */
+    guint64     total;
+    guint64     max;
+    guint64     buckets[CHANNEL_HISTOGRAM_BUCKETS];
+} channel_histogram;
+
+typedef struct channel_type_stats {
+    guint64             messages;
+    guint64             bytes;
+    /* time spent in the handler, received messages only */
+    channel_histogram   handler;
+} channel_type_stats;
+
+typedef struct channel_stats {
+    /* channel_type_stats by message type, NULL for types not seen */
+    GPtrArray           *rx;
+    GPtrArray           *tx;
+    /* waiting for the socket in the middle of a read or of a write */
+    channel_histogram   read_wait;
+    channel_histogram   write_wait;
+    /* from sending an ack to receiving the next message, the server
+     * stops sending when the client doesn't ack in time */
+    channel_histogram   ack_wait;
+    gint64              ack_time;
+    guint               xmit_queue_max;
+} channel_stats;
+
+void channel_histogram_add(channel_histogram *h, gint64 us);
+void channel_stats_init(channel_stats *stats);
+void channel_stats_clear(channel_stats *stats);
+channel_type_stats *channel_stats_get_type(GPtrArray *types, guint type);
+void channel_stats_add_rx(channel_stats *stats, guint type, gsize bytes);
+void channel_stats_add_tx(channel_stats *stats, guint type, gsize bytes);
+void channel_stats_add_handler(channel_stats *stats, guint type, gint64 us);
+void channel_histogram_to_json(const channel_histogram *h, GString *json);
+void channel_stats_types_to_json(GPtrArray *types, gboolean handler, GString *json);
+
+G_END_DECLS
+
+#endif // SPICE_CHANNEL_STATS_H_
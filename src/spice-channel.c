@@ -44,6 +44,9 @@
 #ifdef HAVE_ARPA_INET_H
 #include <arpa/inet.h>
 #endif
+#ifndef G_OS_WIN32
+#include <sys/uio.h>
+#endif
 #include <ctype.h>
 
 #include "gio-coroutine.h"
@@ -76,6 +79,23 @@ static gboolean channel_connect(SpiceChannel *channel, gboolean tls);
 #define SPICE_CHANNEL_GET_PRIVATE(obj)                                  \
     (G_TYPE_INSTANCE_GET_PRIVATE ((obj), SPICE_TYPE_CHANNEL, SpiceChannelPrivate))
 
+/* the most read from the socket at once, what is beyond the message
+ * being read waits in the channel read buffer */
+#define READ_BUFFER_SIZE (64 * 1024)
+/* the most chunks of a message written at once */
+#define WRITE_IOV_MAX 64
+/* the size of the TLS records, or of the writes to a proxy connection,
+ * gathering the small chunks */
+#define TLS_RECORD_SIZE (16 * 1024)
+
+/* the most bytes of queued messages written together, and how long in
+ * ms a queued message waits for others, SPICE_WRITE_BATCH_SIZE and
+ * SPICE_WRITE_BATCH_DELAY in the environment */
+#define WRITE_BATCH_SIZE_DEFAULT (64 * 1024)
+#define WRITE_BATCH_DELAY_DEFAULT 0
+static gsize write_batch_size;
+static guint write_batch_delay;
+
 G_DEFINE_TYPE_WITH_CODE (SpiceChannel, spice_channel, G_TYPE_OBJECT,
                          g_type_add_class_private (g_define_type_id, sizeof (SpiceChannelClassPrivate)));
 
@@ -86,6 +106,10 @@ enum {
     PROP_CHANNEL_TYPE,
     PROP_CHANNEL_ID,
     PROP_TOTAL_READ_BYTES,
+    PROP_TOTAL_READ_CALLS,
+    PROP_TOTAL_READ_MESSAGES,
+    PROP_TOTAL_WRITE_CALLS,
+    PROP_TOTAL_WRITE_MESSAGES,
 };
 
 /* Signals */
@@ -123,6 +147,7 @@ static void spice_channel_init(SpiceChannel *channel)
 #endif
     g_queue_init(&c->xmit_queue);
     STATIC_MUTEX_INIT(c->xmit_queue_lock);
+    channel_stats_init(&c->stats);
 }
 
 static void spice_channel_constructed(GObject *gobject)
@@ -190,6 +215,9 @@ static void spice_channel_finalize(GObject *gobject)
     if (c->remote_common_caps)
         g_array_free(c->remote_common_caps, TRUE);
 
+    g_free(c->rbuf);
+    channel_stats_clear(&c->stats);
+
     /* Chain up to the parent class */
     if (G_OBJECT_CLASS(spice_channel_parent_class)->finalize)
         G_OBJECT_CLASS(spice_channel_parent_class)->finalize(gobject);
@@ -216,6 +244,18 @@ static void spice_channel_get_property(GObject    *gobject,
     case PROP_TOTAL_READ_BYTES:
         g_value_set_ulong(value, c->total_read_bytes);
         break;
+    case PROP_TOTAL_READ_CALLS:
+        g_value_set_ulong(value, c->total_read_calls);
+        break;
+    case PROP_TOTAL_READ_MESSAGES:
+        g_value_set_ulong(value, c->total_read_messages);
+        break;
+    case PROP_TOTAL_WRITE_CALLS:
+        g_value_set_ulong(value, c->total_write_calls);
+        break;
+    case PROP_TOTAL_WRITE_MESSAGES:
+        g_value_set_ulong(value, c->total_write_messages);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(gobject, prop_id, pspec);
         break;
@@ -272,6 +312,13 @@ static void spice_channel_class_init(SpiceChannelClass *klass)
     klass->iterate_read  = spice_channel_iterate_read;
     klass->channel_reset = channel_reset;
 
+    write_batch_size = WRITE_BATCH_SIZE_DEFAULT;
+    if (g_getenv("SPICE_WRITE_BATCH_SIZE"))
+        write_batch_size = MAX(atoi(g_getenv("SPICE_WRITE_BATCH_SIZE")), 1);
+    write_batch_delay = WRITE_BATCH_DELAY_DEFAULT;
+    if (g_getenv("SPICE_WRITE_BATCH_DELAY"))
+        write_batch_delay = MAX(atoi(g_getenv("SPICE_WRITE_BATCH_DELAY")), 0);
+
     gobject_class->constructed  = spice_channel_constructed;
     gobject_class->dispose      = spice_channel_dispose;
     gobject_class->finalize     = spice_channel_finalize;
@@ -318,6 +365,75 @@ static void spice_channel_class_init(SpiceChannelClass *klass)
                             G_PARAM_READABLE |
                             G_PARAM_STATIC_STRINGS));
 
+    /**
+     * SpiceChannel:total-read-calls:
+     *
+     * The number of reads from the socket, or from the TLS connection,
+     * including the ones that found no data. Compare with
+     * #SpiceChannel:total-read-messages for the reads per message.
+     *
+     * Since: 0.31
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_TOTAL_READ_CALLS,
+         g_param_spec_ulong("total-read-calls",
+                            "Total read calls",
+                            "Reads from the socket",
+                            0, G_MAXULONG, 0,
+                            G_PARAM_READABLE |
+                            G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceChannel:total-read-messages:
+     *
+     * The number of messages received, a message list counting once.
+     *
+     * Since: 0.31
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_TOTAL_READ_MESSAGES,
+         g_param_spec_ulong("total-read-messages",
+                            "Total read messages",
+                            "Messages received",
+                            0, G_MAXULONG, 0,
+                            G_PARAM_READABLE |
+                            G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceChannel:total-write-calls:
+     *
+     * The number of writes to the socket, or to the TLS connection,
+     * including the ones that couldn't write anything. Queued messages
+     * are written together, #SpiceChannel:total-write-messages divided
+     * by it is the average number of messages per write.
+     *
+     * Since: 0.31
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_TOTAL_WRITE_CALLS,
+         g_param_spec_ulong("total-write-calls",
+                            "Total write calls",
+                            "Writes to the socket",
+                            0, G_MAXULONG, 0,
+                            G_PARAM_READABLE |
+                            G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceChannel:total-write-messages:
+     *
+     * The number of messages sent.
+     *
+     * Since: 0.31
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_TOTAL_WRITE_MESSAGES,
+         g_param_spec_ulong("total-write-messages",
+                            "Total write messages",
+                            "Messages sent",
+                            0, G_MAXULONG, 0,
+                            G_PARAM_READABLE |
+                            G_PARAM_STATIC_STRINGS));
+
     /**
      * SpiceChannel::channel-event:
      * @channel: the channel that emitted the signal
@@ -463,6 +579,82 @@ static inline uint32_t spice_header_get_msg_sub_list(uint8_t *header, gboolean i
 /* ---------------------------------------------------------------- */
 /* private msg api                                                  */
 
+/*
+ * Message bodies up to 1 << MSG_POOL_MAX_SHIFT bytes are allocated
+ * rounded up to a power of two, and released ones are kept for the next
+ * messages of the same class: the display channel would otherwise
+ * allocate every image it receives.
+ */
+#define MSG_POOL_MIN_SHIFT 8
+#define MSG_POOL_MAX_SHIFT 22
+#define MSG_POOL_CLASSES (MSG_POOL_MAX_SHIFT - MSG_POOL_MIN_SHIFT + 1)
+/* released bodies kept per class, and in all */
+#define MSG_POOL_DEPTH 8
+#define MSG_POOL_MAX_IDLE (16 * 1024 * 1024)
+
+/* the bodies are freed in the main context, but the coroutines may
+ * be threads */
+G_LOCK_DEFINE_STATIC(msg_pool);
+/* released bodies, each starting with the pointer to the next one */
+static gpointer msg_pool[MSG_POOL_CLASSES];
+static guint msg_pool_len[MSG_POOL_CLASSES];
+static gsize msg_pool_idle;
+
+static int msg_pool_class(uint32_t size)
+{
+    int shift = MAX(g_bit_storage(size - 1), MSG_POOL_MIN_SHIFT);
+
+    return shift <= MSG_POOL_MAX_SHIFT ? shift - MSG_POOL_MIN_SHIFT : -1;
+}
+
+/* not zeroed, the read overwrites it */
+static uint8_t *msg_body_alloc(uint32_t size)
+{
+    int cls = msg_pool_class(size);
+    gpointer data = NULL;
+
+    if (size == 0)
+        return NULL;
+    if (cls < 0)
+        return g_malloc(size);
+
+    G_LOCK(msg_pool);
+    if (msg_pool[cls] != NULL) {
+        data = msg_pool[cls];
+        msg_pool[cls] = *(gpointer *)data;
+        msg_pool_len[cls]--;
+        msg_pool_idle -= (gsize)1 << (cls + MSG_POOL_MIN_SHIFT);
+    }
+    G_UNLOCK(msg_pool);
+
+    return data != NULL ? data : g_malloc((gsize)1 << (cls + MSG_POOL_MIN_SHIFT));
+}
+
+static void msg_body_free(uint8_t *data, uint32_t size)
+{
+    int cls = msg_pool_class(size);
+
+    if (data == NULL)
+        return;
+
+    if (cls >= 0) {
+        gsize alloc_size = (gsize)1 << (cls + MSG_POOL_MIN_SHIFT);
+
+        G_LOCK(msg_pool);
+        if (msg_pool_len[cls] < MSG_POOL_DEPTH &&
+            msg_pool_idle + alloc_size <= MSG_POOL_MAX_IDLE) {
+            *(gpointer *)data = msg_pool[cls];
+            msg_pool[cls] = data;
+            msg_pool_len[cls]++;
+            msg_pool_idle += alloc_size;
+            data = NULL;
+        }
+        G_UNLOCK(msg_pool);
+    }
+
+    g_free(data);
+}
+
 G_GNUC_INTERNAL
 SpiceMsgIn *spice_msg_in_new(SpiceChannel *channel)
 {
@@ -516,7 +708,7 @@ void spice_msg_in_unref(SpiceMsgIn *in)
     if (in->parent) {
         spice_msg_in_unref(in->parent);
     } else {
-        g_free(in->data);
+        msg_body_free(in->data, in->dsize);
     }
     g_slice_free(SpiceMsgIn, in);
 }
@@ -710,13 +902,15 @@ void spice_msg_out_send(SpiceMsgOut *out)
 
     was_empty = g_queue_is_empty(&c->xmit_queue);
     g_queue_push_tail(&c->xmit_queue, out);
+    c->stats.xmit_queue_max = MAX(c->stats.xmit_queue_max,
+                                  g_queue_get_length(&c->xmit_queue));
 
     /* One wakeup is enough to empty the entire queue -> only do a wakeup
        if the queue was empty, and there isn't one pending already. */
     if (was_empty && !c->xmit_queue_wakeup_id) {
         c->xmit_queue_wakeup_id =
             /* Use g_timeout_add_full so that can specify the priority */
-            g_timeout_add_full(G_PRIORITY_HIGH, 0,
+            g_timeout_add_full(G_PRIORITY_HIGH, write_batch_delay,
                                spice_channel_idle_wakeup,
                                out->channel, NULL);
     }
@@ -734,6 +928,17 @@ void spice_msg_out_send_internal(SpiceMsgOut *out)
     spice_channel_write_msg(out->channel, out);
 }
 
+/* coroutine context, the time is added to 'wait' */
+static void spice_channel_socket_wait(SpiceChannel *channel, GIOCondition cond,
+                                      channel_histogram *wait)
+{
+    SpiceChannelPrivate *c = channel->priv;
+    gint64 start = g_get_monotonic_time();
+
+    g_coroutine_socket_wait(&c->coroutine, c->sock, cond);
+    channel_histogram_add(wait, g_get_monotonic_time() - start);
+}
+
 /*
  * Write all 'data' of length 'datalen' bytes out to
  * the wire
@@ -754,6 +959,7 @@ static void spice_channel_flush_wire(SpiceChannel *channel,
 
         if (c->has_error) return;
 
+        c->total_write_calls++;
         cond = 0;
         if (c->tls) {
             ret = SSL_write(c->ssl, ptr+offset, datalen-offset);
@@ -781,7 +987,7 @@ static void spice_channel_flush_wire(SpiceChannel *channel,
         if (ret == -1) {
             if (cond != 0) {
                 // TODO: should use g_pollable_input/output_stream_create_source() in 2.28 ?
-                g_coroutine_socket_wait(&c->coroutine, c->sock, cond);
+                spice_channel_socket_wait(channel, cond, &c->stats.write_wait);
                 continue;
             } else {
                 CHANNEL_DEBUG(channel, "Closing the channel: spice_channel_flush %d", errno);
@@ -836,27 +1042,182 @@ static void spice_channel_write(SpiceChannel *channel, const void *data, size_t
         spice_channel_flush_wire(channel, data, len);
 }
 
+#ifndef G_OS_WIN32
+/*
+ * Write all the 'n' buffers of 'iov' out to the socket of a plain
+ * connection, 'iov' is modified
+ */
+/* coroutine context */
+static void spice_channel_flush_wire_iov(SpiceChannel *channel,
+                                         struct iovec *iov, int n)
+{
+    SpiceChannelPrivate *c = channel->priv;
+
+    while (n > 0) {
+        gssize ret;
+
+        if (c->has_error) return;
+
+        c->total_write_calls++;
+        ret = writev(g_socket_get_fd(c->sock), iov, n);
+        if (ret < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                spice_channel_socket_wait(channel, G_IO_OUT, &c->stats.write_wait);
+                continue;
+            }
+            if (errno == EINTR)
+                continue;
+            CHANNEL_DEBUG(channel, "Closing the channel: spice_channel_flush %d", errno);
+            c->has_error = TRUE;
+            return;
+        }
+        if (ret == 0) {
+            CHANNEL_DEBUG(channel, "Closing the connection: spice_channel_flush");
+            c->has_error = TRUE;
+            return;
+        }
+
+        while (n > 0 && (gsize)ret >= iov->iov_len) {
+            ret -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+}
+
+/*
+ * Write all the 'n' buffers of 'iov' out to the TLS connection or to
+ * the connection streams, the small ones gathered so they don't take a
+ * record or a write each
+ */
+/* coroutine context */
+static void spice_channel_flush_stream_iov(SpiceChannel *channel,
+                                        const struct iovec *iov, int n)
+{
+    uint8_t buf[TLS_RECORD_SIZE];
+    size_t used = 0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (iov[i].iov_len >= TLS_RECORD_SIZE) {
+            if (used > 0)
+                spice_channel_flush_wire(channel, buf, used);
+            used = 0;
+            spice_channel_flush_wire(channel, iov[i].iov_base, iov[i].iov_len);
+            continue;
+        }
+        if (used + iov[i].iov_len > TLS_RECORD_SIZE) {
+            spice_channel_flush_wire(channel, buf, used);
+            used = 0;
+        }
+        memcpy(buf + used, iov[i].iov_base, iov[i].iov_len);
+        used += iov[i].iov_len;
+    }
+    if (used > 0)
+        spice_channel_flush_wire(channel, buf, used);
+}
+
+/* coroutine context */
+static void spice_channel_flush_iov(SpiceChannel *channel,
+                                    struct iovec *iov, int n)
+{
+    SpiceChannelPrivate *c = channel->priv;
+
+    /* a proxy connection wraps the socket, in a TLS tunnel for an
+     * https:// proxy, only a plain one can be written to directly */
+    if (c->tls || G_IS_TCP_WRAPPER_CONNECTION(c->conn))
+        spice_channel_flush_stream_iov(channel, iov, n);
+    else
+        spice_channel_flush_wire_iov(channel, iov, n);
+}
+
+/*
+ * Add the data of marshaller 'm' to the 'n' buffers of 'iov' without
+ * linearizing it, flushing them when they are WRITE_IOV_MAX. The chunks
+ * referencing the caller's data are not copied.
+ */
+/* coroutine context */
+static void spice_channel_gather_marshaller(SpiceChannel *channel,
+                                            struct iovec *iov, int *n,
+                                            SpiceMarshaller *m)
+{
+    size_t total = spice_marshaller_get_total_size(m);
+    size_t skip = 0;
+
+    while (skip < total && !channel->priv->has_error) {
+        int added, i;
+
+        if (*n == WRITE_IOV_MAX) {
+            spice_channel_flush_iov(channel, iov, *n);
+            *n = 0;
+        }
+
+        added = spice_marshaller_fill_iovec(m, iov + *n, WRITE_IOV_MAX - *n, skip);
+        if (added == 0)
+            break;
+        for (i = *n; i < *n + added; i++)
+            skip += iov[i].iov_len;
+        *n += added;
+    }
+}
+#endif
+
+/* coroutine context, FALSE if the message mustn't be sent */
+static gboolean spice_channel_prepare_msg(SpiceChannel *channel, SpiceMsgOut *out)
+{
+    uint32_t msg_size;
+
+    if (out->ro_check &&
+        spice_channel_get_read_only(channel)) {
+        g_warning("Try to send message while read-only. Please report a bug.");
+        return FALSE;
+    }
+
+    msg_size = spice_marshaller_get_total_size(out->marshaller) -
+               spice_header_get_header_size(channel->priv->use_mini_header);
+    spice_header_set_msg_size(out->header, channel->priv->use_mini_header, msg_size);
+    channel->priv->total_write_messages++;
+    channel_stats_add_tx(&channel->priv->stats,
+                         spice_header_get_msg_type(out->header, channel->priv->use_mini_header),
+                         spice_marshaller_get_total_size(out->marshaller));
+
+    return TRUE;
+}
+
 /* coroutine context */
 static void spice_channel_write_msg(SpiceChannel *channel, SpiceMsgOut *out)
 {
     uint8_t *data;
     int free_data;
     size_t len;
-    uint32_t msg_size;
 
     g_return_if_fail(channel != NULL);
     g_return_if_fail(out != NULL);
     g_return_if_fail(channel == out->channel);
 
-    if (out->ro_check &&
-        spice_channel_get_read_only(channel)) {
-        g_warning("Try to send message while read-only. Please report a bug.");
-        return;
+    if (!spice_channel_prepare_msg(channel, out))
+        goto end;
+
+#ifndef G_OS_WIN32
+#if HAVE_SASL
+    /* SASL encodes contiguous data */
+    if (channel->priv->sasl_conn == NULL)
+#endif
+    {
+        struct iovec iov[WRITE_IOV_MAX];
+        int n = 0;
+
+        spice_channel_gather_marshaller(channel, iov, &n, out->marshaller);
+        if (n > 0)
+            spice_channel_flush_iov(channel, iov, n);
+        goto end;
     }
+#endif
 
-    msg_size = spice_marshaller_get_total_size(out->marshaller) -
-               spice_header_get_header_size(channel->priv->use_mini_header);
-    spice_header_set_msg_size(out->header, channel->priv->use_mini_header, msg_size);
     data = spice_marshaller_linearize(out->marshaller, 0, &len, &free_data);
     /* spice_msg_out_hexdump(out, data, len); */
     spice_channel_write(channel, data, len);
@@ -864,15 +1225,50 @@ static void spice_channel_write_msg(SpiceChannel *channel, SpiceMsgOut *out)
     if (free_data)
         g_free(data);
 
+end:
     spice_msg_out_unref(out);
 }
 
+/*
+ * Write the 'n' messages of 'outs' together, a burst of small messages
+ * takes a single write, and a single TLS record
+ */
+/* coroutine context */
+static void spice_channel_write_msgs(SpiceChannel *channel, SpiceMsgOut **outs, guint n)
+{
+    guint i;
+#ifndef G_OS_WIN32
+    struct iovec iov[WRITE_IOV_MAX];
+    int niov = 0;
+
+#if HAVE_SASL
+    if (channel->priv->sasl_conn == NULL)
+#endif
+    {
+        for (i = 0; i < n; i++) {
+            if (spice_channel_prepare_msg(channel, outs[i]))
+                spice_channel_gather_marshaller(channel, iov, &niov, outs[i]->marshaller);
+        }
+        if (niov > 0)
+            spice_channel_flush_iov(channel, iov, niov);
+
+        /* the buffers reference the messages until they are written */
+        for (i = 0; i < n; i++)
+            spice_msg_out_unref(outs[i]);
+        return;
+    }
+#endif
+
+    for (i = 0; i < n; i++)
+        spice_channel_write_msg(channel, outs[i]);
+}
+
 /*
  * Read at least 1 more byte of data straight off the wire
  * into the requested buffer.
  */
 /* coroutine context */
-static int spice_channel_read_wire(SpiceChannel *channel, void *data, size_t len)
+static int spice_channel_read_socket(SpiceChannel *channel, void *data, size_t len)
 {
     SpiceChannelPrivate *c = channel->priv;
     gssize ret;
@@ -882,6 +1278,7 @@ reread:
 
     if (c->has_error) return 0; /* has_error is set by disconnect(), return no error */
 
+    c->total_read_calls++;
     cond = 0;
     if (c->tls) {
         ret = SSL_read(c->ssl, data, len);
@@ -911,7 +1308,7 @@ reread:
     if (ret == -1) {
         if (cond != 0) {
             // TODO: should use g_pollable_input/output_stream_create_source() ?
-            g_coroutine_socket_wait(&c->coroutine, c->sock, cond);
+            spice_channel_socket_wait(channel, cond, &c->stats.read_wait);
             goto reread;
         } else {
             c->has_error = TRUE;
@@ -927,6 +1324,52 @@ reread:
     return ret;
 }
 
+/*
+ * Read at least 1 byte, out of what the last read from the socket got
+ * if it got more than asked. Reading as much as is available at once
+ * saves a read per header and body of small messages.
+ */
+/* coroutine context */
+static int spice_channel_read_wire(SpiceChannel *channel, void *data, size_t len)
+{
+    SpiceChannelPrivate *c = channel->priv;
+
+    if (c->rbuf_pos == c->rbuf_end) {
+        int ret;
+
+        /* no need to copy large reads */
+        if (len >= READ_BUFFER_SIZE)
+            return spice_channel_read_socket(channel, data, len);
+
+        if (c->rbuf == NULL)
+            c->rbuf = g_malloc(READ_BUFFER_SIZE);
+        ret = spice_channel_read_socket(channel, c->rbuf, READ_BUFFER_SIZE);
+        if (ret <= 0)
+            return ret;
+        c->rbuf_pos = 0;
+        c->rbuf_end = ret;
+    }
+
+    len = MIN(len, c->rbuf_end - c->rbuf_pos);
+    memcpy(data, c->rbuf + c->rbuf_pos, len);
+    c->rbuf_pos += len;
+
+    return len;
+}
+
+/* coroutine context, whether a read wouldn't wait */
+static gboolean spice_channel_has_input(SpiceChannel *channel)
+{
+    SpiceChannelPrivate *c = channel->priv;
+
+    if (c->rbuf_pos < c->rbuf_end)
+        return TRUE;
+    if (c->tls && SSL_pending(c->ssl) > 0)
+        return TRUE;
+
+    return g_pollable_input_stream_is_readable(G_POLLABLE_INPUT_STREAM(c->in));
+}
+
 #if HAVE_SASL
 /*
  * Read at least 1 more byte of data out of the SASL decrypted
@@ -1823,17 +2266,24 @@ void spice_channel_recv_msg(SpiceChannel *channel,
     if (c->has_error)
         goto end;
 
+    if (c->stats.ack_time != 0) {
+        channel_histogram_add(&c->stats.ack_wait,
+                              g_get_monotonic_time() - c->stats.ack_time);
+        c->stats.ack_time = 0;
+    }
+
     msg_size = spice_header_get_msg_size(in->header, c->use_mini_header);
-    /* FIXME: do not allow others to take ref on in, and use realloc here?
-     * this would avoid malloc/free on each message?
-     */
-    in->data = g_malloc0(msg_size);
+    in->data = msg_body_alloc(msg_size);
+    in->dsize = msg_size;
     spice_channel_read(channel, in->data, msg_size);
     if (c->has_error)
         goto end;
     in->dpos = msg_size;
+    c->total_read_messages++;
 
     msg_type = spice_header_get_msg_type(in->header, c->use_mini_header);
+    channel_stats_add_rx(&c->stats, msg_type,
+                         spice_header_get_header_size(c->use_mini_header) + msg_size);
     sub_list_offset = spice_header_get_msg_sub_list(in->header, c->use_mini_header);
 
     if (msg_type == SPICE_MSG_LIST || sub_list_offset) {
@@ -1868,6 +2318,7 @@ void spice_channel_recv_msg(SpiceChannel *channel,
             SpiceMsgOut *out = spice_msg_out_new(channel, SPICE_MSGC_ACK);
             spice_msg_out_send_internal(out);
             c->message_ack_count = c->message_ack_window;
+            c->stats.ack_time = g_get_monotonic_time();
         }
     }
 
@@ -2098,15 +2549,24 @@ static void spice_channel_flushed(SpiceChannel *channel, gboolean success)
 static void spice_channel_iterate_write(SpiceChannel *channel)
 {
     SpiceChannelPrivate *c = channel->priv;
-    SpiceMsgOut *out;
+    SpiceMsgOut *outs[WRITE_IOV_MAX];
+    guint n;
 
     do {
+        gsize size = 0;
+
+        n = 0;
         STATIC_MUTEX_LOCK(c->xmit_queue_lock);
-        out = g_queue_pop_head(&c->xmit_queue);
+        while (n < G_N_ELEMENTS(outs) && size < write_batch_size &&
+               !g_queue_is_empty(&c->xmit_queue)) {
+            outs[n] = g_queue_pop_head(&c->xmit_queue);
+            size += spice_marshaller_get_total_size(outs[n]->marshaller);
+            n++;
+        }
         STATIC_MUTEX_UNLOCK(c->xmit_queue_lock);
-        if (out)
-            spice_channel_write_msg(channel, out);
-    } while (out);
+        if (n > 0)
+            spice_channel_write_msgs(channel, outs, n);
+    } while (n > 0);
 
     spice_channel_flushed(channel, TRUE);
 }
@@ -2116,12 +2576,14 @@ static void spice_channel_iterate_read(SpiceChannel *channel)
 {
     SpiceChannelPrivate *c = channel->priv;
 
-    g_coroutine_socket_wait(&c->coroutine, c->sock, G_IO_IN);
+    /* what was read already can't wake us up */
+    if (!spice_channel_has_input(channel))
+        g_coroutine_socket_wait(&c->coroutine, c->sock, G_IO_IN);
 
     /* treat all incoming data (block on message completion) */
     while (!c->has_error &&
            c->state != SPICE_CHANNEL_STATE_MIGRATING &&
-           g_pollable_input_stream_is_readable(G_POLLABLE_INPUT_STREAM(c->in))
+           spice_channel_has_input(channel)
     ) { do
             spice_channel_recv_msg(channel,
                                    (handler_msg_in)SPICE_CHANNEL_GET_CLASS(channel)->handle_msg, NULL);
@@ -2302,6 +2764,88 @@ const GError* spice_channel_get_error(SpiceChannel *self)
     return c->error;
 }
 
+/**
+ * spice_channel_get_stats:
+ * @channel: a #SpiceChannel
+ *
+ * Retrieves the statistics of @channel as a JSON object:
+ * - "rx" and "tx": the bytes, messages and socket calls in each
+ *   direction, and in "types" the messages and bytes per message type;
+ *   for the received messages, "handler" is the histogram of the time
+ *   spent handling them
+ * - "read-wait" and "write-wait": the histograms of the time the channel
+ *   waited for the socket in the middle of a read or of a write
+ * - "ack-wait": the histogram of the time from sending an ack to
+ *   receiving the next message, the long ones are the server waiting
+ *   for the ack
+ * - "xmit-queue": the current and the largest number of messages
+ *   waiting to be sent
+ * - "caches", for display and cursor channels: the "hits", "misses",
+ *   "evictions", current "bytes" and "high-water" bytes of each cache of
+ *   the channel, "images", "palettes" or "cursors". The "images" cache
+ *   is shared by the display channels of the session.
+ * - "streams", for display channels: for each running video stream, its
+ *   "id" and "codec", the "input-frames" received and the
+ *   "drops-on-receive" and "drops-on-playback". The "decoded-frames"
+ *   were decoded ahead of being shown, by "decode-ahead-total" divided
+ *   by "decoded-frames" frames on average and "decode-ahead-max" at
+ *   most. "decode-waits" counts the times a frame was due before it was
+ *   decoded.
+ *
+ * A histogram is an object with the "count", "total-us" and "max-us" of
+ * the times, and "buckets", where bucket i counts the times from
+ * 2^(i-1) up to 2^i microseconds.
+ *
+ * Returns: (transfer full): the statistics, free with g_free()
+ * Since: 0.31
+ **/
+gchar *spice_channel_get_stats(SpiceChannel *channel)
+{
+    SpiceChannelClass *klass;
+    SpiceChannelPrivate *c;
+    GString *json;
+    guint queue_depth, queue_max;
+
+    g_return_val_if_fail(SPICE_IS_CHANNEL(channel), NULL);
+    c = channel->priv;
+
+    STATIC_MUTEX_LOCK(c->xmit_queue_lock);
+    queue_depth = g_queue_get_length(&c->xmit_queue);
+    queue_max = c->stats.xmit_queue_max;
+    STATIC_MUTEX_UNLOCK(c->xmit_queue_lock);
+
+    json = g_string_new(NULL);
+    g_string_append_printf(json,
+                           "{\"channel\":\"%s\",\"type\":%d,\"id\":%d,"
+                           "\"rx\":{\"bytes\":%" G_GSIZE_FORMAT
+                           ",\"messages\":%" G_GSIZE_FORMAT
+                           ",\"calls\":%" G_GSIZE_FORMAT ",\"types\":",
+                           c->name, c->channel_type, c->channel_id,
+                           c->total_read_bytes, c->total_read_messages,
+                           c->total_read_calls);
+    channel_stats_types_to_json(c->stats.rx, TRUE, json);
+    g_string_append_printf(json,
+                           "},\"tx\":{\"messages\":%" G_GSIZE_FORMAT
+                           ",\"calls\":%" G_GSIZE_FORMAT ",\"types\":",
+                           c->total_write_messages, c->total_write_calls);
+    channel_stats_types_to_json(c->stats.tx, FALSE, json);
+    g_string_append(json, "},\"read-wait\":");
+    channel_histogram_to_json(&c->stats.read_wait, json);
+    g_string_append(json, ",\"write-wait\":");
+    channel_histogram_to_json(&c->stats.write_wait, json);
+    g_string_append(json, ",\"ack-wait\":");
+    channel_histogram_to_json(&c->stats.ack_wait, json);
+    g_string_append_printf(json,
+                           ",\"xmit-queue\":{\"depth\":%u,\"max-depth\":%u}",
+                           queue_depth, queue_max);
+    klass = SPICE_CHANNEL_GET_CLASS(channel);
+    if (klass->priv->stats_to_json != NULL)
+        klass->priv->stats_to_json(channel, json);
+    g_string_append_c(json, '}');
+
+    return g_string_free(json, FALSE);
+}
+
 /* coroutine context */
 static void *spice_channel_coroutine(void *data)
 {
@@ -2617,6 +3161,7 @@ static void channel_reset(SpiceChannel *channel, gboolean migrating)
     }
 
     g_clear_object(&c->sock);
+    c->rbuf_pos = c->rbuf_end = 0;
 
     c->fd = -1;
 
@@ -2858,6 +3403,9 @@ void spice_channel_swap(SpiceChannel *channel, SpiceChannel *swap, gboolean swap
     SWAP(sasl_decoded_length);
     SWAP(sasl_decoded_offset);
 #endif
+    SWAP(rbuf);
+    SWAP(rbuf_pos);
+    SWAP(rbuf_end);
 }
 
 /* coroutine context */
@@ -2866,6 +3414,7 @@ static void spice_channel_handle_msg(SpiceChannel *channel, SpiceMsgIn *msg)
     SpiceChannelClass *klass = SPICE_CHANNEL_GET_CLASS(channel);
     int type = spice_msg_in_type(msg);
     spice_msg_handler handler;
+    gint64 start;
 
     g_return_if_fail(type < klass->priv->handlers->len);
     if (type > SPICE_MSG_BASE_LAST && channel->priv->disable_channel_msg)
@@ -2873,7 +3422,10 @@ static void spice_channel_handle_msg(SpiceChannel *channel, SpiceMsgIn *msg)
 
     handler = g_array_index(klass->priv->handlers, spice_msg_handler, type);
     g_return_if_fail(handler != NULL);
+    start = g_get_monotonic_time();
     handler(channel, msg);
+    channel_stats_add_handler(&channel->priv->stats, type,
+                              g_get_monotonic_time() - start);
 }
 
 static void spice_channel_reset_capabilities(SpiceChannel *channel)
@@ -146,6 +146,7 @@ const gchar* spice_channel_type_to_string(gint type);
 gint spice_channel_string_to_type(const gchar *str);
 
 const GError* spice_channel_get_error(SpiceChannel *channel);
+gchar *spice_channel_get_stats(SpiceChannel *channel);
 
 G_END_DECLS
 
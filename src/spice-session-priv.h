@@ -34,6 +34,7 @@ typedef struct _PhodavServer PhodavServer;
 #include "spice-gtk-session.h"
 #include "spice-channel-cache.h"
 #include "decode.h"
+#include "spice-surface-pool.h"
 
 G_BEGIN_DECLS
 
@@ -76,6 +77,7 @@ void spice_session_set_caches_hints(SpiceSession *session,
 void spice_session_get_caches(SpiceSession *session,
                               display_cache **images,
                               SpiceGlzDecoderWindow **glz_window);
+SpiceSurfacePool *spice_session_get_surface_pool(SpiceSession *session);
 void spice_session_palettes_clear(SpiceSession *session);
 void spice_session_images_clear(SpiceSession *session);
 void spice_session_migrate_end(SpiceSession *session);
@@ -44,6 +44,8 @@ struct channel {
 #define IMAGES_CACHE_SIZE_DEFAULT (1024 * 1024 * 80)
 #define MIN_GLZ_WINDOW_SIZE_DEFAULT (1024 * 1024 * 12)
 #define MAX_GLZ_WINDOW_SIZE_DEFAULT MIN((LZ_MAX_WINDOW_SIZE * 4), 1024 * 1024 * 64)
+/* released display surfaces kept for reuse, enough for a 4K primary */
+#define SURFACE_POOL_MAX_IDLE (1024 * 1024 * 64)
 
 struct _SpiceSessionPrivate {
     char              *host;
@@ -111,6 +113,7 @@ struct _SpiceSessionPrivate {
     display_cache     *images;
     display_cache     *palettes;
     SpiceGlzDecoderWindow *glz_window;
+    SpiceSurfacePool  *surface_pool;
     int               images_cache_size;
     int               glz_window_size;
     uint32_t          pci_ram_size;
@@ -205,6 +208,12 @@ enum {
     PROP_USERNAME,
     PROP_UNIX_PATH,
     PROP_PREF_COMPRESSION,
+    PROP_IMAGES_CACHE_HIGH_WATER,
+    PROP_GLZ_WINDOW_WAIT_TIME,
+    PROP_GLZ_WINDOW_MEMORY,
+    PROP_GLZ_WINDOW_HIGH_WATER,
+    PROP_SURFACE_POOL_MEMORY,
+    PROP_SURFACE_POOL_HIGH_WATER,
 };
 
 /* signals */
@@ -291,8 +300,9 @@ static void spice_session_init(SpiceSession *session)
     g_free(channels);
 
     ring_init(&s->channels);
-    s->images = cache_image_new((GDestroyNotify)pixman_image_unref);
+    s->images = cache_image_new("images", (GDestroyNotify)pixman_image_unref);
     s->glz_window = glz_decoder_window_new();
+    s->surface_pool = surface_pool_new(SURFACE_POOL_MAX_IDLE);
     update_proxy(session, NULL);
 }
 
@@ -374,6 +384,7 @@ spice_session_finalize(GObject *gobject)
 
     g_clear_pointer(&s->images, cache_free);
     glz_decoder_window_destroy(s->glz_window);
+    g_clear_pointer(&s->surface_pool, surface_pool_unref);
 
     g_clear_pointer(&s->pubkey, g_byte_array_unref);
     g_clear_pointer(&s->ca, g_byte_array_unref);
@@ -695,6 +706,24 @@ static void spice_session_get_property(GObject    *gobject,
     case PROP_PREF_COMPRESSION:
         g_value_set_enum(value, s->preferred_compression);
         break;
+    case PROP_IMAGES_CACHE_HIGH_WATER:
+        g_value_set_uint64(value, cache_get_stats(s->images)->high_water);
+        break;
+    case PROP_GLZ_WINDOW_WAIT_TIME:
+        g_value_set_uint64(value, glz_decoder_window_get_wait_time(s->glz_window));
+        break;
+    case PROP_GLZ_WINDOW_MEMORY:
+        g_value_set_uint64(value, glz_decoder_window_get_size(s->glz_window));
+        break;
+    case PROP_GLZ_WINDOW_HIGH_WATER:
+        g_value_set_uint64(value, glz_decoder_window_get_high_water(s->glz_window));
+        break;
+    case PROP_SURFACE_POOL_MEMORY:
+        g_value_set_uint64(value, surface_pool_get_stats(s->surface_pool)->bytes);
+        break;
+    case PROP_SURFACE_POOL_HIGH_WATER:
+        g_value_set_uint64(value, surface_pool_get_stats(s->surface_pool)->high_water);
+        break;
     default:
 	G_OBJECT_WARN_INVALID_PROPERTY_ID(gobject, prop_id, pspec);
 	break;
@@ -1461,6 +1490,110 @@ static void spice_session_class_init(SpiceSessionClass *klass)
                            G_PARAM_READWRITE |
                            G_PARAM_STATIC_STRINGS));
 
+    /**
+     * SpiceSession:images-cache-high-water:
+     *
+     * The most memory the images cache used at once, in bytes. Compare
+     * with #SpiceSession:cache-size to size it on memory constrained
+     * clients.
+     *
+     * Since: 0.31
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_IMAGES_CACHE_HIGH_WATER,
+         g_param_spec_uint64("images-cache-high-water",
+                             "Images cache high-water mark",
+                             "Most bytes used by the images cache",
+                             0, G_MAXUINT64, 0,
+                             G_PARAM_READABLE |
+                             G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceSession:glz-window-wait-time:
+     *
+     * The time display channels spent waiting for glz images decoded by
+     * another display channel, in microseconds. With multiple monitors
+     * this is where drawing stalls on the slowest channel.
+     *
+     * Since: 0.31
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_GLZ_WINDOW_WAIT_TIME,
+         g_param_spec_uint64("glz-window-wait-time",
+                             "Glz window wait time",
+                             "Microseconds spent waiting for glz images of other displays",
+                             0, G_MAXUINT64, 0,
+                             G_PARAM_READABLE |
+                             G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceSession:glz-window-memory:
+     *
+     * The memory held by the glz dictionary window, in bytes. The server
+     * decides which images the window keeps, #SpiceSession:glz-window-size
+     * is only a hint to it.
+     *
+     * Since: 0.31
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_GLZ_WINDOW_MEMORY,
+         g_param_spec_uint64("glz-window-memory",
+                             "Glz window memory",
+                             "Bytes held by the glz dictionary window",
+                             0, G_MAXUINT64, 0,
+                             G_PARAM_READABLE |
+                             G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceSession:glz-window-high-water:
+     *
+     * The most memory the glz dictionary window held at once, in bytes.
+     *
+     * Since: 0.31
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_GLZ_WINDOW_HIGH_WATER,
+         g_param_spec_uint64("glz-window-high-water",
+                             "Glz window high-water mark",
+                             "Most bytes held by the glz dictionary window",
+                             0, G_MAXUINT64, 0,
+                             G_PARAM_READABLE |
+                             G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceSession:surface-pool-memory:
+     *
+     * The memory held for display surfaces, in bytes: the surfaces in
+     * use and the released ones kept to be reused by the next surfaces
+     * of a similar size.
+     *
+     * Since: 0.31
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_SURFACE_POOL_MEMORY,
+         g_param_spec_uint64("surface-pool-memory",
+                             "Surface pool memory",
+                             "Bytes held for display surfaces",
+                             0, G_MAXUINT64, 0,
+                             G_PARAM_READABLE |
+                             G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceSession:surface-pool-high-water:
+     *
+     * The most memory held for display surfaces at once, in bytes.
+     *
+     * Since: 0.31
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_SURFACE_POOL_HIGH_WATER,
+         g_param_spec_uint64("surface-pool-high-water",
+                             "Surface pool high-water mark",
+                             "Most bytes held for display surfaces",
+                             0, G_MAXUINT64, 0,
+                             G_PARAM_READABLE |
+                             G_PARAM_STATIC_STRINGS));
+
     g_type_class_add_private(klass, sizeof(SpiceSessionPrivate));
 }
 
@@ -1632,6 +1765,7 @@ static void cache_clear_all(SpiceSession *self)
 
     cache_clear(s->images);
     glz_decoder_window_clear(s->glz_window);
+    surface_pool_clear(s->surface_pool);
 }
 
 G_GNUC_INTERNAL
@@ -2484,6 +2618,14 @@ void spice_session_get_caches(SpiceSession *session,
         *glz_window = s->glz_window;
 }
 
+G_GNUC_INTERNAL
+SpiceSurfacePool *spice_session_get_surface_pool(SpiceSession *session)
+{
+    g_return_val_if_fail(SPICE_IS_SESSION(session), NULL);
+
+    return session->priv->surface_pool;
+}
+
 G_GNUC_INTERNAL
 void spice_session_set_caches_hints(SpiceSession *session,
                                     uint32_t pci_ram_size,
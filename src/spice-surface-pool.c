@@ -0,0 +1,253 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2010 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include <string.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#include "spice-util.h"
+#include "spice-surface-pool.h"
+
+/*
+ * Surface buffers are kept when released, so that the next surface of a
+ * similar size reuses one instead of having the kernel map and zero new
+ * pages. Buffers from SURFACE_POOL_HUGE_MIN on are mapped on their own,
+ * with huge pages when some are reserved, transparent huge pages
+ * otherwise, which saves TLB misses on the primary surface.
+ */
+
+#define SURFACE_POOL_PAGE       4096
+#define SURFACE_POOL_HUGE_PAGE  (2 * 1024 * 1024)
+#define SURFACE_POOL_HUGE_MIN   SURFACE_POOL_HUGE_PAGE
+
+#define ROUND_UP(size, align) (((size) + (align) - 1) & ~(gsize)((align) - 1))
+
+typedef struct surface_pool_block {
+    gpointer                    data;
+    gsize                       size;
+    gboolean                    mapped;
+} surface_pool_block;
+
+struct SpiceSurfacePool {
+    gint                        ref_count;
+    gsize                       max_idle_bytes;
+    /* released blocks, the most recently released first */
+    GQueue                      idle;
+    /* data -> block of the blocks in use */
+    GHashTable                  *used;
+    /* MAP_HUGETLB failed, no huge pages are reserved */
+    gboolean                    no_hugetlb;
+    surface_pool_stats          stats;
+};
+
+static surface_pool_block *surface_pool_block_new(SpiceSurfacePool *pool, gsize size)
+{
+    surface_pool_block *block = g_slice_new0(surface_pool_block);
+
+    block->size = size;
+
+#ifdef HAVE_SYS_MMAN_H
+    if (size >= SURFACE_POOL_HUGE_MIN) {
+        gpointer data = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+        if (!pool->no_hugetlb) {
+            data = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (data != MAP_FAILED)
+                pool->stats.huge_pages++;
+            else
+                pool->no_hugetlb = TRUE;
+        }
+#endif
+        if (data == MAP_FAILED) {
+            data = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#ifdef MADV_HUGEPAGE
+            if (data != MAP_FAILED)
+                madvise(data, size, MADV_HUGEPAGE);
+#endif
+        }
+        if (data != MAP_FAILED) {
+            /* anonymous mappings are zeroed */
+            block->data = data;
+            block->mapped = TRUE;
+            return block;
+        }
+    }
+#endif
+
+    block->data = g_malloc0(size);
+    return block;
+}
+
+static void surface_pool_block_free(surface_pool_block *block)
+{
+#ifdef HAVE_SYS_MMAN_H
+    if (block->mapped)
+        munmap(block->data, block->size);
+    else
+#endif
+        g_free(block->data);
+    g_slice_free(surface_pool_block, block);
+}
+
+/* frees the least recently released blocks beyond max bytes */
+static void surface_pool_trim(SpiceSurfacePool *pool, gsize max)
+{
+    while (pool->stats.idle_bytes > max) {
+        surface_pool_block *block = g_queue_pop_tail(&pool->idle);
+
+        pool->stats.idle_bytes -= block->size;
+        pool->stats.bytes -= block->size;
+        surface_pool_block_free(block);
+    }
+}
+
+G_GNUC_INTERNAL
+SpiceSurfacePool *surface_pool_new(gsize max_idle_bytes)
+{
+    SpiceSurfacePool *pool = g_new0(SpiceSurfacePool, 1);
+
+    pool->ref_count = 1;
+    pool->max_idle_bytes = max_idle_bytes;
+    g_queue_init(&pool->idle);
+    pool->used = g_hash_table_new(NULL, NULL);
+
+    return pool;
+}
+
+G_GNUC_INTERNAL
+SpiceSurfacePool *surface_pool_ref(SpiceSurfacePool *pool)
+{
+    g_return_val_if_fail(pool != NULL, NULL);
+
+    g_atomic_int_inc(&pool->ref_count);
+    return pool;
+}
+
+/* the blocks still in use are freed too */
+G_GNUC_INTERNAL
+void surface_pool_unref(SpiceSurfacePool *pool)
+{
+    GHashTableIter iter;
+    surface_pool_block *block;
+
+    g_return_if_fail(pool != NULL);
+
+    if (!g_atomic_int_dec_and_test(&pool->ref_count))
+        return;
+
+    surface_pool_trim(pool, 0);
+    g_hash_table_iter_init(&iter, pool->used);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&block))
+        surface_pool_block_free(block);
+    g_hash_table_unref(pool->used);
+    g_free(pool);
+}
+
+/* a zeroed buffer of size bytes, NULL when size is 0 */
+G_GNUC_INTERNAL
+gpointer surface_pool_alloc(SpiceSurfacePool *pool, gsize size)
+{
+    surface_pool_block *block;
+    GList *l, *best = NULL;
+    gsize alloc_size;
+
+    g_return_val_if_fail(pool != NULL, NULL);
+
+    if (size == 0)
+        return NULL;
+
+    alloc_size = size >= SURFACE_POOL_HUGE_MIN ?
+        ROUND_UP(size, SURFACE_POOL_HUGE_PAGE) : ROUND_UP(size, SURFACE_POOL_PAGE);
+
+    /* the smallest idle block that fits, unless it's more than twice
+     * as big; few blocks are idle at once */
+    for (l = pool->idle.head; l != NULL; l = l->next) {
+        surface_pool_block *b = l->data;
+
+        if (b->size < alloc_size || b->size / 2 > alloc_size)
+            continue;
+        if (best == NULL || b->size < ((surface_pool_block *)best->data)->size)
+            best = l;
+    }
+
+    if (best != NULL) {
+        block = best->data;
+        g_queue_delete_link(&pool->idle, best);
+        pool->stats.idle_bytes -= block->size;
+        pool->stats.hits++;
+        memset(block->data, 0, size);
+    } else {
+        block = surface_pool_block_new(pool, alloc_size);
+        pool->stats.misses++;
+        pool->stats.bytes += block->size;
+        pool->stats.high_water = MAX(pool->stats.high_water, pool->stats.bytes);
+    }
+
+    g_hash_table_insert(pool->used, block->data, block);
+    return block->data;
+}
+
+/* data is kept for reuse, as long as the idle blocks fit max_idle_bytes */
+G_GNUC_INTERNAL
+void surface_pool_release(SpiceSurfacePool *pool, gpointer data)
+{
+    surface_pool_block *block;
+
+    g_return_if_fail(pool != NULL);
+
+    if (data == NULL)
+        return;
+
+    block = g_hash_table_lookup(pool->used, data);
+    g_return_if_fail(block != NULL);
+    g_hash_table_remove(pool->used, data);
+
+    g_queue_push_head(&pool->idle, block);
+    pool->stats.idle_bytes += block->size;
+    surface_pool_trim(pool, pool->max_idle_bytes);
+}
+
+/* frees the idle blocks */
+G_GNUC_INTERNAL
+void surface_pool_clear(SpiceSurfacePool *pool)
+{
+    g_return_if_fail(pool != NULL);
+
+    SPICE_DEBUG("surface pool: %" G_GUINT64_FORMAT " hits, %" G_GUINT64_FORMAT
+                " misses, %" G_GUINT64_FORMAT " with huge pages, %" G_GSIZE_FORMAT
+                " bytes high-water",
+                pool->stats.hits, pool->stats.misses, pool->stats.huge_pages,
+                pool->stats.high_water);
+
+    surface_pool_trim(pool, 0);
+    /* huge pages may have been reserved since */
+    pool->no_hugetlb = FALSE;
+}
+
+G_GNUC_INTERNAL
+const surface_pool_stats *surface_pool_get_stats(SpiceSurfacePool *pool)
+{
+    g_return_val_if_fail(pool != NULL, NULL);
+
+    return &pool->stats;
+}
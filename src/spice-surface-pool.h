@@ -0,0 +1,50 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2010 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef SPICE_SURFACE_POOL_H_
+# define SPICE_SURFACE_POOL_H_
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct SpiceSurfacePool SpiceSurfacePool;
+
+typedef struct surface_pool_stats {
+    guint64     hits;
+    guint64     misses;
+    /* allocations backed by MAP_HUGETLB pages */
+    guint64     huge_pages;
+    /* held by the pool, in use or kept for reuse */
+    gsize       bytes;
+    /* kept for reuse */
+    gsize       idle_bytes;
+    /* the most bytes held at once */
+    gsize       high_water;
+} surface_pool_stats;
+
+SpiceSurfacePool *surface_pool_new(gsize max_idle_bytes);
+SpiceSurfacePool *surface_pool_ref(SpiceSurfacePool *pool);
+void surface_pool_unref(SpiceSurfacePool *pool);
+gpointer surface_pool_alloc(SpiceSurfacePool *pool, gsize size);
+void surface_pool_release(SpiceSurfacePool *pool, gpointer data);
+void surface_pool_clear(SpiceSurfacePool *pool);
+const surface_pool_stats *surface_pool_get_stats(SpiceSurfacePool *pool);
+
+G_END_DECLS
+
+#endif // SPICE_SURFACE_POOL_H_
@@ -23,6 +23,7 @@
 
 /* config */
 static gboolean version = FALSE;
+static gboolean json = FALSE;
 
 /* state */
 static SpiceSession  *session;
@@ -69,6 +70,12 @@ static GOptionEntry app_entries[] = {
         .arg_data         = &version,
         .description      = "Display version and quit",
     },
+    {
+        .long_name        = "json",
+        .arg              = G_OPTION_ARG_NONE,
+        .arg_data         = &json,
+        .description      = "Print the statistics of the channels as JSON",
+    },
     {
         /* end of list */
     }
@@ -119,7 +126,17 @@ int main(int argc, char *argv[])
     }
 
     g_main_loop_run(mainloop);
-    {
+    if (json) {
+        GList *iter, *list = spice_session_get_channels(session);
+        printf("[");
+        for (iter = list ; iter ; iter = iter->next) {
+            gchar *stats = spice_channel_get_stats(iter->data);
+            printf("%s\n%s", iter == list ? "" : ",", stats);
+            g_free(stats);
+        }
+        printf("\n]\n");
+        g_list_free(list);
+    } else {
         GList *iter, *list = spice_session_get_channels(session);
         gulong total_read_bytes;
         gint  channel_type;
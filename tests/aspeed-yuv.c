@@ -0,0 +1,142 @@
+#include <glib.h>
+#include <string.h>
+
+#include "channel-display-aspeed-yuv.h"
+
+/* the table driven conversion the ASPEED decoder used before the
+ * per-implementation kernels, kept here as the reference */
+#define FIX_G(d) (int)((double)d * 65536 + 0.5)
+
+static int ref_y[256];
+static int ref_cr_r[256];
+static int ref_cb_b[256];
+static int ref_cr_g[256];
+static int ref_cb_g[256];
+static gint8 ref_range_limit[1408];
+
+static void init_reference(void)
+{
+    int i;
+
+    for (i = 0; i < 256; i++) {
+        int j = i - 128;
+
+        ref_cr_r[i] = (FIX_G(1.597656) * j + 0x8000) >> 16;
+        ref_cb_b[i] = (FIX_G(2.015625) * j + 0x8000) >> 16;
+        ref_cr_g[i] = (-FIX_G(0.8125) * j + 0x8000) >> 16;
+        ref_cb_g[i] = (-FIX_G(0.390625) * j + 0x8000) >> 16;
+        ref_y[i] = (FIX_G(1.1639999999999999) * (i - 16) + 0x8000) >> 16;
+    }
+
+    memset(ref_range_limit, 0, 256);
+    for (i = 0; i < 256; i++)
+        ref_range_limit[256 + i] = i;
+    memset(ref_range_limit + 512, -1, 896 - 512);
+    memset(ref_range_limit + 896, 0, 1280 - 896);
+    for (i = 1280; i < 1408; i++)
+        ref_range_limit[i] = i;
+}
+
+static guint8 ref_limit(int v)
+{
+    return v >= 0 ? (guint8)ref_range_limit[v + 256] : 0;
+}
+
+static guint32 ref_pixel(guint8 y, guint8 cb, guint8 cr)
+{
+    guint8 b = ref_limit(ref_y[y] + ref_cb_b[cb]);
+    guint8 g = ref_limit(ref_y[y] + (ref_cb_g[cb] + ref_cr_g[cr]));
+    guint8 r = ref_limit(ref_y[y] + ref_cr_r[cr]);
+
+    return b | g << 8 | r << 16;
+}
+
+static void test_rows(void)
+{
+    AspeedYuvImpl impl;
+
+    for (impl = ASPEED_YUV_IMPL_C; impl < ASPEED_YUV_IMPL_LAST; impl++) {
+        AspeedYuvRowFunc row_func = aspeed_yuv_get_row_func(impl);
+        guint8 y[8], cb[8], cr[8];
+        guint32 out[8];
+        int Y, Cb, Cr, k;
+
+        if (row_func == NULL) {
+            g_test_message("%s not supported", aspeed_yuv_impl_to_string(impl));
+            continue;
+        }
+
+        /* every YCbCr triplet */
+        for (Y = 0; Y < 256; Y++) {
+            for (Cb = 0; Cb < 256; Cb++) {
+                for (Cr = 0; Cr < 256; Cr += 8) {
+                    for (k = 0; k < 8; k++) {
+                        y[k] = Y;
+                        cb[k] = Cb;
+                        cr[k] = Cr + k;
+                    }
+                    row_func(y, cb, cr, out);
+                    for (k = 0; k < 8; k++)
+                        g_assert_cmphex(out[k], ==, ref_pixel(Y, Cb, Cr + k));
+                }
+            }
+        }
+    }
+}
+
+static void test_tiles(void)
+{
+    AspeedYuvImpl impl;
+    guint8 tile[384];
+    guint32 out[16 * 16];
+    int i, x, y;
+
+    for (i = 0; i < G_N_ELEMENTS(tile); i++)
+        tile[i] = g_test_rand_int_range(0, 256);
+
+    for (impl = ASPEED_YUV_IMPL_C; impl < ASPEED_YUV_IMPL_LAST; impl++) {
+        AspeedYuvRowFunc row_func = aspeed_yuv_get_row_func(impl);
+
+        if (row_func == NULL)
+            continue;
+
+        /* 4:4:4, clipped to 5x3, written bottom-up */
+        memset(out, 0, sizeof(out));
+        aspeed_yuv_convert_tile(row_func, tile, FALSE, out + 7 * 8, -8, 5, 3);
+        for (y = 0; y < 8; y++) {
+            for (x = 0; x < 8; x++) {
+                guint32 expected = 0;
+                int k = y * 8 + x;
+
+                if (x < 5 && y < 3)
+                    expected = ref_pixel(tile[k], tile[64 + k], tile[128 + k]);
+                g_assert_cmphex(out[(7 - y) * 8 + x], ==, expected);
+            }
+        }
+
+        /* 4:2:0 */
+        aspeed_yuv_convert_tile(row_func, tile, TRUE, out, 16, 16, 16);
+        for (y = 0; y < 16; y++) {
+            for (x = 0; x < 16; x++) {
+                int block = (y >> 3) * 2 + (x >> 3);
+                guint8 Y = tile[block * 64 + (y & 7) * 8 + (x & 7)];
+                int c = (y >> 1) * 8 + (x >> 1);
+
+                g_assert_cmphex(out[y * 16 + x], ==,
+                                ref_pixel(Y, tile[256 + c], tile[320 + c]));
+            }
+        }
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    init_reference();
+
+    g_test_add_func("/aspeed-yuv/rows", test_rows);
+    g_test_add_func("/aspeed-yuv/tiles", test_tiles);
+
+    return g_test_run();
+}
@@ -0,0 +1,213 @@
+#include <glib.h>
+
+#include "spice-channel-cache.h"
+
+static int destroyed;
+
+static void value_destroy(gpointer value)
+{
+    destroyed++;
+    g_free(value);
+}
+
+static gpointer new_value(guint64 id)
+{
+    return g_memdup(&id, sizeof(id));
+}
+
+static void test_add_find_remove(void)
+{
+    display_cache *cache = cache_new("test", value_destroy);
+    gboolean lossy;
+    guint64 id;
+
+    destroyed = 0;
+    for (id = 0; id < 1000; id++)
+        cache_add_lossy(cache, id << 32, new_value(id), 16, id & 1);
+    g_assert_cmpuint(cache_get_stats(cache)->bytes, ==, 16000);
+
+    for (id = 0; id < 1000; id++) {
+        guint64 *value = cache_find_lossy(cache, id << 32, &lossy);
+
+        g_assert(value != NULL);
+        g_assert_cmpuint(*value, ==, id);
+        g_assert_cmpint(lossy, ==, id & 1);
+    }
+    g_assert(cache_find(cache, 1) == NULL);
+
+    /* replacing destroys the previous value */
+    cache_add(cache, 0, new_value(0), 16);
+    g_assert_cmpint(destroyed, ==, 1);
+
+    for (id = 0; id < 1000; id += 2)
+        g_assert(cache_remove(cache, id << 32));
+    g_assert(!cache_remove(cache, 0));
+    for (id = 0; id < 1000; id++)
+        g_assert((cache_find(cache, id << 32) != NULL) == (id & 1));
+    g_assert_cmpuint(cache_get_stats(cache)->bytes, ==, 8000);
+    g_assert_cmpuint(cache_get_stats(cache)->high_water, ==, 16000);
+
+    cache_clear(cache);
+    g_assert(cache_find(cache, 1ULL << 32) == NULL);
+    g_assert_cmpint(destroyed, ==, 1001);
+    cache_free(cache);
+}
+
+static void test_ref_counted(void)
+{
+    display_cache *cache = cache_image_new("test", value_destroy);
+
+    cache_add(cache, 42, new_value(42), 16);
+    cache_add(cache, 42, new_value(42), 16);
+    g_assert(cache_remove(cache, 42));
+    g_assert(cache_find(cache, 42) != NULL);
+    g_assert(cache_remove(cache, 42));
+    g_assert(cache_find(cache, 42) == NULL);
+    cache_free(cache);
+}
+
+static void test_evict(void)
+{
+    display_cache *cache = cache_new("test", value_destroy);
+
+    cache_set_max_bytes(cache, 30);
+    cache_add(cache, 1, new_value(1), 10);
+    cache_add(cache, 2, new_value(2), 10);
+    cache_add(cache, 3, new_value(3), 10);
+    /* 2 becomes the least recently used */
+    g_assert(cache_find(cache, 1) != NULL);
+    cache_add(cache, 4, new_value(4), 10);
+
+    g_assert(cache_find(cache, 2) == NULL);
+    g_assert(cache_find(cache, 1) != NULL);
+    g_assert(cache_find(cache, 3) != NULL);
+    g_assert(cache_find(cache, 4) != NULL);
+    g_assert_cmpuint(cache_get_stats(cache)->evictions, ==, 1);
+    g_assert_cmpuint(cache_get_stats(cache)->bytes, ==, 30);
+    cache_free(cache);
+}
+
+static void test_stats(void)
+{
+    display_cache *cache = cache_new("test", NULL);
+    GString *json = g_string_new(NULL);
+
+    cache_add(cache, 1, GINT_TO_POINTER(1), 10);
+    g_assert(cache_find(cache, 1) != NULL);
+    g_assert(cache_find(cache, 2) == NULL);
+    /* peeking doesn't count */
+    g_assert(cache_peek(cache, 1) != NULL);
+    g_assert(cache_peek(cache, 2) == NULL);
+    g_assert_cmpuint(cache_get_stats(cache)->hits, ==, 1);
+    g_assert_cmpuint(cache_get_stats(cache)->misses, ==, 1);
+
+    cache_stats_to_json(cache, json);
+    g_assert_cmpstr(json->str, ==,
+                    "\"test\":{\"hits\":1,\"misses\":1,\"evictions\":0,"
+                    "\"bytes\":10,\"high-water\":10}");
+    g_string_free(json, TRUE);
+    cache_free(cache);
+}
+
+static void count_notify(gpointer data)
+{
+    (*(int *)data)++;
+}
+
+static void test_waiters(void)
+{
+    display_cache *cache = cache_new("test", NULL);
+    int notified = 0;
+    display_cache_waiter waiter = {
+        .id = 7,
+        .notify = count_notify,
+        .data = &notified
+    };
+
+    cache_add_waiter(cache, &waiter);
+    cache_add(cache, 6, GINT_TO_POINTER(6), 1);
+    g_assert_cmpint(notified, ==, 0);
+    cache_add(cache, 7, GINT_TO_POINTER(7), 1);
+    g_assert_cmpint(notified, ==, 1);
+    cache_remove_waiter(cache, &waiter);
+    cache_add(cache, 7, GINT_TO_POINTER(7), 1);
+    g_assert_cmpint(notified, ==, 1);
+    cache_free(cache);
+}
+
+/* the GHashTable based cache it replaced */
+typedef struct {
+    guint64 id;
+    gboolean lossy;
+    guint32 ref_count;
+} hash_item;
+
+static void hash_item_free(gpointer item)
+{
+    g_slice_free(hash_item, item);
+}
+
+#define BENCH_IDS 4096
+#define BENCH_ROUNDS 200
+
+static void test_benchmark(void)
+{
+    display_cache *cache = cache_new("bench", NULL);
+    GHashTable *table = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                              hash_item_free, NULL);
+    static guint64 ids[BENCH_IDS];
+    gdouble cache_time, table_time;
+    int i, round;
+
+    for (i = 0; i < BENCH_IDS; i++)
+        ids[i] = ((guint64)g_test_rand_int() << 32) | g_test_rand_int();
+
+    g_test_timer_start();
+    for (round = 0; round < BENCH_ROUNDS; round++) {
+        for (i = 0; i < BENCH_IDS; i++)
+            cache_add(cache, ids[i], GINT_TO_POINTER(i + 1), 1);
+        for (i = 0; i < BENCH_IDS; i++)
+            g_assert(cache_find(cache, ids[i]) == GINT_TO_POINTER(i + 1));
+        for (i = 0; i < BENCH_IDS; i++)
+            cache_remove(cache, ids[i]);
+    }
+    cache_time = g_test_timer_elapsed();
+
+    g_test_timer_start();
+    for (round = 0; round < BENCH_ROUNDS; round++) {
+        for (i = 0; i < BENCH_IDS; i++) {
+            hash_item *item = g_slice_new(hash_item);
+
+            item->id = ids[i];
+            item->lossy = FALSE;
+            item->ref_count = 1;
+            g_hash_table_replace(table, item, GINT_TO_POINTER(i + 1));
+        }
+        for (i = 0; i < BENCH_IDS; i++)
+            g_assert(g_hash_table_lookup(table, &ids[i]) == GINT_TO_POINTER(i + 1));
+        for (i = 0; i < BENCH_IDS; i++)
+            g_hash_table_remove(table, &ids[i]);
+    }
+    table_time = g_test_timer_elapsed();
+
+    g_test_minimized_result(cache_time, "display_cache: %.3f s", cache_time);
+    g_test_message("GHashTable: %.3f s", table_time);
+
+    g_hash_table_unref(table);
+    cache_free(cache);
+}
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/cache/add-find-remove", test_add_find_remove);
+    g_test_add_func("/cache/ref-counted", test_ref_counted);
+    g_test_add_func("/cache/evict", test_evict);
+    g_test_add_func("/cache/stats", test_stats);
+    g_test_add_func("/cache/waiters", test_waiters);
+    if (g_test_perf())
+        g_test_add_func("/cache/benchmark", test_benchmark);
+
+    return g_test_run();
+}
@@ -0,0 +1,82 @@
+#include <string.h>
+#include <glib.h>
+
+#include "spice-channel-stats.h"
+
+static void test_histogram(void)
+{
+    channel_histogram h;
+
+    memset(&h, 0, sizeof(h));
+    channel_histogram_add(&h, 0);
+    channel_histogram_add(&h, 1);
+    channel_histogram_add(&h, 3);
+    channel_histogram_add(&h, 4);
+    channel_histogram_add(&h, -5);
+    channel_histogram_add(&h, G_GINT64_CONSTANT(1) << 40);
+
+    g_assert_cmpuint(h.count, ==, 6);
+    g_assert_cmpuint(h.max, ==, G_GUINT64_CONSTANT(1) << 40);
+    /* negative times, from a clock going back, count as 0 */
+    g_assert_cmpuint(h.buckets[0], ==, 2);
+    g_assert_cmpuint(h.buckets[1], ==, 1);
+    g_assert_cmpuint(h.buckets[2], ==, 1);
+    g_assert_cmpuint(h.buckets[3], ==, 1);
+    g_assert_cmpuint(h.buckets[CHANNEL_HISTOGRAM_BUCKETS - 1], ==, 1);
+}
+
+static void test_types(void)
+{
+    channel_stats stats;
+    channel_type_stats *t;
+
+    channel_stats_init(&stats);
+    channel_stats_add_rx(&stats, 101, 20);
+    channel_stats_add_rx(&stats, 101, 30);
+    channel_stats_add_handler(&stats, 101, 7);
+    channel_stats_add_tx(&stats, 3, 10);
+
+    t = channel_stats_get_type(stats.rx, 101);
+    g_assert_cmpuint(t->messages, ==, 2);
+    g_assert_cmpuint(t->bytes, ==, 50);
+    g_assert_cmpuint(t->handler.count, ==, 1);
+    g_assert(g_ptr_array_index(stats.rx, 100) == NULL);
+    g_assert_cmpuint(channel_stats_get_type(stats.tx, 3)->bytes, ==, 10);
+    channel_stats_clear(&stats);
+}
+
+static void test_json(void)
+{
+    channel_stats stats;
+    GString *json = g_string_new(NULL);
+
+    channel_stats_init(&stats);
+    channel_stats_add_rx(&stats, 2, 10);
+    channel_stats_add_handler(&stats, 2, 3);
+    channel_stats_add_rx(&stats, 5, 6);
+
+    channel_stats_types_to_json(stats.rx, TRUE, json);
+    g_assert_cmpstr(json->str, ==,
+                    "{\"2\":{\"messages\":1,\"bytes\":10,\"handler\":"
+                    "{\"count\":1,\"total-us\":3,\"max-us\":3,\"buckets\":[0,0,1]}},"
+                    "\"5\":{\"messages\":1,\"bytes\":6,\"handler\":"
+                    "{\"count\":0,\"total-us\":0,\"max-us\":0,\"buckets\":[]}}}");
+
+    g_string_truncate(json, 0);
+    channel_stats_types_to_json(stats.tx, FALSE, json);
+    g_assert_cmpstr(json->str, ==, "{}");
+
+    g_string_free(json, TRUE);
+    channel_stats_clear(&stats);
+}
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/channel-stats/histogram", test_histogram);
+    g_test_add_func("/channel-stats/types", test_types);
+    g_test_add_func("/channel-stats/json", test_json);
+
+    return g_test_run();
+}
@@ -0,0 +1,105 @@
+#include <glib.h>
+#include <string.h>
+
+#include "spice-surface-pool.h"
+
+#define MB (1024 * 1024)
+
+static gboolean is_zero(const guint8 *data, gsize size)
+{
+    gsize i;
+
+    for (i = 0; i < size; i++)
+        if (data[i] != 0)
+            return FALSE;
+    return TRUE;
+}
+
+static void test_reuse(void)
+{
+    SpiceSurfacePool *pool = surface_pool_new(64 * MB);
+    const surface_pool_stats *stats = surface_pool_get_stats(pool);
+    guint8 *a, *b;
+
+    g_assert(surface_pool_alloc(pool, 0) == NULL);
+
+    a = surface_pool_alloc(pool, 1920 * 1080 * 4);
+    g_assert(is_zero(a, 1920 * 1080 * 4));
+    memset(a, 0xff, 1920 * 1080 * 4);
+    surface_pool_release(pool, a);
+    g_assert_cmpuint(stats->idle_bytes, >=, 1920 * 1080 * 4);
+
+    /* a bit smaller reuses the buffer, zeroed again */
+    b = surface_pool_alloc(pool, 1920 * 1050 * 4);
+    g_assert(b == a);
+    g_assert(is_zero(b, 1920 * 1050 * 4));
+    g_assert_cmpuint(stats->hits, ==, 1);
+    g_assert_cmpuint(stats->idle_bytes, ==, 0);
+
+    /* less than half the size doesn't */
+    surface_pool_release(pool, b);
+    a = surface_pool_alloc(pool, 800 * 600 * 4);
+    g_assert(a != b);
+    g_assert(is_zero(a, 800 * 600 * 4));
+    g_assert_cmpuint(stats->misses, ==, 2);
+
+    surface_pool_release(pool, a);
+    surface_pool_clear(pool);
+    g_assert_cmpuint(stats->idle_bytes, ==, 0);
+    g_assert_cmpuint(stats->bytes, ==, 0);
+    g_assert_cmpuint(stats->high_water, >=, (1920 * 1080 + 800 * 600) * 4);
+    surface_pool_unref(pool);
+}
+
+static void test_best_fit(void)
+{
+    SpiceSurfacePool *pool = surface_pool_new(64 * MB);
+    gpointer small = surface_pool_alloc(pool, 64 * 1024);
+    gpointer big = surface_pool_alloc(pool, 100 * 1024);
+
+    surface_pool_release(pool, big);
+    surface_pool_release(pool, small);
+    g_assert(surface_pool_alloc(pool, 60 * 1024) == small);
+    g_assert(surface_pool_alloc(pool, 60 * 1024) == big);
+    surface_pool_unref(pool);
+}
+
+static void test_trim(void)
+{
+    SpiceSurfacePool *pool = surface_pool_new(3 * MB);
+    const surface_pool_stats *stats = surface_pool_get_stats(pool);
+    gpointer a = surface_pool_alloc(pool, 2 * MB);
+    gpointer b = surface_pool_alloc(pool, 2 * MB);
+
+    g_assert_cmpuint(stats->bytes, ==, 4 * MB);
+    surface_pool_release(pool, a);
+    surface_pool_release(pool, b);
+    /* a, the least recently released, is freed */
+    g_assert_cmpuint(stats->idle_bytes, ==, 2 * MB);
+    g_assert_cmpuint(stats->bytes, ==, 2 * MB);
+    g_assert(surface_pool_alloc(pool, 2 * MB) == b);
+    surface_pool_unref(pool);
+}
+
+static void test_ref(void)
+{
+    SpiceSurfacePool *pool = surface_pool_new(MB);
+    gpointer data = surface_pool_alloc(pool, 4096);
+
+    surface_pool_ref(pool);
+    surface_pool_unref(pool);
+    surface_pool_release(pool, data);
+    surface_pool_unref(pool);
+}
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/surface-pool/reuse", test_reuse);
+    g_test_add_func("/surface-pool/best-fit", test_best_fit);
+    g_test_add_func("/surface-pool/trim", test_trim);
+    g_test_add_func("/surface-pool/ref", test_ref);
+
+    return g_test_run();
+}